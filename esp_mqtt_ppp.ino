@@ -2,12 +2,41 @@
  * esp_mqtt_ppp_web_clean_with_clients.ino
  *
  * ESP8266 (Wemos D1):
- *  - Optional SoftAP + simple web UI (status, AP client IPs, config, boot diagnostics, telemetry)
- *  - PPPoS over UART0 (Serial) as WAN uplink
- *  - TinyMqtt broker on :1883 with time-sliced loop
+ *  - Optional SoftAP + simple web UI (status, AP client IPs, config, boot diagnostics, telemetry),
+ *    streamed with chunked transfer from a small stack buffer (no page String)
+ *  - Optional MQTT bridge (BRIDGE_ENABLE): local publishes are queued in a RAM outbox
+ *    and written upstream in coalesced TCP writes on the raw lwIP tcp API (non-blocking
+ *    connect, writes bounded by tcp_sndbuf, records popped when ACKed); reconnect
+ *    follows the PPP backoff
+ *  - Optional flash spool (SPOOL_ENABLE): bridge overflow during outages goes to LittleFS
+ *    in page-sized appends and is replayed as spool/<age_ms>/<topic> after reconnect
+ *  - Bridge topic selection (BRIDGE_TOPICS/BRIDGE_EXCLUDE) via a static trie with fixed
+ *    node and label pools; pool exhaustion and the max-free-block low-water mark in [TEL]
+ *  - AP client cap and a per-device bridge rate limit (token bucket, latest value per
+ *    topic held back) stored in EEPROM and edited on the web page
+ *  - Link compression options (PPP_VJ, PPP_PFC_ACFC, PPP_ACCM) and the TX wire/IP byte
+ *    ratio in [TEL]
+ *  - Telemetry history: 16-byte samples in a fine ring plus a downsampled coarse ring,
+ *    downloadable as /tel.csv and /tel.bin (replaces the last [TEL] line/netif String)
+ *  - LCP echo keepalive (PPP_LCP_ECHO_INTERVAL/FAILS); PPP events are handled every
+ *    scheduler pass, a dropped link reconnects at once; recovery-time histogram
+ *  - Boot profiling: micros() per setup phase and time to PPP up / first publish in
+ *    BootDiag; broker and PPP start before AP and web, no fixed delays, and the
+ *    EEPROM commit is deferred out of setup() and skipped when nothing changed
+ *  - /api/status as JSON or CBOR from a snapshot taken at telemetry time, with ETag
+ *  - PPPoS over UART0 (Serial) as WAN uplink; RX via the UART ISR into a large ring
+ *    (PPP_RX_BUF), fed to lwIP in bounded chunks; overrun/error counters in [TEL]
+ *  - PPP TX through a ring drained without blocking (UART FIFO free space only);
+ *    queue depth, drops and stall time in [TEL]
+ *  - PPP speed negotiation with the host script ("AT+BAUD=<rate>", fallback 115200)
+ *    and optional RTS/CTS hardware flow control (PPP_HW_FLOW)
+ *  - TinyMqtt broker on :1883; loop() is a small cooperative scheduler: PPP RX runs
+ *    between all other slices, per-task budgets and micros() run-time stats on the web UI
  *  - Health monitor + PPP reconnect backoff (no work in PPP callbacks)
  *
- * Notes (no NAT):
+ *  - Optional NAPT for AP clients onto the PPP link (PPP_NAT_ENABLE)
+ *
+ * Notes (default build, no NAT):
  *  - The device is a PPP client; it does not NAT/forward AP clients to PPP.
  *  - Use AP for setup/telemetry only, or add a route for 192.168.4.0/24 on the PPP peer.
  */
@@ -15,6 +44,8 @@
 #include <ESP8266WiFi.h>
 #include <ESP8266WebServer.h>
 #include <EEPROM.h>
+#include <stdarg.h>
+#include <LittleFS.h>
 #include "TinyMqtt.h"
 
 extern "C" {
@@ -25,8 +56,10 @@ extern "C" {
   #include "netif/ppp/ppp.h"
   #include "netif/ppp/pppos.h"
   #include "lwip/etharp.h"
+  #include "lwip/napt.h"
   #include "lwip/ip4.h"
   #include "lwip/ip4_addr.h"
+  #include "lwip/tcp.h"
   #include "user_interface.h"
 }
 
@@ -36,6 +69,164 @@ extern "C" {
 #ifndef AP_ENABLE
 #define AP_ENABLE 1
 #endif
+#ifndef AP_MAX_CLIENTS
+#define AP_MAX_CLIENTS 4          // default station cap (1..8), editable on the web page
+#endif
+
+// PPP RX: UART0 is drained by the core's RX interrupt into a ring of PPP_RX_BUF
+// bytes (~PPP_RX_BUF/11.5 ms of line time at 115200), so slow broker/web calls
+// no longer overflow the 128-byte hardware FIFO. servicePPP() feeds pppos_input()
+// at most PPP_RX_CHUNK bytes at a time, up to PPP_RX_CHUNKS_PER_LOOP times per
+// scheduler slice and within the slice budget.
+#ifndef PPP_RX_BUF
+#define PPP_RX_BUF 4096
+#endif
+#ifndef PPP_RX_CHUNK
+#define PPP_RX_CHUNK 256
+#endif
+#ifndef PPP_RX_CHUNKS_PER_LOOP
+#define PPP_RX_CHUNKS_PER_LOOP 8
+#endif
+
+// PPP TX: frames from lwIP are queued in a ring of PPP_TX_BUF bytes (power of two)
+// and written only as far as the UART TX FIFO has room, so a large publish never
+// blocks the loop in Serial.write(). Back-to-back frames coalesce in the ring. A
+// frame that does not fit is dropped (TCP retransmits) instead of busy-waiting.
+#ifndef PPP_TX_BUF
+#define PPP_TX_BUF 4096
+#endif
+
+// PPP speed: the link starts at PPP_BAUD. While PPP is not up the host may send
+// "AT" (reply "OK") to probe the current rate, or "AT+BAUD=<rate>" (reply
+// "OK <rate>", then switch). The new rate sticks once "AT" arrives at it within
+// PPP_BAUD_CONFIRM_MS; otherwise, and after PPP_BAUD_REVERT_MS without PPP, we
+// fall back to PPP_BAUD. The host probes before every dial (pppd connect
+// script usr/local/sbin/ppp-wemos.sh), so a reset here only costs one redial.
+#ifndef PPP_BAUD_NEGOTIATE
+#define PPP_BAUD_NEGOTIATE 1
+#endif
+#define PPP_BAUD_CONFIRM_MS 1500
+#define PPP_BAUD_REVERT_MS  60000
+
+// MQTT bridge: a local TinyMqtt client subscribes to "#" and every publish is
+// encoded as an MQTT PUBLISH into a RAM outbox of BRIDGE_OUTBOX bytes (oldest
+// dropped when full). The outbox is written to the upstream broker (default: the
+// PPP peer, i.e. mosquitto on the host) in one TCP write per BRIDGE_FLUSH_MS or
+// BRIDGE_FLUSH_BYTES, and survives PPP outages shorter than it can buffer.
+#ifndef BRIDGE_ENABLE
+#define BRIDGE_ENABLE 0
+#endif
+#ifndef BRIDGE_HOST
+#define BRIDGE_HOST ""            // "" = PPP peer address
+#endif
+#ifndef BRIDGE_PORT
+#define BRIDGE_PORT 1883
+#endif
+#ifndef BRIDGE_OUTBOX
+#define BRIDGE_OUTBOX 8192
+#endif
+#ifndef BRIDGE_FLUSH_MS
+#define BRIDGE_FLUSH_MS 200
+#endif
+#ifndef BRIDGE_FLUSH_BYTES
+#define BRIDGE_FLUSH_BYTES 1024
+#endif
+#ifndef BRIDGE_STALE_MS
+#define BRIDGE_STALE_MS 2000      // older messages are sent as spool/<age_ms>/<topic>
+#endif
+#define BRIDGE_MAX_PACKET  1024   // larger publishes are not bridged
+// Which local topics go upstream: comma-separated MQTT filters, matched with a
+// static trie (TRIE_NODES levels, labels in a TRIE_ARENA byte arena, no heap).
+#ifndef BRIDGE_TOPICS
+#define BRIDGE_TOPICS "#"
+#endif
+#ifndef BRIDGE_EXCLUDE
+#define BRIDGE_EXCLUDE ""         // e.g. "+/rssi,diag/#"
+#endif
+#define TRIE_NODES 48
+#define TRIE_ARENA 384
+// Per-device rate limit on the bridge (defaults; editable on the web page).
+// A device is the first topic level (OpenBeken: the device name). Over its
+// token bucket, the latest value per topic is held back, older ones are dropped.
+#ifndef BRIDGE_RL_RATE
+#define BRIDGE_RL_RATE 10         // messages/s per device, 0 = unlimited
+#endif
+#ifndef BRIDGE_RL_BURST
+#define BRIDGE_RL_BURST 20
+#endif
+#define RL_SOURCES       8        // devices tracked (least recently seen is reused)
+#define RL_PENDING       8        // coalesced topics held back
+#define RL_PENDING_BYTES 128      // topic + payload per held-back message
+
+// Flash spool (needs BRIDGE_ENABLE): while the bridge is down, records that no
+// longer fit the RAM outbox go to LittleFS in SPOOL_PAGE-sized appends and are
+// replayed after reconnect with their age, so the collector keeps event times.
+#ifndef SPOOL_ENABLE
+#define SPOOL_ENABLE 0
+#endif
+#ifndef SPOOL_MAX_BYTES
+#define SPOOL_MAX_BYTES (256UL * 1024)
+#endif
+#define SPOOL_PAGE 1024
+#define SPOOL_FILE "/spool.bin"
+#if SPOOL_ENABLE && !BRIDGE_ENABLE
+#error "SPOOL_ENABLE requires BRIDGE_ENABLE"
+#endif
+#define BRIDGE_KEEPALIVE_S 60
+
+// Hardware flow control on UART0: CTS = GPIO13 (D7), RTS = GPIO15 (D8); TX/RX stay on
+// GPIO1/3 (no Serial.swap). The on-board CH340 does not route RTS/CTS, so wire the
+// adapter's RTS -> D7 and CTS <- D8 and use WEMOS_CRTSCTS=1 on the host.
+#ifndef PPP_HW_FLOW
+#define PPP_HW_FLOW 0
+#endif
+#define PPP_HW_FLOW_THRESH 96   // assert RTS when the 128-byte RX FIFO holds this many bytes
+
+// Link compression. Van Jacobson TCP/IP header compression shrinks the 40-byte
+// headers of small MQTT publishes to 3-5 bytes; it needs an lwIP build with
+// VJ_SUPPORT, otherwise IPCP just runs without it. PFC/ACFC drop 3 bytes of PPP
+// framing. PPP_ACCM is the set of control characters we ask the peer to escape:
+// 0 is fine on a raw 8-bit line with XON/XOFF off on both sides.
+#ifndef PPP_VJ
+#define PPP_VJ 1
+#endif
+#define PPP_VJ_SLOTS 16          // connection slots (lwIP MAX_SLOTS is the upper bound)
+#ifndef PPP_PFC_ACFC
+#define PPP_PFC_ACFC 1
+#endif
+#ifndef PPP_ACCM
+#define PPP_ACCM 0x00000000UL
+#endif
+
+// Dead-link detection: lwIP sends an LCP Echo-Request every PPP_LCP_ECHO_INTERVAL
+// seconds and drops the link after PPP_LCP_ECHO_FAILS unanswered ones (0 = off).
+// The drop is handled on the next scheduler pass and reconnects at once.
+#ifndef PPP_LCP_ECHO_INTERVAL
+#define PPP_LCP_ECHO_INTERVAL 1
+#endif
+#ifndef PPP_LCP_ECHO_FAILS
+#define PPP_LCP_ECHO_FAILS 3
+#endif
+
+// BootDiag (and anything else put into EEPROM) reaches flash this long after boot,
+// not inside setup(): a sector write stalls the CPU for tens of ms, which would
+// delay the first LCP exchange. A crash before then loses this boot's counter
+// bump only; the next boot still records the reset reason.
+#ifndef BOOTDIAG_COMMIT_MS
+#define BOOTDIAG_COMMIT_MS 10000
+#endif
+
+// NAT: masquerade AP clients behind the PPP address, so the host needs neither a
+// route to 192.168.4.0/24 nor the NAT rules below. Needs AP_ENABLE and an lwIP
+// variant with IP_NAPT (Tools > lwIP Variant: "v2 Lower Memory" or "Higher Bandwidth").
+#ifndef PPP_NAT_ENABLE
+#define PPP_NAT_ENABLE 0
+#endif
+#define PPP_NAT_MAX     256      // NAPT table entries (about 30 bytes each)
+#define PPP_NAT_PORTMAP 8
+#if PPP_NAT_ENABLE && !AP_ENABLE
+#error "PPP_NAT_ENABLE requires AP_ENABLE"
+#endif
 
 // ============================== Runtime config ================================
 
@@ -56,15 +247,32 @@ IPAddress ap_ip(192,168,4,1), ap_gw(192,168,4,1), ap_mask(255,255,255,0);
 #define SSID_ADDR   0
 #define PASS_ADDR   32
 #define DIAG_ADDR   96
+#define CFG_ADDR    224
 #define MAX_SSID    31
 #define MAX_PASS    31
 
 static const uint32_t HEALTH_EVERY_MS    = 3000;
+
+// Scheduler slice budgets (us). Tasks cannot be preempted; a slice that runs
+// longer is counted as an overrun. Tasks that can split their work (PPP RX)
+// stop early when sliceExpired().
+static const uint16_t SLICE_PPP_US    = 2000;
+static const uint16_t SLICE_MQTT_US   = 5000;
+static const uint16_t SLICE_HTTP_US   = 20000;
+static const uint16_t SLICE_HEALTH_US = 20000;
 static const uint32_t TELEMETRY_EVERY_MS = 30000;
+// Telemetry history: TEL_FINE records at TELEMETRY_EVERY_MS (~64 min), and
+// TEL_COARSE records folded from TEL_COARSE_EVERY fine ones each (~25 h).
+#define TEL_FINE         128
+#define TEL_COARSE       192
+#define TEL_COARSE_EVERY 16
 
 // ============================== Globals =======================================
 
 MqttBroker broker(MQTT_PORT);
+#if BRIDGE_ENABLE
+MqttClient bridgeLocal(&broker, "bridge");
+#endif
 static unsigned long lastMQTTLoopTouchMs = 0;
 static bool mqttEverBegan = false;
 
@@ -78,18 +286,48 @@ static struct netif ppp_netif;
 static unsigned long lastHealthTickMs = 0;
 static unsigned long lastTelemetryMs  = 0;
 
-static String g_lastTelLine;
-static String g_lastNetifDump;
 
 // PPP deferred/backoff state
 static volatile bool g_ppp_up_flag  = false;
 static volatile bool g_ppp_err_flag = false;
 static volatile int  g_ppp_err_code = 0;
+static uint32_t      g_ppp_down_events = 0;        // error events consumed (link drops)
+static bool          g_ppp_was_up = false;         // last event was UP: reconnect without delay
+
+// Time from link loss to the next UP event; upper bucket bounds in ms.
+static const uint32_t PPP_RECOVERY_BOUNDS_MS[] = { 500, 1000, 2000, 5000, 10000, 30000, 60000 };
+static const uint8_t  PPP_RECOVERY_BUCKETS = sizeof(PPP_RECOVERY_BOUNDS_MS) / sizeof(PPP_RECOVERY_BOUNDS_MS[0]) + 1;
+static uint32_t       g_ppp_recovery_hist[PPP_RECOVERY_BUCKETS] = {};
+static uint32_t       g_ppp_recovery_last_ms = 0, g_ppp_recovery_max_ms = 0;
 
 static unsigned long g_ppp_next_reconnect_ms = 0;
 static uint16_t      g_ppp_reconnect_backoff_ms = 500;  // start small
 static const uint16_t PPP_BACKOFF_MAX_MS = 10000;
 
+// PPP RX integrity counters (shown in [TEL])
+static uint32_t g_ppp_rx_bytes    = 0;
+static uint32_t g_ppp_rx_overruns = 0;   // RX ring full, bytes lost (software)
+static uint32_t g_ppp_rx_errors   = 0;   // FIFO overflow / framing / parity (hardware)
+static uint16_t g_ppp_rx_hwm      = 0;   // highest ring fill seen by servicePPP()
+
+// PPP TX ring (single context: lwIP output and loop() both run on the SDK task)
+static uint8_t       g_ppp_tx_ring[PPP_TX_BUF];
+static uint16_t      g_ppp_tx_head = 0, g_ppp_tx_tail = 0;   // free-running, masked on use
+static uint16_t      g_ppp_tx_hwm = 0;
+static uint32_t      g_ppp_tx_drops = 0;          // output callbacks refused (ring full)
+static uint32_t      g_ppp_tx_stall_ms = 0;       // total time the ring had no room
+static unsigned long g_ppp_tx_stall_since_ms = 0; // != 0: currently full
+static bool          g_ppp_tx_resync = false;     // frame tail dropped: start the next with a flag
+
+// Compression ratio: IP bytes handed to the PPP netif vs HDLC bytes accepted for the UART
+static netif_output_fn g_ppp_ip_output = nullptr;  // lwIP's ppp_netif_output_ip4
+static uint32_t      g_ppp_tx_ip_bytes = 0, g_ppp_tx_wire_bytes = 0;
+
+// Negotiated PPP speed
+static uint32_t      g_ppp_baud = PPP_BAUD;
+static unsigned long g_ppp_baud_confirm_by_ms = 0;   // != 0: waiting for "AT" at the new rate
+static unsigned long g_ppp_down_since_ms = 0;        // != 0: PPP not up since then
+
 #if AP_ENABLE
 // AP credentials (persisted)
 char ap_ssid[MAX_SSID+1] = AP_SSID;
@@ -98,6 +336,10 @@ char ap_pass[MAX_PASS+1] = AP_PASS;
 
 // ======================= Persistent Boot Diagnostics ==========================
 
+// setup() phases in bring-up order; BOOT_PRE is the time before setup() (ROM, SDK, core).
+enum BootPhase : uint8_t { BOOT_PRE, BOOT_EEPROM, BOOT_PPP, BOOT_MQTT, BOOT_BRIDGE, BOOT_AP, BOOT_WEB, BOOT_PHASES };
+static const char* const BOOT_PHASE_NAMES[BOOT_PHASES] = { "pre", "eeprom", "ppp", "mqtt", "bridge", "ap", "web" };
+
 struct BootDiag {
   uint32_t magic;       // 0xB00DDA7A
   uint32_t reason;
@@ -105,58 +347,101 @@ struct BootDiag {
   uint32_t epc1, epc2, epc3, excvaddr, depc;
   uint32_t flashKB, cpuMHz, sketchKB, freeSketchKB;
   uint32_t bootCount;
+  uint32_t phaseUs[BOOT_PHASES];   // this boot, micros() per phase
+  uint32_t pppUpMs;                // millis() at the first PPP up, 0 = not yet
+  uint32_t firstPubMs;             // millis() at the first local publish (bridge builds), 0 = not yet
 };
 static const uint32_t BOOTDIAG_MAGIC = 0xB00DDA7A;
 static BootDiag g_bootdiag = {};
+static uint32_t g_boot_mark_us = 0;
+static bool     g_eeprom_dirty = false;
+static bool     g_bootdiag_committed = false;
+
+// Ends the current setup() phase.
+static void bootPhase(BootPhase p) {
+  const uint32_t now = micros();
+  g_bootdiag.phaseUs[p] = now - g_boot_mark_us;
+  g_boot_mark_us = now;
+}
+static uint32_t bootSetupUs() {
+  uint32_t us = 0;
+  for (uint8_t i = BOOT_PRE + 1; i < BOOT_PHASES; ++i) us += g_bootdiag.phaseUs[i];
+  return us;
+}
+
+// Byte-wise put that only touches (and marks for commit) bytes that differ.
+static void eepromPutBytes(int addr, const void* data, size_t len) {
+  const uint8_t* b = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < len; ++i) {
+    if (EEPROM.read(addr + i) != b[i]) { EEPROM.write(addr + i, b[i]); g_eeprom_dirty = true; }
+  }
+}
+static void eepromCommit() { if (g_eeprom_dirty && EEPROM.commit()) g_eeprom_dirty = false; }
 
 static void loadBootDiag() {
   BootDiag tmp = {};
   EEPROM.get(DIAG_ADDR, tmp);
   if (tmp.magic == BOOTDIAG_MAGIC) g_bootdiag = tmp;
 }
-static void saveBootDiag() { EEPROM.put(DIAG_ADDR, g_bootdiag); EEPROM.commit(); }
+static void saveBootDiag() { eepromPutBytes(DIAG_ADDR, &g_bootdiag, sizeof(g_bootdiag)); }   // committed later
+
+// Settings from the web page; defaults apply until the first save.
+struct NetCfg {
+  uint32_t magic;       // 0xC0F16001
+  uint8_t  maxClients;  // softAP station cap
+  uint8_t  rlRate;      // bridge messages/s per device, 0 = off
+  uint8_t  rlBurst;
+  uint8_t  reserved;
+};
+static const uint32_t NETCFG_MAGIC = 0xC0F16001;
+static NetCfg g_cfg = { NETCFG_MAGIC, AP_MAX_CLIENTS, BRIDGE_RL_RATE, BRIDGE_RL_BURST, 0 };
+static_assert(DIAG_ADDR + sizeof(BootDiag) <= CFG_ADDR && CFG_ADDR + sizeof(NetCfg) <= EEPROM_SIZE, "EEPROM layout");
+
+static void loadNetCfg() {
+  NetCfg tmp = {};
+  EEPROM.get(CFG_ADDR, tmp);
+  if (tmp.magic == NETCFG_MAGIC) g_cfg = tmp;
+  if (g_cfg.maxClients < 1 || g_cfg.maxClients > 8) g_cfg.maxClients = AP_MAX_CLIENTS;
+  if (g_cfg.rlBurst < 1) g_cfg.rlBurst = 1;
+}
+static void saveNetCfg() { g_cfg.magic = NETCFG_MAGIC; eepromPutBytes(CFG_ADDR, &g_cfg, sizeof(g_cfg)); }   // committed by the caller
 
 // ============================= Netif Utils ====================================
 
-static void dump_netifs_to(String& out, const char* tag) {
-  out += "[NETIF] ";
-  out += tag;
-  out += "\n";
-
-  for (netif* n = netif_list; n; n = n->next) {
+// One "  #n xx  ip=.. gw=.. mask=.. flags=.." line (with newline) into line[cap].
+static void netifLine(const netif* n, char* line, size_t cap) {
 #if LWIP_IPV4
-    const ip4_addr_t* ip = netif_ip4_addr(n);
-    const ip4_addr_t* gw = netif_ip4_gw(n);
-    const ip4_addr_t* mk = netif_ip4_netmask(n);
-
-    // Re-entrant conversion buffers (enough for IPv4 "255.255.255.255" + NUL)
-    char ipbuf[16], gwbuf[16], mkbuf[16];
-    ip4addr_ntoa_r(ip, ipbuf, sizeof(ipbuf));
-    ip4addr_ntoa_r(gw, gwbuf, sizeof(gwbuf));
-    ip4addr_ntoa_r(mk, mkbuf, sizeof(mkbuf));
+  const ip4_addr_t* ip = netif_ip4_addr(n);
+  const ip4_addr_t* gw = netif_ip4_gw(n);
+  const ip4_addr_t* mk = netif_ip4_netmask(n);
+
+  // Re-entrant conversion buffers (enough for IPv4 "255.255.255.255" + NUL)
+  char ipbuf[16], gwbuf[16], mkbuf[16];
+  ip4addr_ntoa_r(ip, ipbuf, sizeof(ipbuf));
+  ip4addr_ntoa_r(gw, gwbuf, sizeof(gwbuf));
+  ip4addr_ntoa_r(mk, mkbuf, sizeof(mkbuf));
 #else
-    // Fallback (shouldn't happen on ESP8266/lwIP2, which is IPv4)
-    const char* ipbuf = "0.0.0.0";
-    const char* gwbuf = "0.0.0.0";
-    const char* mkbuf = "0.0.0.0";
+  // Fallback (shouldn't happen on ESP8266/lwIP2, which is IPv4)
+  const char* ipbuf = "0.0.0.0";
+  const char* gwbuf = "0.0.0.0";
+  const char* mkbuf = "0.0.0.0";
 #endif
 
-    char line[192];
-    // Keep your original layout; add quick state hints (UP/LINK) at the end
-    snprintf(line, sizeof(line),
-             "  #%u %c%c  ip=%s gw=%s mask=%s flags=0x%02x%s%s\n",
-             n->num, n->name[0], n->name[1],
-             ipbuf, gwbuf, mkbuf, n->flags,
-             netif_is_up(n) ? " UP" : "",
-             netif_is_link_up(n) ? " LINK" : "");
-
-    out += line;
-  }
+  // Keep your original layout; add quick state hints (UP/LINK) at the end
+  snprintf(line, cap,
+           "  #%u %c%c  ip=%s gw=%s mask=%s flags=0x%02x%s%s\n",
+           n->num, n->name[0], n->name[1],
+           ipbuf, gwbuf, mkbuf, n->flags,
+           netif_is_up(n) ? " UP" : "",
+           netif_is_link_up(n) ? " LINK" : "");
 }
 
-
-
-static void dump_netifs(const char* tag) { String tmp; dump_netifs_to(tmp, tag); Serial1.print(tmp); }
+static void dump_netifs(const char* tag) {
+  Serial1.printf("[NETIF] %s\n", tag);
+  char line[192];
+  for (netif* n = netif_list; n; n = n->next) { netifLine(n, line, sizeof(line)); Serial1.print(line); }
+}
+static netif* findPPP() { for (netif* n = netif_list; n; n = n->next) if (n->name[0]=='p'&&n->name[1]=='p') return n; return nullptr; }
 
 // ============================== AP Bring-up ===================================
 
@@ -168,33 +453,103 @@ static void loadAPConfig() {
   if (ap_ssid[0]==0xFF || ap_ssid[0]=='\0') strcpy(ap_ssid,AP_SSID);
   if (ap_pass[0]==0xFF || ap_pass[0]=='\0') strcpy(ap_pass,AP_PASS);
   loadBootDiag(); // persisted boot diagnostics
+  loadNetCfg();
 }
 static void saveAPConfig(const char* ssid,const char* pass){
   memset(ap_ssid,0,sizeof(ap_ssid)); memset(ap_pass,0,sizeof(ap_pass));
   strncpy(ap_ssid,ssid,MAX_SSID); strncpy(ap_pass,pass,MAX_PASS);
-  EEPROM.put(SSID_ADDR,ap_ssid); EEPROM.put(PASS_ADDR,ap_pass); EEPROM.commit();
+  eepromPutBytes(SSID_ADDR, ap_ssid, sizeof(ap_ssid)); eepromPutBytes(PASS_ADDR, ap_pass, sizeof(ap_pass));
+  saveBootDiag(); eepromCommit();
+}
+#if PPP_NAT_ENABLE
+static bool g_nat_on = false;
+
+// The NAPT flag goes on the inside (AP) netif; forwarded packets take the
+// address of whatever netif they leave through, so PPP address changes are fine.
+static void setupNAT() {
+  static bool inited = false;
+  if (!inited) { ip_napt_init(PPP_NAT_MAX, PPP_NAT_PORTMAP); inited = true; }
+  g_nat_on = (ip_napt_enable_no(SOFTAP_IF, 1) == ERR_OK);
+  Serial1.printf("[NAT] %s (table %u, portmaps %u)\n", g_nat_on ? "AP -> PPP enabled" : "enable FAILED",
+                 (unsigned)PPP_NAT_MAX, (unsigned)PPP_NAT_PORTMAP);
 }
+#endif
+
 static void setupAP() {
   WiFi.mode(WIFI_AP);
   WiFi.softAPConfig(ap_ip, ap_gw, ap_mask);
-  if (!WiFi.softAP(ap_ssid, ap_pass, AP_CHANNEL, false, 4)) {   // max 4 clients
+  if (!WiFi.softAP(ap_ssid, ap_pass, AP_CHANNEL, false, g_cfg.maxClients)) {
     Serial1.println("[AP] start FAILED");
   } else {
-    Serial1.printf("[AP] %s up at %s\n", ap_ssid, WiFi.softAPIP().toString().c_str());
+    Serial1.printf("[AP] %s up at %s (max %u clients)\n", ap_ssid, WiFi.softAPIP().toString().c_str(), (unsigned)g_cfg.maxClients);
   }
   wifi_set_sleep_type(NONE_SLEEP_T);
+#if PPP_NAT_ENABLE
+  setupNAT();
+#endif
   dump_netifs("after softAP");
 }
 #else
 static void loadAPConfig() {
   EEPROM.begin(EEPROM_SIZE);
   loadBootDiag(); // still persist boot diagnostics even without AP config
+  loadNetCfg();
 }
 #endif
 
 // ========================= PPP Bring-up =======================================
 
-static u32_t ppp_output_cb(ppp_pcb *, u8_t *data, u32_t len, void *) { return Serial.write(data, len); }
+static_assert((PPP_TX_BUF & (PPP_TX_BUF - 1)) == 0 && PPP_TX_BUF <= 32768, "PPP_TX_BUF must be a power of two <= 32768");
+
+static inline uint16_t pppTxDepth() { return (uint16_t)(g_ppp_tx_head - g_ppp_tx_tail); }
+
+// Move as much as the TX FIFO accepts right now; never waits.
+static void pppTxDrain() {
+  while (pppTxDepth()) {
+    int room = Serial.availableForWrite();
+    if (room <= 0) break;
+    const uint16_t at = g_ppp_tx_tail & (PPP_TX_BUF - 1);
+    uint16_t n = pppTxDepth();
+    if (n > PPP_TX_BUF - at) n = PPP_TX_BUF - at;   // up to the wrap
+    if ((int)n > room) n = (uint16_t)room;
+    Serial.write(g_ppp_tx_ring + at, n);
+    g_ppp_tx_tail += n;
+  }
+  if (g_ppp_tx_stall_since_ms && pppTxDepth() < PPP_TX_BUF / 2) {
+    g_ppp_tx_stall_ms += millis() - g_ppp_tx_stall_since_ms;
+    g_ppp_tx_stall_since_ms = 0;
+  }
+}
+
+// Only for rare control traffic (speed change): wait until the ring is empty.
+static void pppTxDrainAll() { while (pppTxDepth()) { pppTxDrain(); yield(); } }
+
+static bool pppTxPut(const uint8_t* data, uint32_t len) {
+  const uint32_t need = len + (g_ppp_tx_resync ? 1 : 0);
+  if (need > (uint32_t)(PPP_TX_BUF - pppTxDepth())) {
+    if (!g_ppp_tx_stall_since_ms) g_ppp_tx_stall_since_ms = millis() ? millis() : 1;
+    g_ppp_tx_drops++;
+    g_ppp_tx_resync = true;
+    return false;
+  }
+  if (g_ppp_tx_resync) { g_ppp_tx_ring[g_ppp_tx_head++ & (PPP_TX_BUF - 1)] = 0x7E; g_ppp_tx_resync = false; }
+  const uint16_t at = g_ppp_tx_head & (PPP_TX_BUF - 1);
+  const uint32_t first = (len < (uint32_t)(PPP_TX_BUF - at)) ? len : (uint32_t)(PPP_TX_BUF - at);
+  memcpy(g_ppp_tx_ring + at, data, first);
+  memcpy(g_ppp_tx_ring, data + first, len - first);
+  g_ppp_tx_head += (uint16_t)len;
+  if (pppTxDepth() > g_ppp_tx_hwm) g_ppp_tx_hwm = pppTxDepth();
+  return true;
+}
+
+// lwIP may hand over one HDLC frame in several pieces; a refused piece makes
+// pppos count an output error and the peer discards the frame by FCS.
+static u32_t ppp_output_cb(ppp_pcb *, u8_t *data, u32_t len, void *) {
+  if (!pppTxPut(data, len)) return 0;
+  g_ppp_tx_wire_bytes += len;
+  pppTxDrain();     // start right away if the FIFO has room
+  return len;
+}
 
 // PPP status callback: NO LOGGING HERE (defer to main loop)
 static void ppp_status_cb(ppp_pcb *, int err_code, void *) {
@@ -207,116 +562,578 @@ static void ppp_status_cb(ppp_pcb *, int err_code, void *) {
   }
 }
 
+// Counts IP bytes in front of the PPP netif; VJ and framing happen behind it.
+static err_t pppCountOutput(netif* n, pbuf* p, const ip4_addr_t* ip) {
+  g_ppp_tx_ip_bytes += p->tot_len;
+  return g_ppp_ip_output(n, p, ip);
+}
+
+// Wemos-side LCP/IPCP wishes; lwIP's defaults are set in pppos_create(), and
+// the want/allow options persist across ppp_connect() retries.
+static void setupPPPCompression() {
+  lcp_options& lw = ppp->lcp_wantoptions;
+  lcp_options& la = ppp->lcp_allowoptions;
+  lw.neg_asyncmap = 1; lw.asyncmap = PPP_ACCM; la.neg_asyncmap = 1;
+  lw.neg_pcompression = lw.neg_accompression = PPP_PFC_ACFC;
+  la.neg_pcompression = la.neg_accompression = PPP_PFC_ACFC;
+#if VJ_SUPPORT
+  ipcp_options& iw = ppp->ipcp_wantoptions;
+  iw.neg_vj = ppp->ipcp_allowoptions.neg_vj = PPP_VJ;
+  iw.vj_protocol = IPCP_VJ_COMP;
+  iw.maxslotindex = PPP_VJ_SLOTS - 1;
+  iw.cflag = 1;                                // allow connection-ID compression
+#elif PPP_VJ
+  Serial1.println("[PPP] VJ requested but lwIP was built without VJ_SUPPORT");
+#endif
+  if (ppp_netif.output != pppCountOutput) { g_ppp_ip_output = ppp_netif.output; ppp_netif.output = pppCountOutput; }
+}
+
+// "tx"/"rx" per direction in which VJ was negotiated, "-" for neither.
+static const char* pppVjState() {
+#if VJ_SUPPORT
+  if (ppp) {
+    const bool tx = ppp->ipcp_hisoptions.neg_vj, rx = ppp->ipcp_gotoptions.neg_vj;  // his: we compress
+    if (tx || rx) return tx && rx ? "tx+rx" : tx ? "tx" : "rx";
+  }
+#endif
+  return "-";
+}
+
+static void setupPPPFlowControl() {
+#if PPP_HW_FLOW
+  pinMode(13, FUNCTION_4);   // U0CTS
+  pinMode(15, FUNCTION_4);   // U0RTS
+  USC0(0) |= (1 << UCTXHFE);
+  USC1(0) = (USC1(0) & ~(0x7F << UCRXHFT)) | ((PPP_HW_FLOW_THRESH & 0x7F) << UCRXHFT) | (1 << UCRXHFE);
+#endif
+}
+
 static void setupPPP() {
-  Serial.begin(PPP_BAUD); delay(50);
+  Serial.setRxBufferSize(PPP_RX_BUF);   // must precede begin(); no-op if unchanged
+  Serial.begin(g_ppp_baud);
+  setupPPPFlowControl();                // begin() rewrites the UART config registers
   ppp = pppos_create(&ppp_netif, ppp_output_cb, ppp_status_cb, nullptr);
   if (!ppp) { Serial1.println("[PPP] create FAILED"); return; }
 #if defined(PPPAUTHTYPE_NONE)
   ppp_set_auth(ppp, PPPAUTHTYPE_NONE, "", "");
 #endif
+  setupPPPCompression();
+  ppp->settings.lcp_echo_interval = PPP_LCP_ECHO_INTERVAL;
+  ppp->settings.lcp_echo_fails    = PPP_LCP_ECHO_FAILS;
   ppp_set_default(ppp);
   ppp_connect(ppp, 0);
   Serial1.println("[PPP] connecting...");
 }
 
+// ------------------------------ Speed negotiation ------------------------------
+
+static const uint32_t PPP_BAUD_RATES[] = { 115200, 230400, 460800, 921600, 1500000, 2000000 };
+
+static void pppSetBaud(uint32_t baud) {
+  pppTxDrainAll();
+  Serial.flush();                // let the reply leave at the old rate
+  Serial.updateBaudRate(baud);
+  g_ppp_baud = baud;
+}
+
+static void pppBaudReply(const char* s) { pppTxPut((const uint8_t*)s, strlen(s)); pppTxDrain(); }
+
+static void pppBaudCommand(const char* cmd) {
+  if (strcmp(cmd, "AT") == 0) {
+    pppBaudReply("OK\r\n");
+    if (g_ppp_baud_confirm_by_ms) {
+      g_ppp_baud_confirm_by_ms = 0;
+      Serial1.printf("[PPP] speed %lu confirmed\n", (unsigned long)g_ppp_baud);
+    }
+    return;
+  }
+  if (strncmp(cmd, "AT+BAUD=", 8) != 0) return;
+  uint32_t want = strtoul(cmd + 8, nullptr, 10);
+  for (uint32_t r : PPP_BAUD_RATES) {
+    if (r != want) continue;
+    char ok[24]; snprintf(ok, sizeof(ok), "OK %lu\r\n", (unsigned long)want);
+    pppBaudReply(ok);
+    pppSetBaud(want);
+    g_ppp_baud_confirm_by_ms = millis() + PPP_BAUD_CONFIRM_MS;
+    if (!g_ppp_baud_confirm_by_ms) g_ppp_baud_confirm_by_ms = 1;
+    return;
+  }
+  pppBaudReply("ERROR\r\n");
+}
+
+// Looks for AT lines in the byte stream while PPP is not up. The bytes still
+// go to pppos_input(), which ignores anything outside HDLC flags.
+static void pppBaudScan(const uint8_t* p, size_t n) {
+  static char line[24];
+  static uint8_t len = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const char c = (char)p[i];
+    if (c == '\r' || c == '\n') {
+      line[len] = '\0';
+      if (len) pppBaudCommand(line);
+      len = 0;
+    } else if (c >= 0x20 && c < 0x7f && len < sizeof(line) - 1) {
+      line[len++] = c;
+    } else {
+      len = 0;                   // binary PPP data: drop the partial line
+    }
+  }
+}
+
+static void pppBaudService() {
+  if (g_ppp_baud_confirm_by_ms && (int32_t)(millis() - g_ppp_baud_confirm_by_ms) >= 0) {
+    g_ppp_baud_confirm_by_ms = 0;
+    Serial1.printf("[PPP] speed %lu not confirmed -> back to %lu\n", (unsigned long)g_ppp_baud, PPP_BAUD);
+    pppSetBaud(PPP_BAUD);
+  }
+}
+
+// ============================ Chunked page writer =============================
+
+// Pages are streamed with chunked transfer encoding: text collects in a small
+// stack buffer and goes out as one chunk when full; large constant blocks are
+// sent straight from flash. No String is built, so a page costs ~PAGE_CHUNK
+// bytes of stack plus the web server's own send buffers.
+static const size_t PAGE_CHUNK = 512;
+
+struct PageOut {
+  char   buf[PAGE_CHUNK];
+  size_t n = 0;
+
+  void flush() { if (n) { server.sendContent(buf, n); n = 0; } }
+  void put(const char* s, size_t len) {
+    while (len) {
+      size_t k = (len < PAGE_CHUNK - n) ? len : PAGE_CHUNK - n;
+      memcpy(buf + n, s, k); n += k; s += k; len -= k;
+      if (n == PAGE_CHUNK) flush();
+    }
+  }
+  void put(const char* s) { put(s, strlen(s)); }
+  void put(const __FlashStringHelper* f) {          // F("...") literals
+    PGM_P p = reinterpret_cast<PGM_P>(f);
+    size_t len = strlen_P(p);
+    while (len) {
+      size_t k = (len < PAGE_CHUNK - n) ? len : PAGE_CHUNK - n;
+      memcpy_P(buf + n, p, k); n += k; p += k; len -= k;
+      if (n == PAGE_CHUNK) flush();
+    }
+  }
+  void putBlockP(PGM_P p) { flush(); server.sendContent_P(p); }   // big PROGMEM block
+  __attribute__((format(printf, 2, 3))) void printf(const char* fmt, ...) {
+    char tmp[160];
+    va_list ap; va_start(ap, fmt);
+    int len = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if (len > 0) put(tmp, (size_t)len < sizeof(tmp) ? (size_t)len : sizeof(tmp) - 1);
+  }
+};
+
+static void pageBegin(const char* type) {
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, type, "");
+}
+static void pageEnd(PageOut& out) { out.flush(); server.sendContent(""); }
+
 // ========================= Safe AP client list (IPs) ==========================
 
 #if AP_ENABLE
-static void buildClientIPsHTML(String& out) {
+static void buildClientIPsHTML(PageOut& out) {
   // Only attempt if AP is active
-  if (!(WiFi.getMode() & WIFI_AP)) { out += F("<p>AP not active.</p>"); return; }
+  if (!(WiFi.getMode() & WIFI_AP)) { out.put(F("<p>AP not active.</p>")); return; }
 
   const int count = wifi_softap_get_station_num();
-  out += F("<h3>Connected AP Clients</h3>");
-  out += F("<p>Count: "); out += String(count); out += F("</p>");
+  out.printf("<h3>Connected AP Clients</h3><p>Count: %d</p>", count);
 
-  if (count <= 0) { out += F("<ul></ul>"); return; }
+  if (count <= 0) { out.put(F("<ul></ul>")); return; }
 
-  // Copy IPs from SDK list into a temporary array, then free the list immediately.
-  struct station_info* list = wifi_softap_get_station_info();
+  // Copy IPs from the SDK list into a small fixed array, then free the list immediately.
+  enum { MAX_LISTED = 8 };
+  uint32_t ips[MAX_LISTED];
   int copied = 0;
-  IPAddress* ips = (count > 0) ? new IPAddress[count] : nullptr;
-
-  for (struct station_info* s = list; s && copied < count; s = STAILQ_NEXT(s, next)) {
-    ips[copied++] = IPAddress(s->ip.addr);
+  struct station_info* list = wifi_softap_get_station_info();
+  for (struct station_info* s = list; s && copied < MAX_LISTED; s = STAILQ_NEXT(s, next)) {
+    ips[copied++] = s->ip.addr;
   }
   wifi_softap_free_station_info(); // release SDK memory promptly
 
-  out += F("<ul>");
+  out.put(F("<ul>"));
   for (int i = 0; i < copied; ++i) {
-    out += F("<li>"); out += ips[i].toString(); out += F("</li>");
+    const uint8_t* b = reinterpret_cast<const uint8_t*>(&ips[i]);
+    out.printf("<li>%u.%u.%u.%u</li>", b[0], b[1], b[2], b[3]);
   }
-  out += F("</ul>");
-
-  delete[] ips;
+  out.put(F("</ul>"));
 }
 #endif
 
 // ================================ Web UI ======================================
 
+// Scheduler stats (defined with the scheduler below)
+static void buildSchedHTML(PageOut& out);
+static void schedResetStats();
+static void buildTelHTML(PageOut& out);
+#if BRIDGE_ENABLE
+static void buildBridgeHTML(PageOut& out);
+#endif
+
+#if PPP_NAT_ENABLE
+#define PAGE_TITLE "Wemos PPP (NAT)"
+#else
+#define PAGE_TITLE "Wemos PPP (no NAT)"
+#endif
+
+static const char PAGE_HEAD[] PROGMEM =
+  "<html><head><title>" PAGE_TITLE "</title>"
+  "<meta name='viewport' content='width=device-width,initial-scale=1'/>"
+  "<style>body{font-family:system-ui,Segoe UI,Roboto,Arial,sans-serif;margin:0;padding:12px;}"
+  "pre{background:#111;color:#eee;padding:8px;white-space:pre-wrap;word-break:break-word;border-radius:6px}"
+  "a{color:#06c;text-decoration:none}a:hover{text-decoration:underline}"
+  "h1,h2,h3{margin:8px 0 6px}</style></head><body>"
+  "<h1>" PAGE_TITLE "</h1>";
+
+static const char PAGE_NAT_NOTE[] PROGMEM =
+#if PPP_NAT_ENABLE
+  "<p><em>Note:</em> NAT is enabled. AP clients reach the PPP side from the Wemos' PPP address; "
+  "they are not reachable from there unless you add port maps.</p>";
+#else
+  "<p><em>Note:</em> NAT is disabled. AP clients will <strong>not</strong> be forwarded to the PPP link. "
+  "Use the AP for device setup/telemetry only, or add a route for 192.168.4.0/24 on your PPP peer if you want reachability from that side.</p>";
+#endif
+
 static void handleRoot() {
-  String html; html.reserve(9000);
-  html += F("<html><head><title>Wemos PPP (no NAT)</title>"
-            "<meta name='viewport' content='width=device-width,initial-scale=1'/>"
-            "<style>body{font-family:system-ui,Segoe UI,Roboto,Arial,sans-serif;margin:0;padding:12px;}"
-            "pre{background:#111;color:#eee;padding:8px;white-space:pre-wrap;word-break:break-word;border-radius:6px}"
-            "a{color:#06c;text-decoration:none}a:hover{text-decoration:underline}"
-            "h1,h2,h3{margin:8px 0 6px}</style></head><body>");
-  html += F("<h1>Wemos PPP (no NAT)</h1>");
+  pageBegin("text/html");
+  PageOut out;
+  out.putBlockP(PAGE_HEAD);
 
 #if AP_ENABLE
-  html += F("<h2>Access Point</h2>");
-  html += F("<p>AP SSID: "); html += ap_ssid; html += F("</p>");
-  buildClientIPsHTML(html);
+  out.put(F("<h2>Access Point</h2><p>AP SSID: ")); out.put(ap_ssid); out.put(F("</p>"));
+  buildClientIPsHTML(out);
 #else
-  html += F("<p>AP: <em>disabled at compile time</em></p>");
+  out.put(F("<p>AP: <em>disabled at compile time</em></p>"));
 #endif
 
   // PPP IP display
-  netif* p = nullptr; for (netif* it = netif_list; it; it = it->next) if (it->name[0]=='p' && it->name[1]=='p') { p = it; break; }
+  netif* p = findPPP();
   if (p && netif_is_up(p)) {
-    html += F("<h2>PPP Link</h2><p>PPP IP: ");
-    html += ipaddr_ntoa(netif_ip4_addr(p));
-    html += F("</p>");
-  }
-
-  html += F("<p><em>Note:</em> NAT is disabled. AP clients will <strong>not</strong> be forwarded to the PPP link. "
-            "Use the AP for device setup/telemetry only, or add a route for 192.168.4.0/24 on your PPP peer if you want reachability from that side.</p>");
-
-  html += F("<h2>Boot Diagnostics (persisted)</h2><pre>");
-  html += "BootCount: " + String(g_bootdiag.bootCount) + "\n";
-  html += "Reason   : " + String(g_bootdiag.reason) + "\n";
-  html += "exccause : " + String(g_bootdiag.exccause) + "\n";
-  html += "epc1     : 0x" + String(g_bootdiag.epc1, HEX) + "\n";
-  html += "epc2     : 0x" + String(g_bootdiag.epc2, HEX) + "\n";
-  html += "epc3     : 0x" + String(g_bootdiag.epc3, HEX) + "\n";
-  html += "excvaddr : 0x" + String(g_bootdiag.excvaddr, HEX) + "\n";
-  html += "depc     : 0x" + String(g_bootdiag.depc, HEX) + "\n";
-  html += "CPU MHz  : " + String(g_bootdiag.cpuMHz) + "\n";
-  html += "Flash KB : " + String(g_bootdiag.flashKB) + "\n";
-  html += "Sketch KB: " + String(g_bootdiag.sketchKB) + "\n";
-  html += "FreeSK KB: " + String(g_bootdiag.freeSketchKB) + "\n";
-  html += F("</pre>");
-
-  html += F("<h2>Telemetry Snapshot</h2><pre>");
-  html += g_lastTelLine; html += F("\n"); html += g_lastNetifDump; html += F("</pre>");
+    char ipbuf[16];
+    ip4addr_ntoa_r(netif_ip4_addr(p), ipbuf, sizeof(ipbuf));
+    out.printf("<h2>PPP Link</h2><p>PPP IP: %s</p>", ipbuf);
+  } else {
+    out.put(F("<h2>PPP Link</h2><p>PPP down</p>"));
+  }
+  out.printf("<pre>LCP echo %us x %u, drops %lu, recovery last %lu ms, max %lu ms\n",
+             (unsigned)PPP_LCP_ECHO_INTERVAL, (unsigned)PPP_LCP_ECHO_FAILS, (unsigned long)g_ppp_down_events,
+             (unsigned long)g_ppp_recovery_last_ms, (unsigned long)g_ppp_recovery_max_ms);
+  for (uint8_t i = 0; i < PPP_RECOVERY_BUCKETS; ++i) {
+    if (i + 1 < PPP_RECOVERY_BUCKETS) out.printf("  <%5lu ms %6lu\n", (unsigned long)PPP_RECOVERY_BOUNDS_MS[i], (unsigned long)g_ppp_recovery_hist[i]);
+    else out.printf("  >=%4lu s  %6lu\n", (unsigned long)(PPP_RECOVERY_BOUNDS_MS[i - 1] / 1000), (unsigned long)g_ppp_recovery_hist[i]);
+  }
+  out.put(F("</pre>"));
+
+  out.putBlockP(PAGE_NAT_NOTE);
+
+  out.put(F("<h2>Boot Diagnostics (persisted)</h2><pre>"));
+  out.printf("BootCount: %lu\nReason   : %lu\nexccause : %lu\n",
+             (unsigned long)g_bootdiag.bootCount, (unsigned long)g_bootdiag.reason, (unsigned long)g_bootdiag.exccause);
+  out.printf("epc1     : 0x%lx\nepc2     : 0x%lx\nepc3     : 0x%lx\nexcvaddr : 0x%lx\ndepc     : 0x%lx\n",
+             (unsigned long)g_bootdiag.epc1, (unsigned long)g_bootdiag.epc2, (unsigned long)g_bootdiag.epc3,
+             (unsigned long)g_bootdiag.excvaddr, (unsigned long)g_bootdiag.depc);
+  out.printf("CPU MHz  : %lu\nFlash KB : %lu\nSketch KB: %lu\nFreeSK KB: %lu\n",
+             (unsigned long)g_bootdiag.cpuMHz, (unsigned long)g_bootdiag.flashKB,
+             (unsigned long)g_bootdiag.sketchKB, (unsigned long)g_bootdiag.freeSketchKB);
+  out.put(F("Boot us  :"));
+  for (uint8_t i = 0; i < BOOT_PHASES; ++i) out.printf(" %s=%lu", BOOT_PHASE_NAMES[i], (unsigned long)g_bootdiag.phaseUs[i]);
+  out.printf("\nsetup us : %lu\nPPP up ms: %lu\n1st pub  : %lu ms\n", (unsigned long)bootSetupUs(),
+             (unsigned long)g_bootdiag.pppUpMs, (unsigned long)g_bootdiag.firstPubMs);
+  out.put(F("</pre>"));
+
+  buildSchedHTML(out);
+#if BRIDGE_ENABLE
+  buildBridgeHTML(out);
+#endif
+
+  buildTelHTML(out);
+
+#if AP_ENABLE
+  out.put(F("<h2>Set AP Parameters</h2>"
+            "<form method='POST' action='/setap'>SSID: <input name='ssid' value='"));
+  out.put(ap_ssid); out.put(F("'><br>Password: <input name='pass' value='"));
+  out.put(ap_pass); out.printf("'><br>Max clients (1-8): <input name='maxsta' size='2' value='%u'>", (unsigned)g_cfg.maxClients);
+#if BRIDGE_ENABLE
+  out.printf("<br>Bridge limit per device: <input name='rate' size='3' value='%u'> msg/s (0 = off), "
+             "burst <input name='burst' size='3' value='%u'>", (unsigned)g_cfg.rlRate, (unsigned)g_cfg.rlBurst);
+#endif
+  out.put(F("<br><input type='submit' value='Save & Reboot'></form>"));
+#endif
+
+  out.put(F("<h2>Reset</h2><form method='POST' action='/reset'><input type='submit' value='Reboot'></form>"));
+
+  out.put(F("</body></html>"));
+  pageEnd(out);
+}
+
+// ============================ Telemetry history ===============================
+
+// 16-byte samples, no heap. Counters are deltas since the previous sample so
+// a coarse record can sum them; heap values saturate at 65535.
+struct TelRec {
+  uint32_t upS;
+  uint16_t heap, maxBlk;
+  uint8_t  frag, sta;
+  uint8_t  flags;               // TEL_F_*
+  uint8_t  pppDowns;            // PPP error events
+  uint16_t uartErr;             // RX ring overruns + UART FIFO/framing errors
+  uint16_t txDrops;             // PPP TX ring refusals
+};
+static_assert(sizeof(TelRec) == 16, "TelRec must stay 16 bytes (tel.bin format)");
+enum : uint8_t { TEL_F_PPP = 0x01, TEL_F_AP = 0x02, TEL_F_BRIDGE = 0x04, TEL_F_NAT = 0x08 };
+
+struct TelRing {
+  TelRec*  r;
+  uint16_t cap, head, count;
+  void push(const TelRec& t) { r[head] = t; head = (head + 1) % cap; if (count < cap) count++; }
+  const TelRec& at(uint16_t i) const { return r[(head + cap - count + i) % cap]; }   // 0 = oldest
+};
+static TelRec  g_tel_fine_buf[TEL_FINE], g_tel_coarse_buf[TEL_COARSE];
+static TelRing g_tel_fine   = { g_tel_fine_buf,   TEL_FINE,   0, 0 };
+static TelRing g_tel_coarse = { g_tel_coarse_buf, TEL_COARSE, 0, 0 };
+static TelRec  g_tel_acc;                            // coarse record being folded
+static uint8_t g_tel_acc_n = 0;
+
+static inline uint16_t sat16(uint32_t v) { return v > 0xFFFF ? 0xFFFF : (uint16_t)v; }
+
+static void telAdd(const TelRec& t) {
+  g_tel_fine.push(t);
+  if (!g_tel_acc_n) {
+    g_tel_acc = t;
+  } else {                                           // worst case over the period, summed deltas
+    TelRec& a = g_tel_acc;
+    a.upS = t.upS; a.flags = t.flags;
+    if (t.heap < a.heap) a.heap = t.heap;
+    if (t.maxBlk < a.maxBlk) a.maxBlk = t.maxBlk;
+    if (t.frag > a.frag) a.frag = t.frag;
+    if (t.sta > a.sta) a.sta = t.sta;
+    a.pppDowns = (uint8_t)((a.pppDowns + t.pppDowns > 0xFF) ? 0xFF : a.pppDowns + t.pppDowns);
+    a.uartErr = sat16((uint32_t)a.uartErr + t.uartErr);
+    a.txDrops = sat16((uint32_t)a.txDrops + t.txDrops);
+  }
+  if (++g_tel_acc_n == TEL_COARSE_EVERY) { g_tel_coarse.push(g_tel_acc); g_tel_acc_n = 0; }
+}
+
+static void telCsvRows(PageOut& out, const TelRing& ring, char tier) {
+  for (uint16_t i = 0; i < ring.count; ++i) {
+    const TelRec& t = ring.at(i);
+    out.printf("%c,%lu,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u\n", tier, (unsigned long)t.upS, t.heap, t.maxBlk,
+               t.frag, t.sta, !!(t.flags & TEL_F_PPP), !!(t.flags & TEL_F_AP), !!(t.flags & TEL_F_BRIDGE),
+               !!(t.flags & TEL_F_NAT), t.pppDowns, t.uartErr, t.txDrops);
+  }
+}
+
+// Oldest first: the coarse tier ("c"), then the fine tier ("f").
+static void handleTelCsv() {
+  server.sendHeader("Content-Disposition", "attachment; filename=tel.csv");
+  pageBegin("text/csv");
+  PageOut out;
+  out.put(F("tier,up_s,heap,maxblk,frag,sta,ppp,ap,bridge,nat,ppp_downs,uart_err,tx_drops\n"));
+  telCsvRows(out, g_tel_coarse, 'c');
+  telCsvRows(out, g_tel_fine, 'f');
+  pageEnd(out);
+}
+
+// "WTEL", version, record size, coarse count, fine count, coarse factor,
+// period (s); then the coarse and the fine records, oldest first, little-endian.
+static void handleTelBin() {
+  server.sendHeader("Content-Disposition", "attachment; filename=tel.bin");
+  pageBegin("application/octet-stream");
+  PageOut out;
+  struct __attribute__((packed)) { char magic[4]; uint8_t ver, recSize; uint16_t coarse, fine, every; uint32_t periodS; } h =
+    { { 'W', 'T', 'E', 'L' }, 1, (uint8_t)sizeof(TelRec), g_tel_coarse.count, g_tel_fine.count, TEL_COARSE_EVERY,
+      TELEMETRY_EVERY_MS / 1000 };
+  out.put(reinterpret_cast<const char*>(&h), sizeof(h));
+  for (uint16_t i = 0; i < g_tel_coarse.count; ++i) out.put(reinterpret_cast<const char*>(&g_tel_coarse.at(i)), sizeof(TelRec));
+  for (uint16_t i = 0; i < g_tel_fine.count; ++i)   out.put(reinterpret_cast<const char*>(&g_tel_fine.at(i)), sizeof(TelRec));
+  pageEnd(out);
+}
+
+static void buildTelHTML(PageOut& out) {
+  out.printf("<h2>Telemetry</h2><p>%u + %u samples: <a href='/tel.csv'>tel.csv</a> | <a href='/tel.bin'>tel.bin</a></p>"
+             "<pre>   up_s   heap maxblk frag sta ppp downs uart_err tx_drop\n", g_tel_fine.count, g_tel_coarse.count);
+  const uint16_t from = g_tel_fine.count > 8 ? g_tel_fine.count - 8 : 0;
+  for (uint16_t i = from; i < g_tel_fine.count; ++i) {
+    const TelRec& t = g_tel_fine.at(i);
+    out.printf("%7lu %6u %6u %3u%% %3u %3s %5u %8u %7u\n", (unsigned long)t.upS, t.heap, t.maxBlk, t.frag, t.sta,
+               (t.flags & TEL_F_PPP) ? "up" : "-", t.pppDowns, t.uartErr, t.txDrops);
+  }
+  out.put(F("\n"));
+  char line[192];
+  for (netif* n = netif_list; n; n = n->next) { netifLine(n, line, sizeof(line)); out.put(line); }
+  out.put(F("</pre>"));
+}
 
+// ============================== Status API ====================================
+
+// /api/status serves a snapshot that is refreshed together with the [TEL] line
+// (every TELEMETRY_EVERY_MS), so pollers between two snapshots get 304 Not
+// Modified for the price of one header. ?format=cbor or "Accept: application/cbor"
+// selects the binary encoding (RFC 8949).
+
+static const uint8_t SNAP_MAX_STA = 8;
+
+struct StatusSnap {
+  uint32_t seq, uptimeS;
+  uint32_t heap, maxBlk;
+  uint8_t  frag, apUp, pppUp, staCount;
+  uint32_t staIp[SNAP_MAX_STA];
+  uint32_t pppIp, baud;
+  uint32_t rxBytes, rxOverruns, rxErrors;
+  uint32_t txDrops, txStallMs;
+  BootDiag boot;                     // copied too: pppUpMs/firstPubMs change after boot
+  uint32_t setupUs;
+};
+static StatusSnap g_snap;
+static char       g_snap_etag[12] = "\"0\"";
+
+static void captureStatusSnap() {
+  StatusSnap n;
+  memset(&n, 0, sizeof(n));          // padding too: the ETag hashes raw bytes
+  n.seq     = g_snap.seq + 1;
+  n.uptimeS = millis() / 1000UL;
+  n.heap    = ESP.getFreeHeap();
+  n.maxBlk  = ESP.getMaxFreeBlockSize();
+  n.frag    = ESP.getHeapFragmentation();
 #if AP_ENABLE
-  html += F("<h2>Set AP Parameters</h2>"
-            "<form method='POST' action='/setap'>SSID: <input name='ssid' value='");
-  html += ap_ssid; html += F("'><br>Password: <input name='pass' value='");
-  html += ap_pass; html += F("'><br><input type='submit' value='Save & Reboot'></form>");
+  n.apUp = (WiFi.getMode() & WIFI_AP) ? 1 : 0;
+  if (n.apUp) {
+    struct station_info* list = wifi_softap_get_station_info();
+    for (struct station_info* st = list; st && n.staCount < SNAP_MAX_STA; st = STAILQ_NEXT(st, next)) n.staIp[n.staCount++] = st->ip.addr;
+    wifi_softap_free_station_info();
+  }
 #endif
+  netif* p = findPPP();
+  n.pppUp = (p && netif_is_up(p)) ? 1 : 0;
+  n.pppIp = p ? netif_ip4_addr(p)->addr : 0;
+  n.baud  = g_ppp_baud;
+  n.rxBytes = g_ppp_rx_bytes; n.rxOverruns = g_ppp_rx_overruns; n.rxErrors = g_ppp_rx_errors;
+  n.txDrops = g_ppp_tx_drops; n.txStallMs = g_ppp_tx_stall_ms;
+  n.boot = g_bootdiag;
+  n.setupUs = bootSetupUs();
+  g_snap = n;
+
+  uint32_t h = 2166136261u;          // FNV-1a over the snapshot, which is all the bodies show
+  const uint8_t* b = reinterpret_cast<const uint8_t*>(&g_snap);
+  for (size_t i = 0; i < sizeof(g_snap); ++i) { h ^= b[i]; h *= 16777619u; }
+  snprintf(g_snap_etag, sizeof(g_snap_etag), "\"%08lx\"", (unsigned long)h);
+}
+
+static void fmtIp(uint32_t a, char* out, size_t len) {
+  const uint8_t* b = reinterpret_cast<const uint8_t*>(&a);
+  snprintf(out, len, "%u.%u.%u.%u", b[0], b[1], b[2], b[3]);
+}
+
+static size_t statusJSON(char* buf, size_t cap) {
+  const StatusSnap& n = g_snap;
+  char ip[16];
+  size_t len = 0;
+  auto add = [&](const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+    if (len >= cap) return;
+    va_list ap; va_start(ap, fmt);
+    int k = vsnprintf(buf + len, cap - len, fmt, ap);
+    va_end(ap);
+    if (k > 0) len += (size_t)k;
+  };
+  add("{\"seq\":%lu,\"uptime_s\":%lu,", (unsigned long)n.seq, (unsigned long)n.uptimeS);
+  add("\"boot\":{\"count\":%lu,\"reason\":%lu,\"exccause\":%lu,\"epc1\":%lu,\"epc2\":%lu,\"epc3\":%lu,"
+      "\"excvaddr\":%lu,\"depc\":%lu,\"cpu_mhz\":%lu,\"flash_kb\":%lu,\"sketch_kb\":%lu,\"free_sketch_kb\":%lu,"
+      "\"setup_us\":%lu,\"ppp_up_ms\":%lu,\"first_pub_ms\":%lu},",
+      (unsigned long)n.boot.bootCount, (unsigned long)n.boot.reason, (unsigned long)n.boot.exccause,
+      (unsigned long)n.boot.epc1, (unsigned long)n.boot.epc2, (unsigned long)n.boot.epc3,
+      (unsigned long)n.boot.excvaddr, (unsigned long)n.boot.depc, (unsigned long)n.boot.cpuMHz,
+      (unsigned long)n.boot.flashKB, (unsigned long)n.boot.sketchKB, (unsigned long)n.boot.freeSketchKB,
+      (unsigned long)n.setupUs, (unsigned long)n.boot.pppUpMs, (unsigned long)n.boot.firstPubMs);
+  add("\"heap\":{\"free\":%lu,\"max_block\":%lu,\"frag\":%u},",
+      (unsigned long)n.heap, (unsigned long)n.maxBlk, (unsigned)n.frag);
+  add("\"ap\":{\"up\":%s,\"stations\":[", n.apUp ? "true" : "false");
+  for (uint8_t i = 0; i < n.staCount; ++i) { fmtIp(n.staIp[i], ip, sizeof(ip)); add("%s\"%s\"", i ? "," : "", ip); }
+  fmtIp(n.pppIp, ip, sizeof(ip));
+  add("]},\"ppp\":{\"up\":%s,\"ip\":\"%s\",\"baud\":%lu,\"rx_bytes\":%lu,\"rx_overruns\":%lu,\"rx_errors\":%lu,"
+      "\"tx_drops\":%lu,\"tx_stall_ms\":%lu}}",
+      n.pppUp ? "true" : "false", ip, (unsigned long)n.baud, (unsigned long)n.rxBytes, (unsigned long)n.rxOverruns,
+      (unsigned long)n.rxErrors, (unsigned long)n.txDrops, (unsigned long)n.txStallMs);
+  return (len < cap) ? len : cap - 1;
+}
+
+// Minimal CBOR writer: maps with text keys, unsigned ints, bools, arrays.
+struct CborOut {
+  uint8_t* p; size_t cap, len = 0;
+  CborOut(uint8_t* b, size_t c) : p(b), cap(c) {}
+  void byte(uint8_t v) { if (len < cap) p[len] = v; len++; }
+  void head(uint8_t major, uint32_t v) {
+    major <<= 5;
+    if (v < 24)            { byte(major | v); }
+    else if (v <= 0xFF)    { byte(major | 24); byte(v); }
+    else if (v <= 0xFFFF)  { byte(major | 25); byte(v >> 8); byte(v); }
+    else                   { byte(major | 26); byte(v >> 24); byte(v >> 16); byte(v >> 8); byte(v); }
+  }
+  void uint(uint32_t v)           { head(0, v); }
+  void text(const char* s)        { size_t n = strlen(s); head(3, n); for (size_t i = 0; i < n; ++i) byte(s[i]); }
+  void array(uint32_t n)          { head(4, n); }
+  void map(uint32_t n)            { head(5, n); }
+  void boolean(bool b)            { byte(b ? 0xF5 : 0xF4); }
+  void kv(const char* k, uint32_t v) { text(k); uint(v); }
+};
 
-  html += F("<h2>Reset</h2><form method='POST' action='/reset'><input type='submit' value='Reboot'></form>");
+static size_t statusCBOR(uint8_t* buf, size_t cap) {
+  const StatusSnap& n = g_snap;
+  char ip[16];
+  CborOut c(buf, cap);
+  c.map(6);
+  c.kv("seq", n.seq); c.kv("uptime_s", n.uptimeS);
+  c.text("boot"); c.map(15);
+  c.kv("count", n.boot.bootCount); c.kv("reason", n.boot.reason); c.kv("exccause", n.boot.exccause);
+  c.kv("epc1", n.boot.epc1); c.kv("epc2", n.boot.epc2); c.kv("epc3", n.boot.epc3);
+  c.kv("excvaddr", n.boot.excvaddr); c.kv("depc", n.boot.depc); c.kv("cpu_mhz", n.boot.cpuMHz);
+  c.kv("flash_kb", n.boot.flashKB); c.kv("sketch_kb", n.boot.sketchKB); c.kv("free_sketch_kb", n.boot.freeSketchKB);
+  c.kv("setup_us", n.setupUs); c.kv("ppp_up_ms", n.boot.pppUpMs); c.kv("first_pub_ms", n.boot.firstPubMs);
+  c.text("heap"); c.map(3);
+  c.kv("free", n.heap); c.kv("max_block", n.maxBlk); c.kv("frag", n.frag);
+  c.text("ap"); c.map(2);
+  c.text("up"); c.boolean(n.apUp);
+  c.text("stations"); c.array(n.staCount);
+  for (uint8_t i = 0; i < n.staCount; ++i) { fmtIp(n.staIp[i], ip, sizeof(ip)); c.text(ip); }
+  c.text("ppp"); c.map(8);
+  c.text("up"); c.boolean(n.pppUp);
+  fmtIp(n.pppIp, ip, sizeof(ip)); c.text("ip"); c.text(ip);
+  c.kv("baud", n.baud); c.kv("rx_bytes", n.rxBytes); c.kv("rx_overruns", n.rxOverruns);
+  c.kv("rx_errors", n.rxErrors); c.kv("tx_drops", n.txDrops); c.kv("tx_stall_ms", n.txStallMs);
+  return (c.len <= cap) ? c.len : 0;
+}
 
-  html += F("</body></html>");
-  server.send(200, "text/html", html);
+static void handleApiStatus() {
+  server.sendHeader("ETag", g_snap_etag);
+  server.sendHeader("Cache-Control", "no-cache");
+  if (strcmp(server.header("If-None-Match").c_str(), g_snap_etag) == 0) {
+    server.send(304, "application/json", "");
+    return;
+  }
+  const bool cbor = (server.hasArg("format") && strcmp(server.arg("format").c_str(), "cbor") == 0) ||
+                    strstr(server.header("Accept").c_str(), "application/cbor") != nullptr;
+  if (cbor) {
+    uint8_t buf[640];
+    size_t len = statusCBOR(buf, sizeof(buf));
+    server.send(200, "application/cbor", reinterpret_cast<const char*>(buf), len);
+  } else {
+    char buf[1024];
+    size_t len = statusJSON(buf, sizeof(buf));
+    server.send(200, "application/json", buf, len);
+  }
 }
 
 #if AP_ENABLE
 static void handleSetAP() {
   if (server.hasArg("ssid") && server.hasArg("pass")) {
+    if (server.hasArg("maxsta")) g_cfg.maxClients = (uint8_t)constrain(server.arg("maxsta").toInt(), 1, 8);
+    if (server.hasArg("rate"))   g_cfg.rlRate  = (uint8_t)constrain(server.arg("rate").toInt(), 0, 255);
+    if (server.hasArg("burst"))  g_cfg.rlBurst = (uint8_t)constrain(server.arg("burst").toInt(), 1, 255);
+    saveNetCfg();
     saveAPConfig(server.arg("ssid").c_str(), server.arg("pass").c_str());
     server.send(200, "text/html", "<html><body><h1>Saved. Rebooting...</h1></body></html>");
     delay(500); ESP.restart();
@@ -331,7 +1148,7 @@ static void handleReset() {
   // Persist current AP config across reboot
   saveAPConfig(ap_ssid, ap_pass);
 #else
-  EEPROM.commit(); // ensure BootDiag stays persisted
+  saveBootDiag(); eepromCommit(); // ensure BootDiag stays persisted
 #endif
   server.send(200, "text/html", "<html><body><h1>Rebooting...</h1></body></html>");
   delay(500); ESP.restart();
@@ -343,6 +1160,16 @@ static void setupWeb() {
   server.on("/setap", HTTP_POST, handleSetAP);
 #endif
   server.on("/reset", HTTP_POST, handleReset);
+  server.on("/api/status", HTTP_GET, handleApiStatus);
+  server.on("/tel.csv", HTTP_GET, handleTelCsv);
+  server.on("/tel.bin", HTTP_GET, handleTelBin);
+  static const char* kHeaders[] = { "If-None-Match", "Accept" };
+  server.collectHeaders(kHeaders, sizeof(kHeaders) / sizeof(kHeaders[0]));
+  server.on("/sched/reset", HTTP_POST, []() {
+    schedResetStats();
+    server.sendHeader("Location", "/");
+    server.send(303, "text/plain", "");
+  });
   server.begin();
   Serial1.println("[WEB] HTTP server started on port 80");
 }
@@ -359,9 +1186,546 @@ static void setupMQTT() {
   broker.begin();
   mqttEverBegan = true;
   lastMQTTLoopTouchMs = millis();
-  Serial1.printf("[MQTT] TinyMqtt broker on :%u (PPP, no NAT)\n", MQTT_PORT);
+  Serial1.printf("[MQTT] TinyMqtt broker on :%u (PPP, %s)\n", MQTT_PORT, PPP_NAT_ENABLE ? "NAT" : "no NAT");
+}
+
+// ================================ Bridge ======================================
+
+#if BRIDGE_ENABLE
+// ----- Topic trie: one node per filter level, siblings chained, labels in an arena -----
+struct TrieNode { uint16_t label; uint8_t len; uint8_t term; int8_t child, next; };
+static const uint8_t TRIE_INCL = 0x01, TRIE_EXCL = 0x02;
+
+static TrieNode g_trie[TRIE_NODES];
+static char     g_trie_arena[TRIE_ARENA];
+static uint8_t  g_trie_used = 1;                     // node 0 = root
+static uint16_t g_trie_arena_used = 0;
+static uint32_t g_trie_full = 0;                     // filters that did not fit the pools
+
+static bool trieInsert(const char* f, size_t flen, uint8_t bit) {
+  int8_t at = 0;
+  size_t i = 0;
+  while (true) {
+    size_t j = i; while (j < flen && f[j] != '/') ++j;
+    const uint8_t len = (uint8_t)(j - i);
+    int8_t c = g_trie[at].child;
+    while (c >= 0 && !(g_trie[c].len == len && memcmp(g_trie_arena + g_trie[c].label, f + i, len) == 0)) c = g_trie[c].next;
+    if (c < 0) {
+      if (g_trie_used >= TRIE_NODES || g_trie_arena_used + len > TRIE_ARENA) { g_trie_full++; return false; }
+      c = (int8_t)g_trie_used++;
+      memcpy(g_trie_arena + g_trie_arena_used, f + i, len);
+      g_trie[c] = { g_trie_arena_used, len, 0, -1, g_trie[at].child };
+      g_trie_arena_used += len;
+      g_trie[at].child = c;
+    }
+    at = c;
+    if (j >= flen) { g_trie[at].term |= bit; return true; }
+    i = j + 1;
+  }
+}
+
+static void trieLoad(const char* list, uint8_t bit) {
+  for (const char* p = list; *p; ) {
+    const char* e = strchr(p, ',');
+    const size_t n = e ? (size_t)(e - p) : strlen(p);
+    if (n && !trieInsert(p, n, bit)) Serial1.printf("[BRIDGE] filter '%.*s' dropped: trie full\n", (int)n, p);
+    p += n + (e ? 1 : 0);
+  }
+}
+
+// ORs the term bits of all filters matching topic[0..len) below node 'at'.
+static uint8_t trieMatch(int8_t at, const char* t, size_t len, bool first) {
+  size_t j = 0; while (j < len && t[j] != '/') ++j;
+  const bool last = (j >= len);
+  uint8_t acc = 0;
+  for (int8_t c = g_trie[at].child; c >= 0; c = g_trie[c].next) {
+    const TrieNode& n = g_trie[c];
+    const char* l = g_trie_arena + n.label;
+    const bool wild = (n.len == 1 && (l[0] == '#' || l[0] == '+'));
+    if (wild && first && t[0] == '$') continue;    // wildcards never match $SYS-style roots
+    if (n.len == 1 && l[0] == '#') { acc |= n.term; continue; }
+    if (!wild && !(n.len == j && memcmp(l, t, j) == 0)) continue;
+    if (last) {
+      acc |= n.term;
+      for (int8_t h = n.child; h >= 0; h = g_trie[h].next)   // "a/#" also matches "a"
+        if (g_trie[h].len == 1 && g_trie_arena[g_trie[h].label] == '#') acc |= g_trie[h].term;
+    } else {
+      acc |= trieMatch(c, t + j + 1, len - j - 1, false);
+    }
+  }
+  return acc;
+}
+
+static bool bridgeWants(const char* topic, size_t tl) {
+  const uint8_t m = trieMatch(0, topic, tl, true);
+  return (m & TRIE_INCL) && !(m & TRIE_EXCL);
+}
+
+enum BridgeState : uint8_t { BR_IDLE, BR_TCP, BR_CONNACK, BR_UP };
+
+// Outbox/spool record: u16 len (of what follows), u32 capture millis, u8 flags,
+// u16 topic length, topic, payload. PUBLISH packets are built at flush time so
+// late messages can carry their age in the topic ("spool/<age_ms>/<topic>").
+static const uint16_t BR_REC_HDR = 2 + 4 + 1 + 2;
+static const uint8_t  BR_F_NOAGE = 0x01;             // captured before the last reboot
+
+static uint8_t       g_br_box[BRIDGE_OUTBOX];
+static uint8_t       g_br_stage[1460];               // one TCP segment / one spool page
+static uint16_t      g_br_head = 0, g_br_tail = 0, g_br_used = 0, g_br_n = 0;
+static BridgeState   g_br_state = BR_IDLE;
+static unsigned long g_br_next_try_ms = 0;           // 0 = try when PPP is up
+static unsigned long g_br_first_queued_ms = 0;       // age of the oldest unsent record
+static unsigned long g_br_last_tx_ms = 0, g_br_state_ms = 0;
+static uint32_t      g_br_in = 0, g_br_out = 0, g_br_dropped = 0, g_br_oversize = 0;
+static uint32_t      g_br_writes = 0, g_br_connects = 0, g_br_filtered = 0;
+
+// Upstream session on the raw lwIP TCP API: the RX bytes of this connection
+// arrive through servicePPP() in the same loop, so nothing here may wait for
+// lwIP. Callbacks only record events; serviceBridge() acts on them. Records
+// stay in the outbox until their bytes are ACKed (g_br_sent_n of them are
+// written), so a connection that dies mid-flight resends them on reconnect.
+static const uint8_t BR_FLIGHT = 8;                  // writes awaiting ACK
+struct BrFlight { uint16_t bytes, recs; };
+static tcp_pcb*      g_br_pcb = nullptr;
+static BrFlight      g_br_fl[BR_FLIGHT];
+static uint8_t       g_br_fl_head = 0, g_br_fl_n = 0;
+static uint16_t      g_br_sent_n = 0, g_br_sent_off = 0;   // written records / their outbox bytes
+static uint32_t      g_br_acked = 0;                 // ACKed bytes not yet matched to writes
+static uint8_t       g_br_rx[8], g_br_rx_n = 0;      // CONNACK / PINGRESP bytes
+static volatile bool g_br_ev_connected = false, g_br_ev_err = false, g_br_ev_closed = false;
+
+static void brPutByte(uint8_t b) { g_br_box[g_br_head] = b; g_br_head = (g_br_head + 1) % BRIDGE_OUTBOX; }
+static uint8_t brPeek(uint16_t at) { return g_br_box[(g_br_tail + at) % BRIDGE_OUTBOX]; }
+static uint16_t brRecLen() { return (uint16_t)((brPeek(0) << 8) | brPeek(1)); }
+static void brPop() {
+  const uint16_t len = brRecLen();
+  g_br_tail = (g_br_tail + 2 + len) % BRIDGE_OUTBOX;
+  g_br_used -= 2 + len; g_br_n--;
+  if (!g_br_n) g_br_first_queued_ms = 0;
+}
+// Copies the oldest record (length prefix included) to dst; returns its size.
+static uint16_t brCopyOldest(uint8_t* dst) {
+  const uint16_t n = 2 + brRecLen();
+  for (uint16_t i = 0; i < n; ++i) dst[i] = brPeek(i);
+  return n;
+}
+
+#if SPOOL_ENABLE
+// Flash spool: records pushed out of a full outbox while the bridge is down are
+// collected in a RAM page and appended to SPOOL_FILE one whole page at a time.
+// Each page starts with the boot count; records from another boot lose their age.
+static uint8_t  g_sp_page[SPOOL_PAGE];
+static uint16_t g_sp_fill = 4;                       // after the page header
+static uint32_t g_sp_size = 0, g_sp_rd = 0;          // file bytes written / replayed
+static uint32_t g_sp_spooled = 0, g_sp_replayed = 0, g_sp_dropped = 0, g_sp_pages = 0;
+static bool     g_sp_ok = false;
+
+static void spoolWritePage() {
+  memset(g_sp_page + g_sp_fill, 0xFF, SPOOL_PAGE - g_sp_fill);   // 0xFFFF = end of page
+  File f = LittleFS.open(SPOOL_FILE, "a");
+  if (!f || f.write(g_sp_page, SPOOL_PAGE) != SPOOL_PAGE) { g_sp_ok = false; Serial1.println("[SPOOL] write failed, spool off"); }
+  else { g_sp_size += SPOOL_PAGE; g_sp_pages++; }
+  if (f) f.close();
+  g_sp_fill = 4;
+}
+
+static void spoolAppend(const uint8_t* rec, uint16_t n) {
+  if (!g_sp_ok || n > SPOOL_PAGE - 4 - 2) { g_sp_dropped++; return; }
+  if (g_sp_fill + n > SPOOL_PAGE - 2) {
+    if (g_sp_size + SPOOL_PAGE > SPOOL_MAX_BYTES) { g_sp_dropped++; return; }
+    spoolWritePage();
+    if (!g_sp_ok) { g_sp_dropped++; return; }
+  }
+  if (g_sp_fill == 4) memcpy(g_sp_page, &g_bootdiag.bootCount, 4);
+  memcpy(g_sp_page + g_sp_fill, rec, n);
+  g_sp_fill += n;
+  g_sp_spooled++;
+}
+#endif
+
+static void brAppend(uint32_t t, uint8_t flags, const char* topic, size_t tl, const uint8_t* payload, size_t len) {
+  const size_t rec = BR_REC_HDR + tl + len;
+  while (g_br_used + rec > BRIDGE_OUTBOX) {
+    if (g_br_sent_n) { g_br_dropped++; return; }     // the oldest records are written, wait for their ACK
+#if SPOOL_ENABLE
+    if (g_br_state != BR_UP) { spoolAppend(g_br_stage, brCopyOldest(g_br_stage)); brPop(); continue; }
+#endif
+    brPop(); g_br_dropped++;
+  }
+  const uint16_t body = (uint16_t)(rec - 2);
+  brPutByte(body >> 8); brPutByte(body);
+  brPutByte(t >> 24); brPutByte(t >> 16); brPutByte(t >> 8); brPutByte(t);
+  brPutByte(flags);
+  brPutByte(tl >> 8); brPutByte(tl);
+  for (size_t i = 0; i < tl; ++i) brPutByte(topic[i]);
+  for (size_t i = 0; i < len; ++i) brPutByte(payload[i]);
+  g_br_used += rec; g_br_n++;
+  if (!g_br_first_queued_ms) g_br_first_queued_ms = millis() ? millis() : 1;
+}
+
+// ----- Per-device token buckets (milli-tokens); over-limit topics coalesce -----
+struct RlSource {
+  char     key[24];                                  // first topic level
+  uint8_t  kl;
+  uint32_t tokens;
+  unsigned long last_ms;
+  uint32_t passed, coalesced, dropped;
+};
+struct RlPending {
+  int8_t   src;                                      // -1 = free
+  uint16_t tl, pl;
+  uint32_t t_ms;                                     // capture time of the held value
+  char     data[RL_PENDING_BYTES];                   // topic then payload
+};
+static RlSource  g_rl_src[RL_SOURCES];
+static uint8_t   g_rl_nsrc = 0;
+static RlPending g_rl_pend[RL_PENDING];
+
+static void rlRefill(RlSource& r, unsigned long now) {
+  const uint32_t cap = (uint32_t)g_cfg.rlBurst * 1000;
+  uint32_t dt = now - r.last_ms;
+  if (g_cfg.rlRate && dt > cap / g_cfg.rlRate) dt = cap / g_cfg.rlRate + 1;   // long idle: full bucket, no overflow
+  const uint32_t add = dt * g_cfg.rlRate;            // ms * msg/s = milli-tokens
+  r.tokens = (r.tokens + add > cap) ? cap : r.tokens + add;
+  r.last_ms = now;
+}
+
+static int8_t rlSource(const char* t, size_t tl, unsigned long now) {
+  size_t kl = 0; while (kl < tl && t[kl] != '/') ++kl;
+  if (kl > sizeof(g_rl_src[0].key)) kl = sizeof(g_rl_src[0].key);
+  int8_t lru = 0;
+  for (uint8_t i = 0; i < g_rl_nsrc; ++i) {
+    if (g_rl_src[i].kl == kl && memcmp(g_rl_src[i].key, t, kl) == 0) return (int8_t)i;
+    if ((int32_t)(g_rl_src[i].last_ms - g_rl_src[lru].last_ms) < 0) lru = (int8_t)i;
+  }
+  int8_t i = lru;
+  if (g_rl_nsrc < RL_SOURCES) i = (int8_t)g_rl_nsrc++;
+  else for (RlPending& p : g_rl_pend) if (p.src == i) p.src = -1;   // reused slot: forget its backlog
+  RlSource& r = g_rl_src[i];
+  memset(&r, 0, sizeof(r));
+  memcpy(r.key, t, kl); r.kl = (uint8_t)kl;
+  r.tokens = (uint32_t)g_cfg.rlBurst * 1000; r.last_ms = now;
+  return i;
+}
+
+// True if the message may be queued now; otherwise it is held back (latest
+// value per topic wins) or dropped when no pending slot is free.
+static bool rlAdmit(const char* t, size_t tl, const char* payload, size_t len) {
+  if (!g_cfg.rlRate) return true;
+  const unsigned long now = millis();
+  const int8_t si = rlSource(t, tl, now);
+  RlSource& r = g_rl_src[si];
+  rlRefill(r, now);
+
+  // An older value of this topic still held back: replace it, even with tokens
+  // left, so the stale one is never sent after this one. rlDrain() sends it.
+  RlPending* slot = nullptr; bool held = false;
+  for (RlPending& p : g_rl_pend) {
+    if (p.src == si && p.tl == tl && memcmp(p.data, t, tl) == 0) { slot = &p; held = true; r.coalesced++; break; }
+    if (!slot && p.src < 0) slot = &p;
+  }
+  if (!held && r.tokens >= 1000) { r.tokens -= 1000; r.passed++; return true; }
+  if (!slot || tl + len > RL_PENDING_BYTES) {
+    if (held) slot->src = -1;                        // too big to hold: the stale value goes in any case
+    if (held && r.tokens >= 1000) { r.tokens -= 1000; r.passed++; return true; }
+    r.dropped++; return false;
+  }
+  if (slot->src < 0) { slot->src = si; slot->tl = (uint16_t)tl; memcpy(slot->data, t, tl); }
+  memcpy(slot->data + tl, payload, len);
+  slot->pl = (uint16_t)len;
+  slot->t_ms = now;
+  return false;
+}
+
+// Releases held-back values as their device's bucket refills.
+static void rlDrain() {
+  const unsigned long now = millis();
+  for (RlPending& p : g_rl_pend) {
+    if (p.src < 0) continue;
+    RlSource& r = g_rl_src[p.src];
+    rlRefill(r, now);
+    if (r.tokens < 1000) continue;
+    r.tokens -= 1000; r.passed++;
+    brAppend(p.t_ms, 0, p.data, p.tl, (const uint8_t*)p.data + p.tl, p.pl);
+    p.src = -1;
+  }
 }
 
+static void buildBridgeHTML(PageOut& out) {
+  out.printf("<h2>Bridge</h2><pre>state %s, outbox %u/%u B, in %lu, out %lu, filtered %lu, dropped %lu\n",
+             g_br_state == BR_UP ? "UP" : g_br_state != BR_IDLE ? "CONNECTING" : "DOWN",
+             (unsigned)g_br_used, (unsigned)BRIDGE_OUTBOX, (unsigned long)g_br_in, (unsigned long)g_br_out,
+             (unsigned long)g_br_filtered, (unsigned long)g_br_dropped);
+  if (!g_cfg.rlRate) { out.put(F("rate limit off</pre>")); return; }
+  out.printf("rate limit %u msg/s, burst %u per device\n\ndevice                   passed coalesced  dropped tokens\n",
+             (unsigned)g_cfg.rlRate, (unsigned)g_cfg.rlBurst);
+  for (uint8_t i = 0; i < g_rl_nsrc; ++i) {
+    const RlSource& r = g_rl_src[i];
+    out.printf("%-24.*s %6lu %9lu %8lu %6lu\n", (int)r.kl, r.key, (unsigned long)r.passed,
+               (unsigned long)r.coalesced, (unsigned long)r.dropped, (unsigned long)(r.tokens / 1000));
+  }
+  out.put(F("</pre>"));
+}
+
+// Local client callback (runs inside broker.loop()): queue only.
+static void bridgeOnLocalPublish(const MqttClient*, const Topic& topic, const char* payload, size_t len) {
+  const char* t = topic.c_str();
+  const size_t tl = strlen(t);
+  g_br_in++;
+  if (!g_bootdiag.firstPubMs) g_bootdiag.firstPubMs = millis() ? millis() : 1;
+  if (!bridgeWants(t, tl)) { g_br_filtered++; return; }
+  if (BR_REC_HDR + tl + len > BRIDGE_MAX_PACKET) { g_br_oversize++; return; }
+  if (!rlAdmit(t, tl, payload, len)) return;
+  brAppend(millis(), 0, t, tl, (const uint8_t*)payload, len);
+}
+
+#if SPOOL_ENABLE
+// Moves spooled records back into the outbox, one flash page per call, oldest
+// first; the partial RAM page goes last. Only while the outbox has room.
+static void spoolReplay() {
+  if (g_br_used > BRIDGE_OUTBOX / 2) return;
+  const uint8_t* pg = nullptr;
+  uint16_t end = SPOOL_PAGE;
+  if (g_sp_rd < g_sp_size) {
+    File f = LittleFS.open(SPOOL_FILE, "r");
+    if (!f || !f.seek(g_sp_rd) || f.read(g_br_stage, SPOOL_PAGE) != SPOOL_PAGE) {
+      if (f) f.close();
+      g_sp_rd = g_sp_size;                           // unreadable: give up on the file
+    } else {
+      f.close();
+      pg = g_br_stage;
+      g_sp_rd += SPOOL_PAGE;
+    }
+    if (g_sp_rd >= g_sp_size) { LittleFS.remove(SPOOL_FILE); g_sp_rd = g_sp_size = 0; }
+    if (!pg) return;
+  } else if (g_sp_fill > 4) {
+    memcpy(g_br_stage, g_sp_page, g_sp_fill);
+    pg = g_br_stage; end = g_sp_fill;
+    g_sp_fill = 4;
+  } else {
+    return;
+  }
+
+  uint32_t boot; memcpy(&boot, pg, 4);
+  const uint8_t noage = (boot == g_bootdiag.bootCount) ? 0 : BR_F_NOAGE;
+  for (uint16_t off = 4; off + BR_REC_HDR <= end; ) {
+    const uint16_t body = (uint16_t)((pg[off] << 8) | pg[off + 1]);
+    if (body == 0xFFFF || off + 2 + body > end) break;
+    const uint8_t* r = pg + off + 2;
+    const uint32_t t = ((uint32_t)r[0] << 24) | ((uint32_t)r[1] << 16) | ((uint32_t)r[2] << 8) | r[3];
+    const uint16_t tl = (uint16_t)((r[5] << 8) | r[6]);
+    if (7 + tl > body) break;
+    brAppend(t, r[4] | noage, (const char*)r + 7, tl, r + 7 + tl, body - 7 - tl);
+    g_sp_replayed++;
+    off += 2 + body;
+  }
+}
+
+static void setupSpool() {
+  g_sp_ok = LittleFS.begin();
+  if (!g_sp_ok) { Serial1.println("[SPOOL] LittleFS mount failed, spool off"); return; }
+  File f = LittleFS.open(SPOOL_FILE, "r");
+  if (f) { g_sp_size = f.size() - f.size() % SPOOL_PAGE; f.close(); }
+  Serial1.printf("[SPOOL] %lu bytes pending from an earlier boot\n", (unsigned long)g_sp_size);
+}
+#endif
+
+static err_t brTcpConnected(void*, tcp_pcb*, err_t) { g_br_ev_connected = true; return ERR_OK; }
+static err_t brTcpSent(void*, tcp_pcb*, u16_t len) { g_br_acked += len; return ERR_OK; }
+static void  brTcpErr(void*, err_t) { g_br_pcb = nullptr; g_br_ev_err = true; }   // lwIP already freed the pcb
+static err_t brTcpRecv(void*, tcp_pcb* pcb, pbuf* p, err_t) {
+  if (!p) { g_br_ev_closed = true; return ERR_OK; }
+  const uint16_t room = sizeof(g_br_rx) - g_br_rx_n;
+  g_br_rx_n += pbuf_copy_partial(p, g_br_rx + g_br_rx_n, p->tot_len < room ? p->tot_len : room, 0);
+  tcp_recved(pcb, p->tot_len);
+  pbuf_free(p);
+  return ERR_OK;
+}
+
+static void bridgeDisconnect(const char* why) {
+  if (g_br_state != BR_IDLE) Serial1.printf("[BRIDGE] down: %s (%u queued)\n", why, (unsigned)g_br_n);
+  if (g_br_pcb) {
+    tcp_arg(g_br_pcb, nullptr); tcp_sent(g_br_pcb, nullptr); tcp_recv(g_br_pcb, nullptr); tcp_err(g_br_pcb, nullptr);
+    if (tcp_close(g_br_pcb) != ERR_OK) tcp_abort(g_br_pcb);
+    g_br_pcb = nullptr;
+  }
+  g_br_state = BR_IDLE;
+  g_br_fl_head = g_br_fl_n = 0;
+  g_br_sent_n = g_br_sent_off = 0;                   // unACKed records go again next time
+  if (g_br_n && !g_br_first_queued_ms) g_br_first_queued_ms = millis() ? millis() : 1;
+  g_br_acked = 0; g_br_rx_n = 0;
+  g_br_ev_connected = g_br_ev_err = g_br_ev_closed = false;
+  // retry with the PPP reconnect backoff (reset to 500 ms when PPP comes up)
+  g_br_next_try_ms = millis() + g_ppp_reconnect_backoff_ms;
+  if (!g_br_next_try_ms) g_br_next_try_ms = 1;
+}
+
+static void bridgeOnPPPUp()   { g_br_next_try_ms = 0; }
+static void bridgeOnPPPDown() { if (g_br_state != BR_IDLE) bridgeDisconnect("PPP down"); }
+
+// Queues n bytes (copied by lwIP) that complete recs outbox records once ACKed.
+// false = no send space or flight slot right now; try again next pass.
+static bool brTcpWrite(const uint8_t* data, uint16_t n, uint16_t recs) {
+  if (!g_br_pcb || g_br_fl_n >= BR_FLIGHT || tcp_sndbuf(g_br_pcb) < n) return false;
+  if (tcp_write(g_br_pcb, data, n, TCP_WRITE_FLAG_COPY) != ERR_OK) return false;
+  tcp_output(g_br_pcb);
+  g_br_fl[(g_br_fl_head + g_br_fl_n) % BR_FLIGHT] = { n, recs };
+  g_br_fl_n++;
+  return true;
+}
+
+// Pops the records whose bytes the peer has ACKed.
+static void bridgeAcked() {
+  while (g_br_fl_n && g_br_acked >= g_br_fl[g_br_fl_head].bytes) {
+    const BrFlight f = g_br_fl[g_br_fl_head];
+    g_br_acked -= f.bytes;
+    g_br_fl_head = (g_br_fl_head + 1) % BR_FLIGHT; g_br_fl_n--;
+    for (uint16_t i = 0; i < f.recs && g_br_sent_n; ++i) {
+      g_br_sent_off -= 2 + brRecLen();
+      g_br_sent_n--;
+      brPop();
+      g_br_out++;
+    }
+  }
+}
+
+static void bridgeConnect() {
+  netif* p = nullptr; for (netif* it = netif_list; it; it = it->next) if (it->name[0]=='p' && it->name[1]=='p') { p = it; break; }
+  if (!p || !netif_is_up(p)) return;
+  IPAddress host(netif_ip4_gw(p)->addr);
+  if (BRIDGE_HOST[0]) host.fromString(BRIDGE_HOST);
+  g_br_pcb = tcp_new();
+  if (!g_br_pcb) { bridgeDisconnect("no pcb"); return; }
+  tcp_nagle_disable(g_br_pcb);                       // we coalesce ourselves
+  tcp_sent(g_br_pcb, brTcpSent);
+  tcp_recv(g_br_pcb, brTcpRecv);
+  tcp_err(g_br_pcb, brTcpErr);
+  ip_addr_t a;
+  ip_addr_set_ip4_u32(&a, (uint32_t)host);
+  g_br_state = BR_TCP;                               // the SYN-ACK comes in through servicePPP()
+  g_br_state_ms = millis();
+  g_br_connects++;
+  if (tcp_connect(g_br_pcb, &a, BRIDGE_PORT, brTcpConnected) != ERR_OK) bridgeDisconnect("connect failed");
+}
+
+static void bridgeSendConnect() {
+  char id[24]; snprintf(id, sizeof(id), "wemos-%06lx", (unsigned long)ESP.getChipId());
+  const size_t il = strlen(id);
+  uint8_t pkt[48] = { 0x10, (uint8_t)(10 + 2 + il), 0, 4, 'M', 'Q', 'T', 'T', 4, 0x02 /* clean session */,
+                      0, BRIDGE_KEEPALIVE_S, (uint8_t)(il >> 8), (uint8_t)il };
+  memcpy(pkt + 14, id, il);
+  if (!brTcpWrite(pkt, 14 + il, 0)) { bridgeDisconnect("CONNECT not queued"); return; }
+  g_br_state = BR_CONNACK;
+  g_br_state_ms = g_br_last_tx_ms = millis();
+}
+
+// Builds PUBLISH packets from whole unsent records into one write of at most the
+// free TCP send space; records older than BRIDGE_STALE_MS get the spool prefix.
+static void bridgeFlush(unsigned long now) {
+  if (!g_br_pcb || g_br_fl_n >= BR_FLIGHT) return;
+  size_t n = 0, recs = 0;
+  size_t room = tcp_sndbuf(g_br_pcb);
+  if (room > sizeof(g_br_stage)) room = sizeof(g_br_stage);
+  uint16_t off = g_br_sent_off;
+  for (uint16_t i = g_br_sent_n; i < g_br_n; ++i) {
+    const uint16_t body = (uint16_t)((brPeek(off) << 8) | brPeek(off + 1));
+    const uint32_t t = ((uint32_t)brPeek(off + 2) << 24) | ((uint32_t)brPeek(off + 3) << 16) |
+                       ((uint32_t)brPeek(off + 4) << 8) | brPeek(off + 5);
+    const uint8_t flags = brPeek(off + 6);
+    const uint16_t tl = (uint16_t)((brPeek(off + 7) << 8) | brPeek(off + 8));
+    const uint16_t pl = body - 7 - tl;
+
+    char pre[24] = "";
+    const uint32_t age = now - t;
+    if (flags & BR_F_NOAGE) snprintf(pre, sizeof(pre), "spool/-/");
+    else if (age >= BRIDGE_STALE_MS) snprintf(pre, sizeof(pre), "spool/%lu/", (unsigned long)age);
+    const size_t prel = strlen(pre);
+    const size_t rem = 2 + prel + tl + pl;
+    const size_t pkt = 1 + (rem < 128 ? 1 : rem < 16384 ? 2 : 3) + rem;
+    if (n + pkt > room) break;
+
+    uint8_t* w = g_br_stage + n;
+    *w++ = 0x30;                                     // PUBLISH, QoS 0
+    size_t r = rem;
+    do { uint8_t d = r % 128; r /= 128; *w++ = r ? (d | 0x80) : d; } while (r);
+    *w++ = (prel + tl) >> 8; *w++ = (uint8_t)(prel + tl);
+    memcpy(w, pre, prel); w += prel;
+    for (uint16_t k = 0; k < tl + pl; ++k) *w++ = brPeek(off + 9 + k);
+    n += pkt; recs++; off += 2 + body;
+  }
+  if (!n || !brTcpWrite(g_br_stage, (uint16_t)n, (uint16_t)recs)) return;
+  g_br_sent_n += recs;
+  g_br_sent_off = off;
+  if (g_br_sent_n == g_br_n) g_br_first_queued_ms = 0;   // restarted by the next brAppend()
+  g_br_writes++;
+  g_br_last_tx_ms = now;
+}
+
+static void serviceBridge() {
+  bridgeLocal.loop();
+  rlDrain();
+  const unsigned long now = millis();
+
+  if (g_br_state == BR_IDLE) {
+    if (!g_br_next_try_ms || (int32_t)(now - g_br_next_try_ms) >= 0) bridgeConnect();
+    return;
+  }
+  if (g_br_ev_err)    { bridgeDisconnect("connection reset"); return; }
+  if (g_br_ev_closed) { bridgeDisconnect("connection closed"); return; }
+  bridgeAcked();
+
+  if (g_br_state == BR_TCP) {
+    if (g_br_ev_connected) { g_br_ev_connected = false; bridgeSendConnect(); }
+    else if ((uint32_t)(now - g_br_state_ms) > 5000) bridgeDisconnect("connect timeout");
+    return;
+  }
+  // CONNACK / PINGRESP; nothing else expected
+  if (g_br_state == BR_CONNACK && g_br_rx_n >= 4 && g_br_rx[0] == 0x20) {
+    if (g_br_rx[3] != 0) { bridgeDisconnect("CONNACK refused"); return; }
+    g_br_state = BR_UP;
+    Serial1.printf("[BRIDGE] up (%u queued)\n", (unsigned)g_br_n);
+  }
+  if (g_br_state == BR_UP) g_br_rx_n = 0;
+  if (g_br_state == BR_CONNACK) {
+    if ((uint32_t)(now - g_br_state_ms) > 5000) bridgeDisconnect("no CONNACK");
+    return;
+  }
+
+  const bool due = g_br_n > g_br_sent_n &&
+                   (g_br_used - g_br_sent_off >= BRIDGE_FLUSH_BYTES ||
+                    (g_br_first_queued_ms && (uint32_t)(now - g_br_first_queued_ms) >= BRIDGE_FLUSH_MS));
+  if (due) {
+    bridgeFlush(now);
+#if SPOOL_ENABLE
+  } else if (g_br_state == BR_UP && (g_sp_size || g_sp_fill > 4)) {
+    spoolReplay();
+#endif
+  } else if ((uint32_t)(now - g_br_last_tx_ms) >= BRIDGE_KEEPALIVE_S * 500UL) {
+    static const uint8_t ping[2] = { 0xC0, 0x00 };
+    if (brTcpWrite(ping, 2, 0)) g_br_last_tx_ms = now;   // no room: the queued data keeps the session alive
+  }
+}
+
+static void setupBridge() {
+  g_trie[0] = { 0, 0, 0, -1, -1 };
+  for (RlPending& p : g_rl_pend) p.src = -1;
+  trieLoad(BRIDGE_TOPICS, TRIE_INCL);
+  trieLoad(BRIDGE_EXCLUDE, TRIE_EXCL);
+  // one "#" subscription in the broker; the trie decides what leaves the board
+  bridgeLocal.setCallback(bridgeOnLocalPublish);
+  bridgeLocal.subscribe("#");
+#if SPOOL_ENABLE
+  setupSpool();
+#endif
+  Serial1.printf("[BRIDGE] '%s' minus '%s' -> %s:%u, outbox %u bytes, trie %u/%u nodes\n",
+                 BRIDGE_TOPICS, BRIDGE_EXCLUDE, BRIDGE_HOST[0] ? BRIDGE_HOST : "<PPP peer>", (unsigned)BRIDGE_PORT,
+                 (unsigned)BRIDGE_OUTBOX, (unsigned)g_trie_used, (unsigned)TRIE_NODES);
+}
+#else
+static inline void bridgeOnPPPUp() {}
+static inline void bridgeOnPPPDown() {}
+#endif
+
 // ============================= Health Monitor =================================
 
 static const char* rstReasonToStr(uint32_t r) {
@@ -370,7 +1734,6 @@ static const char* rstReasonToStr(uint32_t r) {
     case 4:return "REASON_SOFT_RESTART"; case 5:return "REASON_DEEP_SLEEP_AWAKE";
     case 6:return "REASON_EXT_SYS_RST"; default:return "UNKNOWN"; }
 }
-static netif* findPPP() { for (netif* n = netif_list; n; n = n->next) if (n->name[0]=='p'&&n->name[1]=='p') return n; return nullptr; }
 
 #if AP_ENABLE
 static void ensureAPUp() {
@@ -401,15 +1764,46 @@ static void servicePPPDeferred() {
 
   if (g_ppp_up_flag) {
     g_ppp_up_flag = false;
+    if (g_ppp_down_since_ms && g_ppp_down_events) {            // not the first connect after boot
+      const uint32_t took = now - g_ppp_down_since_ms;
+      uint8_t b = 0;
+      while (b + 1 < PPP_RECOVERY_BUCKETS && took >= PPP_RECOVERY_BOUNDS_MS[b]) ++b;
+      g_ppp_recovery_hist[b]++;
+      g_ppp_recovery_last_ms = took;
+      if (took > g_ppp_recovery_max_ms) g_ppp_recovery_max_ms = took;
+      Serial1.printf("[PPP] recovered in %lu ms\n", (unsigned long)took);
+    }
+    if (!g_bootdiag.pppUpMs) g_bootdiag.pppUpMs = now ? now : 1;
+    g_ppp_down_since_ms = 0;
     g_ppp_reconnect_backoff_ms = 500;
+    g_ppp_was_up = true;
     Serial1.println("[PPP] UP event consumed");
     dump_netifs("PPP UP");
+    bridgeOnPPPUp();
   }
   if (g_ppp_err_flag) {
     g_ppp_err_flag = false;
     Serial1.printf("[PPP] error event: code=%d\n", g_ppp_err_code);
-    ppp_schedule_reconnect(now);
+    g_ppp_down_events++;
+    if (!g_ppp_down_since_ms) g_ppp_down_since_ms = now ? now : 1;
+    bridgeOnPPPDown();
+    if (g_ppp_was_up) {                                        // fresh drop (echo timeout, peer restart)
+      g_ppp_was_up = false;
+      g_ppp_next_reconnect_ms = now ? now : 1;
+      Serial1.println("[PPP] link lost -> reconnect now");
+    } else {
+      ppp_schedule_reconnect(now);
+    }
+  }
+#if PPP_BAUD_NEGOTIATE
+  // Host restarted without probing us: go back to the well-known rate.
+  if (g_ppp_baud != PPP_BAUD && g_ppp_down_since_ms && (uint32_t)(now - g_ppp_down_since_ms) >= PPP_BAUD_REVERT_MS) {
+    Serial1.printf("[PPP] no link for %lus at %lu baud -> back to %lu\n",
+                   (unsigned long)(PPP_BAUD_REVERT_MS/1000), (unsigned long)g_ppp_baud, PPP_BAUD);
+    g_ppp_down_since_ms = now ? now : 1;
+    pppSetBaud(PPP_BAUD);
   }
+#endif
   if (g_ppp_next_reconnect_ms && (int32_t)(now - g_ppp_next_reconnect_ms) >= 0) {
     g_ppp_next_reconnect_ms = 0;
     if (ppp) { Serial1.println("[PPP] reconnecting now…"); ppp_connect(ppp, 0); }
@@ -429,6 +1823,8 @@ static void ensureMQTTUp() {
 
 static void logTelemetry() {
   uint32_t freeHeap=ESP.getFreeHeap(), maxBlk=ESP.getMaxFreeBlockSize(); uint8_t frag=ESP.getHeapFragmentation();
+  static uint32_t minMaxBlk = UINT32_MAX;          // low-water mark: fragmentation trend
+  if (maxBlk < minMaxBlk) minMaxBlk = maxBlk;
 #if AP_ENABLE
   int staCount=wifi_softap_get_station_num();
 #else
@@ -440,10 +1836,70 @@ static void logTelemetry() {
 #else
   const char* apState="DISABLED";
 #endif
-  char line[200]; snprintf(line,sizeof(line),"[TEL] up=%lus heap=%lu maxblk=%lu frag=%u%% AP=%s STA=%d PPP=%s IP=%s",
-           millis()/1000UL,(unsigned long)freeHeap,(unsigned long)maxBlk,(unsigned)frag,apState,staCount,pppState, p?ipaddr_ntoa(netif_ip4_addr(p)):"0.0.0.0");
-  g_lastTelLine=line; String netifs; dump_netifs_to(netifs,"periodic"); g_lastNetifDump=netifs;
-  Serial1.println(g_lastTelLine); Serial1.print(g_lastNetifDump);
+  char line[480]; int ll = snprintf(line,sizeof(line),"[TEL] up=%lus heap=%lu maxblk=%lu/%lu frag=%u%% AP=%s STA=%d PPP=%s IP=%s baud=%lu%s RX=%lu ovr=%lu err=%lu hwm=%u/%u TX=%u/%u/%u drop=%lu stall=%lums vj=%s wire/ip=%lu/%lu NAT=%s",
+           millis()/1000UL,(unsigned long)freeHeap,(unsigned long)maxBlk,(unsigned long)minMaxBlk,(unsigned)frag,apState,staCount,pppState, p?ipaddr_ntoa(netif_ip4_addr(p)):"0.0.0.0",
+           (unsigned long)g_ppp_baud, PPP_HW_FLOW ? "+rtscts" : "",
+           (unsigned long)g_ppp_rx_bytes,(unsigned long)g_ppp_rx_overruns,(unsigned long)g_ppp_rx_errors,(unsigned)g_ppp_rx_hwm,(unsigned)PPP_RX_BUF,
+           (unsigned)pppTxDepth(),(unsigned)g_ppp_tx_hwm,(unsigned)PPP_TX_BUF,(unsigned long)g_ppp_tx_drops,
+           (unsigned long)(g_ppp_tx_stall_ms + (g_ppp_tx_stall_since_ms ? millis() - g_ppp_tx_stall_since_ms : 0)),
+           pppVjState(),
+           (unsigned long)g_ppp_tx_wire_bytes, (unsigned long)g_ppp_tx_ip_bytes,
+#if PPP_NAT_ENABLE
+           g_nat_on ? "on" : "FAIL");
+#else
+           "off");
+#endif
+  if (g_ppp_tx_ip_bytes && ll > 0 && ll < (int)sizeof(line))
+    ll += snprintf(line + ll, sizeof(line) - ll, "(%lu%%)",
+                   (unsigned long)((uint64_t)g_ppp_tx_wire_bytes * 100 / g_ppp_tx_ip_bytes));
+  if (g_ppp_down_events && ll > 0 && ll < (int)sizeof(line))
+    ll += snprintf(line + ll, sizeof(line) - ll, " drops=%lu rec=%lu/%lums",
+                   (unsigned long)g_ppp_down_events, (unsigned long)g_ppp_recovery_last_ms,
+                   (unsigned long)g_ppp_recovery_max_ms);
+#if BRIDGE_ENABLE
+  if (ll > 0 && ll < (int)sizeof(line))
+    snprintf(line + ll, sizeof(line) - ll, " BR=%s q=%u/%uB in=%lu out=%lu flt=%lu drop=%lu big=%lu wr=%lu conn=%lu trie=%u/%u ar=%u/%u full=%lu",
+             g_br_state == BR_UP ? "UP" : g_br_state != BR_IDLE ? "CONN" : "DOWN", (unsigned)g_br_used, (unsigned)BRIDGE_OUTBOX,
+             (unsigned long)g_br_in, (unsigned long)g_br_out, (unsigned long)g_br_filtered, (unsigned long)g_br_dropped,
+             (unsigned long)g_br_oversize, (unsigned long)g_br_writes, (unsigned long)g_br_connects,
+             (unsigned)g_trie_used, (unsigned)TRIE_NODES, (unsigned)g_trie_arena_used, (unsigned)TRIE_ARENA, (unsigned long)g_trie_full);
+#if SPOOL_ENABLE
+  ll = (int)strlen(line);
+  if (ll < (int)sizeof(line))
+    snprintf(line + ll, sizeof(line) - ll, " SP=%lu/%luB sp=%lu rp=%lu drop=%lu",
+             (unsigned long)(g_sp_size - g_sp_rd), (unsigned long)SPOOL_MAX_BYTES,
+             (unsigned long)g_sp_spooled, (unsigned long)g_sp_replayed, (unsigned long)g_sp_dropped);
+#endif
+#else
+  (void)ll;
+#endif
+  captureStatusSnap();
+
+  static uint32_t prevDowns = 0, prevUart = 0, prevTxDrops = 0;
+  const uint32_t uart = g_ppp_rx_overruns + g_ppp_rx_errors;
+  TelRec t;
+  t.upS = millis() / 1000UL;
+  t.heap = sat16(freeHeap); t.maxBlk = sat16(maxBlk);
+  t.frag = frag; t.sta = (uint8_t)staCount;
+  t.flags = ((p && netif_is_up(p)) ? TEL_F_PPP : 0)
+#if AP_ENABLE
+          | ((WiFi.getMode() & WIFI_AP) ? TEL_F_AP : 0)
+#endif
+#if BRIDGE_ENABLE
+          | (g_br_state == BR_UP ? TEL_F_BRIDGE : 0)
+#endif
+#if PPP_NAT_ENABLE
+          | (g_nat_on ? TEL_F_NAT : 0)
+#endif
+          ;
+  t.pppDowns = (uint8_t)((g_ppp_down_events - prevDowns) > 0xFF ? 0xFF : g_ppp_down_events - prevDowns);
+  t.uartErr = sat16(uart - prevUart);
+  t.txDrops = sat16(g_ppp_tx_drops - prevTxDrops);
+  prevDowns = g_ppp_down_events; prevUart = uart; prevTxDrops = g_ppp_tx_drops;
+  telAdd(t);
+
+  Serial1.println(line);
+  dump_netifs("periodic");
 }
 
 static void serviceHealth() {
@@ -453,37 +1909,139 @@ static void serviceHealth() {
 
   ensureAPUp();
   ensurePPPUp();
-  servicePPPDeferred();
   ensureMQTTUp();
 
+  if (!g_bootdiag_committed && now >= BOOTDIAG_COMMIT_MS) {
+    g_bootdiag_committed = true;
+    const uint32_t t0 = micros();
+    saveBootDiag();                  // picks up pppUpMs/firstPubMs if already known
+    const bool wrote = g_eeprom_dirty;
+    eepromCommit();
+    Serial1.printf("[BOOT] EEPROM %s (%lu us)\n", wrote ? "committed" : "unchanged, no commit", (unsigned long)(micros() - t0));
+  }
+
   if ((uint32_t)(now - lastTelemetryMs) >= TELEMETRY_EVERY_MS) { lastTelemetryMs = now; logTelemetry(); }
 }
 
+// ============================== Scheduler =====================================
+
+enum SchedPrio : uint8_t { PRIO_HIGH = 0, PRIO_NORMAL = 1, PRIO_LOW = 2 };
+
+struct SchedTask {
+  const char* name;
+  void      (*fn)();
+  SchedPrio   prio;
+  uint16_t    budgetUs;
+  // accounting (micros)
+  uint32_t    runs, overruns, maxUs, lastUs;
+  uint64_t    totalUs;
+};
+
+static uint32_t g_slice_deadline_us = 0;
+static uint32_t g_sched_passes = 0, g_sched_pass_max_us = 0;
+
+static inline bool sliceExpired() { return (int32_t)(micros() - g_slice_deadline_us) >= 0; }
+
+static void schedRun(SchedTask& t) {
+  const uint32_t t0 = micros();
+  g_slice_deadline_us = t0 + t.budgetUs;
+  t.fn();
+  const uint32_t dt = micros() - t0;
+  t.runs++; t.totalUs += dt; t.lastUs = dt;
+  if (dt > t.maxUs) t.maxUs = dt;
+  if (dt > t.budgetUs) t.overruns++;
+}
+
 // ============================ Service Loops ===================================
 
+// Bytes arrive via the UART RX ISR; this only moves them from the ring into
+// lwIP, in bounded chunks so one burst cannot starve the broker/web server.
 static inline void servicePPP() {
+  pppTxDrain();
+  if (Serial.hasOverrun()) g_ppp_rx_overruns++;
+  if (Serial.hasRxError()) g_ppp_rx_errors++;
   if (!ppp) return;
-  static uint8_t buf[512];
-  int avail = Serial.available();
-  while (avail > 0) {
-    int take = (avail > (int)sizeof(buf)) ? sizeof(buf) : avail;
-    int n = Serial.readBytes(buf, take);
-    if (n > 0) { pppos_input(ppp, buf, n); }
-    avail = Serial.available(); delay(0);
+#if PPP_BAUD_NEGOTIATE
+  const bool linkUp = netif_is_up(&ppp_netif);
+  if (!linkUp) pppBaudService();
+#endif
+  static uint8_t buf[PPP_RX_CHUNK];
+  for (int i = 0; i < PPP_RX_CHUNKS_PER_LOOP && !sliceExpired(); ++i) {
+    int avail = Serial.available();
+    if (avail <= 0) break;
+    if (avail > g_ppp_rx_hwm) g_ppp_rx_hwm = avail;
+    size_t n = Serial.read(buf, (avail > (int)sizeof(buf)) ? sizeof(buf) : (size_t)avail);  // non-blocking
+    if (n == 0) break;
+    g_ppp_rx_bytes += n;
+#if PPP_BAUD_NEGOTIATE
+    if (!linkUp) pppBaudScan(buf, n);
+#endif
+    pppos_input(ppp, buf, n);
+    yield();
   }
 }
 static inline void serviceHTTP() { server.handleClient(); }
 
+// Table order = round-robin order of the normal/low tasks; high-priority tasks
+// run before each of them.
+static SchedTask g_tasks[] = {
+  { "ppp_rx", servicePPP,    PRIO_HIGH,   SLICE_PPP_US,    0, 0, 0, 0, 0 },
+  { "ppp_ctl", servicePPPDeferred, PRIO_NORMAL, SLICE_PPP_US, 0, 0, 0, 0, 0 },
+  { "mqtt",   serviceMQTT,   PRIO_NORMAL, SLICE_MQTT_US,   0, 0, 0, 0, 0 },
+  { "http",   serviceHTTP,   PRIO_NORMAL, SLICE_HTTP_US,   0, 0, 0, 0, 0 },
+#if BRIDGE_ENABLE
+  { "bridge", serviceBridge, PRIO_NORMAL, SLICE_MQTT_US,   0, 0, 0, 0, 0 },
+#endif
+  { "health", serviceHealth, PRIO_LOW,    SLICE_HEALTH_US, 0, 0, 0, 0, 0 },
+};
+static const size_t SCHED_TASKS = sizeof(g_tasks) / sizeof(g_tasks[0]);
+
+static void schedPass() {
+  const uint32_t t0 = micros();
+  for (size_t i = 0; i < SCHED_TASKS; ++i) {
+    if (g_tasks[i].prio == PRIO_HIGH) continue;
+    for (size_t h = 0; h < SCHED_TASKS; ++h) if (g_tasks[h].prio == PRIO_HIGH) schedRun(g_tasks[h]);
+    schedRun(g_tasks[i]);
+  }
+  const uint32_t dt = micros() - t0;
+  g_sched_passes++;
+  if (dt > g_sched_pass_max_us) g_sched_pass_max_us = dt;
+}
+
+static void schedResetStats() {
+  for (size_t i = 0; i < SCHED_TASKS; ++i) {
+    SchedTask& t = g_tasks[i];
+    t.runs = t.overruns = t.maxUs = t.lastUs = 0; t.totalUs = 0;
+  }
+  g_sched_passes = 0; g_sched_pass_max_us = 0;
+}
+
+static void buildSchedHTML(PageOut& out) {
+  out.put(F("<h2>Scheduler</h2><pre>task     prio budget_us     runs   avg_us   max_us  overruns\n"));
+  for (size_t i = 0; i < SCHED_TASKS; ++i) {
+    const SchedTask& t = g_tasks[i];
+    out.printf("%-8s %4u %9u %8lu %8lu %8lu %9lu\n",
+               t.name, (unsigned)t.prio, (unsigned)t.budgetUs, (unsigned long)t.runs,
+               (unsigned long)(t.runs ? t.totalUs / t.runs : 0), (unsigned long)t.maxUs, (unsigned long)t.overruns);
+  }
+  out.printf("passes: %lu, worst pass: %lu us</pre>", (unsigned long)g_sched_passes, (unsigned long)g_sched_pass_max_us);
+  out.put(F("<form method='POST' action='/sched/reset'><input type='submit' value='Reset scheduler stats'></form>"));
+}
+
 // ============================== Arduino =======================================
 
 void setup() {
-  Serial1.begin(LOG_BAUD); delay(100);
+  const uint32_t preUs = micros();
+  Serial1.begin(LOG_BAUD);
   WiFi.persistent(false);
   wifi_set_sleep_type(NONE_SLEEP_T);
 
   loadAPConfig(); // also loads persisted boot diag
+  g_bootdiag.pppUpMs = 0; g_bootdiag.firstPubMs = 0;
+  g_bootdiag.phaseUs[BOOT_PRE] = preUs;
+  g_boot_mark_us = preUs;
 
-  // Persist boot diagnostics for THIS boot
+  // Boot diagnostics for THIS boot (reach flash after BOOTDIAG_COMMIT_MS)
   struct rst_info* ri = system_get_rst_info();
   g_bootdiag.magic=BOOTDIAG_MAGIC; g_bootdiag.bootCount=g_bootdiag.bootCount+1;
   g_bootdiag.reason=ri->reason; g_bootdiag.exccause=ri->exccause;
@@ -491,18 +2049,30 @@ void setup() {
   g_bootdiag.excvaddr=ri->excvaddr; g_bootdiag.depc=ri->depc;
   g_bootdiag.cpuMHz=ESP.getCpuFreqMHz(); g_bootdiag.flashKB=ESP.getFlashChipSize()/1024;
   g_bootdiag.sketchKB=ESP.getSketchSize()/1024; g_bootdiag.freeSketchKB=ESP.getFreeSketchSpace()/1024;
-  saveBootDiag();
+  bootPhase(BOOT_EEPROM);
 
+  // Link and broker first, so sensors that come back with the AP find a broker
+  // and the bridge starts queueing while LCP/IPCP are still negotiating.
+  g_ppp_down_since_ms = millis() ? millis() : 1;
+  setupPPP();
+  bootPhase(BOOT_PPP);
+  setupMQTT();
+  bootPhase(BOOT_MQTT);
+#if BRIDGE_ENABLE
+  setupBridge();
+#endif
+  bootPhase(BOOT_BRIDGE);
 #if AP_ENABLE
   setupAP();
 #else
   WiFi.mode(WIFI_OFF);
   Serial1.println("[AP] disabled at compile time");
 #endif
-
-  setupPPP();
-  setupMQTT();
+  bootPhase(BOOT_AP);
   setupWeb();
+  bootPhase(BOOT_WEB);
+  saveBootDiag();        // RAM copy only; see BOOTDIAG_COMMIT_MS
+  captureStatusSnap();   // /api/status has data before the first [TEL]
 
   // Log boot diag
   Serial1.printf("[BOOT] Reason=%s (%u)\n", rstReasonToStr(ri->reason), ri->reason);
@@ -514,6 +2084,9 @@ void setup() {
                  system_get_sdk_version(), ESP.getCpuFreqMHz(),
                  ESP.getFlashChipSize()/1024, ESP.getSketchSize()/1024, ESP.getFreeSketchSpace()/1024,
                  g_bootdiag.bootCount);
+  Serial1.print("[BOOT] us:");
+  for (uint8_t i = 0; i < BOOT_PHASES; ++i) Serial1.printf(" %s=%lu", BOOT_PHASE_NAMES[i], (unsigned long)g_bootdiag.phaseUs[i]);
+  Serial1.printf(" setup=%lu\n", (unsigned long)(micros() - preUs));
 
   lastMQTTLoopTouchMs = millis();
   lastHealthTickMs    = lastMQTTLoopTouchMs;
@@ -521,9 +2094,6 @@ void setup() {
 }
 
 void loop() {
-  serviceMQTT();
-  servicePPP();
-  serviceHTTP();
-  serviceHealth();
+  schedPass();
   yield();
 }
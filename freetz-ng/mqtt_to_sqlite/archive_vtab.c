@@ -0,0 +1,215 @@
+// archive_vtab.c
+// Virtual table "mqtt_archive" that decodes archive_blocks (see archive_vtab.h).
+// Built into mqtt_archive, or as a loadable extension for the sqlite3 shell:
+//   make ext && sqlite3 mqtt_messages.db '.load ./archive_vtab' 'SELECT ...'
+
+#ifdef ARCHIVE_VTAB_EXTENSION
+#  include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#else
+#  include "archive_vtab.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsz.h"
+
+enum { COL_TS, COL_TOPIC, COL_VALUE, COL_TOPIC_ID };
+
+// idxNum bits: which constraints were handed to xFilter, in this argv order.
+enum { F_TOPIC = 1, F_TOPIC_ID = 2, F_TS_MIN = 4, F_TS_MAX = 8 };
+
+typedef struct {
+    sqlite3_vtab base;
+    sqlite3     *db;
+} arch_vtab;
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    sqlite3_stmt *blocks;     // matching blocks, ordered by topic and day
+    tsz_dec_t     dec;
+    sqlite3_int64 topic_id, rowid, ts_min, ts_max;
+    int64_t       t;
+    double        v;
+    int           eof;
+} arch_cursor;
+
+static int arch_connect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                        sqlite3_vtab **out, char **err) {
+    (void)aux; (void)argc; (void)argv; (void)err;
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(ts INTEGER, topic TEXT, value REAL, topic_id INTEGER)");
+    if (rc != SQLITE_OK) return rc;
+    arch_vtab *vt = sqlite3_malloc(sizeof(*vt));
+    if (!vt) return SQLITE_NOMEM;
+    memset(vt, 0, sizeof(*vt));
+    vt->db = db;
+    *out = &vt->base;
+    return SQLITE_OK;
+}
+
+static int arch_disconnect(sqlite3_vtab *vt) {
+    sqlite3_free(vt);
+    return SQLITE_OK;
+}
+
+// Bounds are passed on as a superset (constraints are not omitted), so GT/LT
+// need no special casing: SQLite re-checks every row.
+static int arch_best_index(sqlite3_vtab *vt, sqlite3_index_info *info) {
+    (void)vt;
+    int slot[4] = { -1, -1, -1, -1 };  // F_* bit index -> constraint
+    for (int i = 0; i < info->nConstraint; ++i) {
+        const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+        if (!c->usable) continue;
+        if (c->iColumn == COL_TOPIC && c->op == SQLITE_INDEX_CONSTRAINT_EQ) slot[0] = i;
+        else if (c->iColumn == COL_TOPIC_ID && c->op == SQLITE_INDEX_CONSTRAINT_EQ) slot[1] = i;
+        else if (c->iColumn == COL_TS) {
+            if (c->op == SQLITE_INDEX_CONSTRAINT_EQ || c->op == SQLITE_INDEX_CONSTRAINT_GE ||
+                c->op == SQLITE_INDEX_CONSTRAINT_GT) slot[2] = i;
+            if (c->op == SQLITE_INDEX_CONSTRAINT_EQ || c->op == SQLITE_INDEX_CONSTRAINT_LE ||
+                c->op == SQLITE_INDEX_CONSTRAINT_LT) slot[3] = i;
+        }
+    }
+    int argv = 0;
+    double cost = 1e7;
+    info->idxNum = 0;
+    for (int b = 0; b < 4; ++b) {
+        if (slot[b] < 0) continue;
+        // the same EQ constraint may fill both ts bounds; it gets one argv slot
+        if (b == 3 && slot[3] == slot[2]) { info->idxNum |= F_TS_MAX; continue; }
+        info->aConstraintUsage[slot[b]].argvIndex = ++argv;
+        info->idxNum |= 1 << b;
+        cost /= (b < 2) ? 100.0 : 10.0;
+    }
+    info->estimatedCost = cost;
+    return SQLITE_OK;
+}
+
+static int arch_open(sqlite3_vtab *vt, sqlite3_vtab_cursor **out) {
+    (void)vt;
+    arch_cursor *c = sqlite3_malloc(sizeof(*c));
+    if (!c) return SQLITE_NOMEM;
+    memset(c, 0, sizeof(*c));
+    *out = &c->base;
+    return SQLITE_OK;
+}
+
+static int arch_close(sqlite3_vtab_cursor *cur) {
+    arch_cursor *c = (arch_cursor*)cur;
+    sqlite3_finalize(c->blocks);
+    sqlite3_free(c);
+    return SQLITE_OK;
+}
+
+// Moves to the next decoded point inside [ts_min, ts_max], loading blocks as needed.
+static int arch_advance(arch_cursor *c) {
+    for (;;) {
+        if (c->dec.buf) {
+            int r = tsz_dec_next(&c->dec, &c->t, &c->v);
+            if (r < 0) {
+                sqlite3_free(c->base.pVtab->zErrMsg);
+                c->base.pVtab->zErrMsg = sqlite3_mprintf("corrupt archive block (topic_id %lld)", c->topic_id);
+                return SQLITE_CORRUPT;
+            }
+            if (r == 1 && c->t > c->ts_max) r = 0;  // blocks are sorted inside
+            if (r == 1) {
+                if (c->t < c->ts_min) continue;
+                c->rowid++;
+                return SQLITE_OK;
+            }
+            c->dec.buf = NULL;
+        }
+        int rc = sqlite3_step(c->blocks);
+        if (rc == SQLITE_DONE) { c->eof = 1; return SQLITE_OK; }
+        if (rc != SQLITE_ROW) return rc;
+        c->topic_id = sqlite3_column_int64(c->blocks, 0);
+        const void *data = sqlite3_column_blob(c->blocks, 2);
+        int len = sqlite3_column_bytes(c->blocks, 2);
+        if (tsz_dec_init(&c->dec, data, (size_t)len) != 0) {
+            sqlite3_free(c->base.pVtab->zErrMsg);
+            c->base.pVtab->zErrMsg = sqlite3_mprintf("bad archive block (topic_id %lld)", c->topic_id);
+            return SQLITE_CORRUPT;
+        }
+    }
+}
+
+static int arch_filter(sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr,
+                       int argc, sqlite3_value **argv) {
+    (void)idxStr;
+    arch_cursor *c = (arch_cursor*)cur;
+    arch_vtab *vt = (arch_vtab*)cur->pVtab;
+    sqlite3_finalize(c->blocks);
+    c->blocks = NULL;
+    memset(&c->dec, 0, sizeof(c->dec));
+    c->eof = 0;
+    c->rowid = 0;
+    c->ts_min = INT64_MIN;
+    c->ts_max = INT64_MAX;
+
+    int rc = sqlite3_prepare_v2(vt->db,
+        "SELECT b.topic_id, t.name, b.data FROM archive_blocks b JOIN topics t ON t.id = b.topic_id"
+        " WHERE (?1 IS NULL OR t.name = ?1) AND (?2 IS NULL OR b.topic_id = ?2)"
+        "   AND b.t_last >= ?3 AND b.t_first <= ?4"
+        " ORDER BY b.topic_id, b.day;", -1, &c->blocks, NULL);
+    if (rc != SQLITE_OK) {
+        sqlite3_free(cur->pVtab->zErrMsg);
+        cur->pVtab->zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(vt->db));
+        return rc;
+    }
+    int a = 0;
+    if (idxNum & F_TOPIC)    sqlite3_bind_value(c->blocks, 1, argv[a++]);
+    if (idxNum & F_TOPIC_ID) sqlite3_bind_value(c->blocks, 2, argv[a++]);
+    if (idxNum & F_TS_MIN)   c->ts_min = sqlite3_value_int64(argv[a++]);
+    if (idxNum & F_TS_MAX)   c->ts_max = a < argc ? sqlite3_value_int64(argv[a++]) : c->ts_min;  // ts = x
+    if (c->ts_max < INT64_MAX) c->ts_max++;  // "ts < 5.5" and "ts <= 5" both keep 5
+    sqlite3_bind_int64(c->blocks, 3, c->ts_min);
+    sqlite3_bind_int64(c->blocks, 4, c->ts_max);
+    return arch_advance(c);
+}
+
+static int arch_next(sqlite3_vtab_cursor *cur) { return arch_advance((arch_cursor*)cur); }
+static int arch_eof(sqlite3_vtab_cursor *cur) { return ((arch_cursor*)cur)->eof; }
+
+static int arch_column(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col) {
+    arch_cursor *c = (arch_cursor*)cur;
+    switch (col) {
+    case COL_TS:       sqlite3_result_int64(ctx, c->t); break;
+    case COL_TOPIC:    sqlite3_result_value(ctx, sqlite3_column_value(c->blocks, 1)); break;
+    case COL_VALUE:    sqlite3_result_double(ctx, c->v); break;
+    case COL_TOPIC_ID: sqlite3_result_int64(ctx, c->topic_id); break;
+    }
+    return SQLITE_OK;
+}
+
+static int arch_rowid(sqlite3_vtab_cursor *cur, sqlite3_int64 *rowid) {
+    *rowid = ((arch_cursor*)cur)->rowid;
+    return SQLITE_OK;
+}
+
+static sqlite3_module ARCH_MODULE = {
+    .iVersion    = 0,
+    .xCreate     = NULL,          // eponymous only: "FROM mqtt_archive" needs no CREATE
+    .xConnect    = arch_connect,
+    .xBestIndex  = arch_best_index,
+    .xDisconnect = arch_disconnect,
+    .xDestroy    = arch_disconnect,
+    .xOpen       = arch_open,
+    .xClose      = arch_close,
+    .xFilter     = arch_filter,
+    .xNext       = arch_next,
+    .xEof        = arch_eof,
+    .xColumn     = arch_column,
+    .xRowid      = arch_rowid,
+};
+
+int archive_vtab_register(sqlite3 *db) {
+    return sqlite3_create_module(db, "mqtt_archive", &ARCH_MODULE, NULL);
+}
+
+#ifdef ARCHIVE_VTAB_EXTENSION
+int sqlite3_archivevtab_init(sqlite3 *db, char **err, const sqlite3_api_routines *api) {
+    (void)err;
+    SQLITE_EXTENSION_INIT2(api);
+    return archive_vtab_register(db);
+}
+#endif
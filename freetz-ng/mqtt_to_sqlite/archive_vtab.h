@@ -0,0 +1,17 @@
+// archive_vtab.h
+// Read-only virtual table over mqtt_to_sqlite's archive_blocks:
+//   SELECT ts, topic, value FROM mqtt_archive
+//   WHERE topic = 'obk1234/power/get' AND ts BETWEEN 1704067200 AND 1735689600;
+// Constraints on topic, topic_id and ts select the blocks to decode; every
+// other condition is checked by SQLite as usual.
+
+#ifndef ARCHIVE_VTAB_H
+#define ARCHIVE_VTAB_H
+
+#include <sqlite3.h>
+
+// Registers the eponymous table "mqtt_archive" on db (linked-in builds).
+// The loadable extension (make ext) does the same in sqlite3_archivevtab_init().
+int archive_vtab_register(sqlite3 *db);
+
+#endif
@@ -0,0 +1,547 @@
+// link_bench.c
+// Hardware-in-the-loop benchmark for the Wemos uplink (esp_mqtt_ppp.ino over
+// PPP, slip/esp_mqtt_slip.ino over SLIP): drives the device's own broker through
+// ppp0/sl0 and writes one CSV row per measured value, so firmware variants,
+// speeds and compression settings can be compared run by run.
+//
+// Tests (LINK_TESTS, in this order):
+//   rtt    publish -> echo of the same topic from the Wemos broker, one message
+//          in flight: p50/p99/max latency and lost echoes
+//   tput   sustained echo throughput for each LINK_SIZES payload, at most
+//          LINK_WINDOW messages in flight: msg/s, payload kB/s per direction, lost
+//   nat    TCP throughput through the Wemos to/from an AP client:
+//            LINK_NAT_LISTEN=<port>  the client connects to us and sends
+//                                    (e.g. nc <host> 5001 </dev/zero): NAT path
+//            LINK_NAT_TARGET=ip:port we send to a sink on the client (routed path)
+//   reset  DTR/RTS pulse (wemos_reset.c), then the time until the broker port
+//          accepts TCP again and until the first MQTT echo, LINK_RESET_COUNT times
+//
+// Environment:
+//   LINK_BROKER=192.168.178.50  LINK_PORT=1883
+//   LINK_VARIANT=ppp            label written to every CSV row (e.g. ppp-921600-vj, slip)
+//   LINK_TESTS=rtt,tput,nat,reset
+//   LINK_RTT_COUNT=200          LINK_RTT_PAYLOAD=32      LINK_TIMEOUT_MS=2000
+//   LINK_SIZES=32,128,512,1024  LINK_TPUT_S=10           LINK_WINDOW=8
+//   LINK_NAT_LISTEN=            LINK_NAT_TARGET=         LINK_NAT_S=10   LINK_NAT_WAIT_S=60
+//   LINK_DEV=/dev/ttyUSB0       LINK_PULSE_MS=120        LINK_RESET_COUNT=3
+//   LINK_RESET_TIMEOUT_S=90     LINK_PPPD_PIDFILE=       (SIGTERM pppd after the pulse,
+//                                                         so a service renegotiates the speed)
+//   LINK_CSV=link_bench.csv     appended; header when the file is new
+//
+// CSV columns: ts,variant,test,param,metric,value (ts = unix seconds of the run)
+//
+// Build: make link_bench   (or make link-bench to build and run it)
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+
+#include <mosquitto.h>
+
+#include "wemos_reset.h"
+
+/* ---------- Config ---------- */
+static char g_broker[256] = "192.168.178.50";
+static int  g_port = 1883;
+static char g_variant[64] = "ppp";
+static char g_tests[128] = "rtt,tput,nat,reset";
+static int  g_rtt_count = 200;
+static int  g_rtt_payload = 32;
+static int  g_timeout_ms = 2000;
+static char g_sizes[128] = "32,128,512,1024";
+static int  g_tput_s = 10;
+static int  g_window = 8;
+static int  g_nat_listen = 0;
+static char g_nat_target[64] = "";
+static int  g_nat_s = 10;
+static int  g_nat_wait_s = 60;
+static char g_dev[256] = "/dev/ttyUSB0";
+static int  g_pulse_ms = 120;
+static int  g_reset_count = 3;
+static int  g_reset_timeout_s = 90;
+static char g_pppd_pidfile[256] = "";
+static char g_csv_path[256] = "link_bench.csv";
+
+static const char *env_or_default(const char *name, const char *defval) {
+    const char *v = getenv(name);
+    return (v && *v) ? v : defval;
+}
+
+static int env_or_default_int(const char *name, int defval) {
+    const char *v = getenv(name);
+    if (!v || !*v) return defval;
+    char *end = NULL;
+    long x = strtol(v, &end, 10);
+    if (end == v) return defval;
+    return (int)x;
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)(ts.tv_nsec / 1000);
+}
+
+static void abs_deadline(struct timespec *ts, int ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec  += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) { ts->tv_sec++; ts->tv_nsec -= 1000000000L; }
+}
+
+/* ---------- CSV ---------- */
+static FILE  *g_csv = NULL;
+static time_t g_run_ts = 0;
+
+static int csv_open(void) {
+    int fresh = access(g_csv_path, F_OK) != 0;
+    g_csv = fopen(g_csv_path, "a");
+    if (!g_csv) { perror(g_csv_path); return -1; }
+    if (fresh) fputs("ts,variant,test,param,metric,value\n", g_csv);
+    return 0;
+}
+
+static void csv_row(const char *test, const char *param, const char *metric, double value) {
+    if (!g_csv) return;
+    fprintf(g_csv, "%lld,%s,%s,%s,%s,%.3f\n", (long long)g_run_ts, g_variant, test, param, metric, value);
+    fflush(g_csv);
+}
+
+/* ---------- MQTT echo ---------- */
+// Every message goes to linkbench/<pid>/<run> with "<seq> <send_us>" at the
+// start of the payload; the subscription to linkbench/<pid>/# brings it back.
+// Echoes of an older run (late or retransmitted) are ignored.
+typedef struct {
+    pthread_mutex_t mu;
+    pthread_cond_t  cv;
+    unsigned        run;
+    unsigned long   recv;         // echoes of the current run
+    unsigned long   last_seq;     // highest seq echoed in this run
+    uint64_t        last_send_us; // its send time
+    uint64_t        last_recv_us;
+} echo_t;
+
+static echo_t g_echo = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, 0 };
+static char   g_prefix[64];
+
+static void on_connect(struct mosquitto *m, void *obj, int rc) {
+    (void)obj;
+    if (rc != 0) return;
+    char filter[80];
+    snprintf(filter, sizeof(filter), "%s/#", g_prefix);
+    mosquitto_subscribe(m, NULL, filter, 0);   // again after every reconnect
+}
+
+static void on_message(struct mosquitto *m, void *obj, const struct mosquitto_message *msg) {
+    (void)m; (void)obj;
+    size_t plen = strlen(g_prefix);
+    if (!msg->topic || strncmp(msg->topic, g_prefix, plen) != 0 || msg->topic[plen] != '/') return;
+    unsigned run = (unsigned)strtoul(msg->topic + plen + 1, NULL, 10);
+    char buf[48];
+    int n = msg->payloadlen < (int)sizeof(buf) - 1 ? msg->payloadlen : (int)sizeof(buf) - 1;
+    memcpy(buf, msg->payload, (size_t)(n > 0 ? n : 0));
+    buf[n > 0 ? n : 0] = '\0';
+    char *end = NULL;
+    unsigned long seq = strtoul(buf, &end, 10);
+    uint64_t sent = end ? strtoull(end, NULL, 10) : 0;
+    uint64_t t = now_us();
+
+    pthread_mutex_lock(&g_echo.mu);
+    if (run == g_echo.run) {
+        g_echo.recv++;
+        if (seq >= g_echo.last_seq) { g_echo.last_seq = seq; g_echo.last_send_us = sent; g_echo.last_recv_us = t; }
+        pthread_cond_broadcast(&g_echo.cv);
+    }
+    pthread_mutex_unlock(&g_echo.mu);
+}
+
+static unsigned echo_new_run(void) {
+    pthread_mutex_lock(&g_echo.mu);
+    unsigned run = ++g_echo.run;
+    g_echo.recv = 0;
+    g_echo.last_seq = 0;
+    g_echo.last_send_us = g_echo.last_recv_us = 0;
+    pthread_mutex_unlock(&g_echo.mu);
+    return run;
+}
+
+static int echo_publish(struct mosquitto *mosq, unsigned run, unsigned long seq, char *payload, int size) {
+    char topic[96];
+    snprintf(topic, sizeof(topic), "%s/%u", g_prefix, run);
+    int len = snprintf(payload, (size_t)size + 48, "%lu %llu", seq, (unsigned long long)now_us());
+    if (len < size) { memset(payload + len, ' ', (size_t)(size - len)); len = size; }
+    return mosquitto_publish(mosq, NULL, topic, len, payload, 0, false);
+}
+
+// Waits until seq was echoed (or anything newer); returns its latency in us, 0 on timeout.
+static uint64_t echo_wait(unsigned long seq, int timeout_ms) {
+    struct timespec dl;
+    abs_deadline(&dl, timeout_ms);
+    uint64_t lat = 0;
+    pthread_mutex_lock(&g_echo.mu);
+    while (!(g_echo.recv && g_echo.last_seq >= seq)) {
+        if (pthread_cond_timedwait(&g_echo.cv, &g_echo.mu, &dl) == ETIMEDOUT) break;
+    }
+    if (g_echo.recv && g_echo.last_seq >= seq)
+        lat = g_echo.last_recv_us > g_echo.last_send_us ? g_echo.last_recv_us - g_echo.last_send_us : 1;
+    pthread_mutex_unlock(&g_echo.mu);
+    return lat;
+}
+
+// Probe until one echo comes back: subscription and link are live.
+static int echo_ready(struct mosquitto *mosq, int timeout_ms, char *payload) {
+    uint64_t end = now_us() + (uint64_t)timeout_ms * 1000u;
+    while (now_us() < end) {
+        unsigned run = echo_new_run();
+        if (echo_publish(mosq, run, 1, payload, 8) == MOSQ_ERR_SUCCESS && echo_wait(1, 300)) return 0;
+        usleep(100 * 1000);
+    }
+    return -1;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double pct_ms(const uint32_t *v, size_t n, double p) {
+    if (!n) return 0.0;
+    size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+    return v[i] / 1000.0;
+}
+
+/* ---------- Tests ---------- */
+static int test_rtt(struct mosquitto *mosq, char *payload) {
+    uint32_t *lat = calloc((size_t)g_rtt_count, sizeof(*lat));
+    if (!lat) return -1;
+    unsigned run = echo_new_run();
+    size_t n = 0;
+    unsigned long lost = 0;
+    for (int i = 1; i <= g_rtt_count; ++i) {
+        if (echo_publish(mosq, run, (unsigned long)i, payload, g_rtt_payload) != MOSQ_ERR_SUCCESS) { lost++; continue; }
+        uint64_t d = echo_wait((unsigned long)i, g_timeout_ms);
+        if (d) lat[n++] = d > UINT32_MAX ? UINT32_MAX : (uint32_t)d;
+        else lost++;
+    }
+    qsort(lat, n, sizeof(*lat), cmp_u32);
+    char param[16];
+    snprintf(param, sizeof(param), "%d", g_rtt_payload);
+    double p50 = pct_ms(lat, n, 0.50), p99 = pct_ms(lat, n, 0.99), mx = n ? lat[n - 1] / 1000.0 : 0.0;
+    printf("rtt     payload %5d B: n=%zu lost=%lu p50=%.2f ms p99=%.2f ms max=%.2f ms\n",
+           g_rtt_payload, n, lost, p50, p99, mx);
+    csv_row("rtt", param, "p50_ms", p50);
+    csv_row("rtt", param, "p99_ms", p99);
+    csv_row("rtt", param, "max_ms", mx);
+    csv_row("rtt", param, "lost", (double)lost);
+    free(lat);
+    return 0;
+}
+
+static int test_tput_one(struct mosquitto *mosq, char *payload, int size) {
+    unsigned run = echo_new_run();
+    unsigned long sent = 0, written_off = 0;   // in flight = sent - echoed - written_off
+    uint64_t t0 = now_us(), t_end = t0 + (uint64_t)g_tput_s * 1000000u;
+    while (now_us() < t_end) {
+        pthread_mutex_lock(&g_echo.mu);
+        unsigned long recv = g_echo.recv;
+        if (sent >= recv + written_off + (unsigned long)g_window) {
+            struct timespec dl;
+            abs_deadline(&dl, g_timeout_ms);
+            int rc = 0;
+            while (g_echo.recv == recv && rc != ETIMEDOUT) rc = pthread_cond_timedwait(&g_echo.cv, &g_echo.mu, &dl);
+            // Nothing came back for a whole timeout: give up on the window and go on.
+            if (g_echo.recv == recv) written_off = sent - recv;
+            pthread_mutex_unlock(&g_echo.mu);
+            continue;
+        }
+        pthread_mutex_unlock(&g_echo.mu);
+        if (echo_publish(mosq, run, sent + 1, payload, size) == MOSQ_ERR_SUCCESS) sent++;
+    }
+    // Drain what is still in flight.
+    echo_wait(sent, g_timeout_ms);
+    pthread_mutex_lock(&g_echo.mu);
+    unsigned long recv = g_echo.recv;
+    uint64_t t_last = g_echo.last_recv_us ? g_echo.last_recv_us : now_us();
+    pthread_mutex_unlock(&g_echo.mu);
+
+    double secs = (double)(t_last - t0) / 1e6;
+    double msg_s = secs > 0 ? recv / secs : 0.0;
+    double kb_s = msg_s * size / 1000.0;
+    unsigned long missing = sent > recv ? sent - recv : 0;
+    char param[16];
+    snprintf(param, sizeof(param), "%d", size);
+    printf("tput    payload %5d B: sent=%lu echoed=%lu lost=%lu %.1f msg/s %.2f kB/s each way\n",
+           size, sent, recv, missing, msg_s, kb_s);
+    csv_row("tput", param, "msg_s", msg_s);
+    csv_row("tput", param, "kB_s", kb_s);
+    csv_row("tput", param, "lost", (double)missing);
+    return 0;
+}
+
+static int test_tput(struct mosquitto *mosq, char *payload) {
+    char sizes[sizeof(g_sizes)], *save = NULL;
+    snprintf(sizes, sizeof(sizes), "%s", g_sizes);
+    int failed = 0;
+    for (char *s = strtok_r(sizes, ",", &save); s; s = strtok_r(NULL, ",", &save)) {
+        int size = atoi(s);
+        if (size < 24 || size > 65536) { fprintf(stderr, "tput: payload %s out of range (24..65536)\n", s); failed = 1; continue; }
+        if (test_tput_one(mosq, payload, size) != 0) failed = 1;
+    }
+    return failed ? -1 : 0;
+}
+
+static void nat_report(const char *mode, unsigned long long bytes, double secs) {
+    double kbit_s = secs > 0 ? bytes * 8.0 / 1000.0 / secs : 0.0;
+    printf("nat     %-8s: %llu bytes in %.2f s = %.1f kbit/s\n", mode, bytes, secs, kbit_s);
+    csv_row("nat", mode, "kbit_s", kbit_s);
+    csv_row("nat", mode, "bytes", (double)bytes);
+}
+
+// An AP client connects to LINK_NAT_LISTEN and sends; we count what arrives.
+static int test_nat_listen(void) {
+    int ls = socket(AF_INET, SOCK_STREAM, 0);
+    if (ls < 0) { perror("socket"); return -1; }
+    int one = 1;
+    setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in a;
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port = htons((uint16_t)g_nat_listen);
+    a.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(ls, (struct sockaddr*)&a, sizeof(a)) != 0 || listen(ls, 1) != 0) {
+        fprintf(stderr, "nat: port %d: %s\n", g_nat_listen, strerror(errno));
+        close(ls);
+        return -1;
+    }
+    printf("nat     waiting up to %d s for an AP client on port %d...\n", g_nat_wait_s, g_nat_listen);
+    fflush(stdout);
+    struct pollfd pfd = { ls, POLLIN, 0 };
+    if (poll(&pfd, 1, g_nat_wait_s * 1000) <= 0) { fprintf(stderr, "nat: no client connected\n"); close(ls); return -1; }
+    int s = accept(ls, NULL, NULL);
+    close(ls);
+    if (s < 0) { perror("accept"); return -1; }
+
+    static char buf[16384];
+    unsigned long long bytes = 0;
+    uint64_t t0 = 0, t_last = 0, t_end = 0;
+    for (;;) {
+        struct pollfd p = { s, POLLIN, 0 };
+        int wait_ms = t0 ? (int)((t_end > now_us() ? t_end - now_us() : 0) / 1000) : g_timeout_ms * 5;
+        if (poll(&p, 1, wait_ms) <= 0) break;
+        ssize_t n = read(s, buf, sizeof(buf));
+        if (n <= 0) break;
+        t_last = now_us();
+        if (!t0) { t0 = t_last; t_end = t0 + (uint64_t)g_nat_s * 1000000u; continue; }  // start at the first segment
+        bytes += (unsigned long long)n;
+        if (t_last >= t_end) break;
+    }
+    close(s);
+    nat_report("listen", bytes, t0 && t_last > t0 ? (double)(t_last - t0) / 1e6 : 0.0);
+    return 0;
+}
+
+// We send to a sink on an AP client; bytes still unacknowledged at the end do not count.
+static int test_nat_target(void) {
+    char host[64];
+    snprintf(host, sizeof(host), "%s", g_nat_target);
+    char *colon = strrchr(host, ':');
+    if (!colon) { fprintf(stderr, "nat: LINK_NAT_TARGET must be ip:port\n"); return -1; }
+    *colon = '\0';
+    struct sockaddr_in a;
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port = htons((uint16_t)atoi(colon + 1));
+    if (inet_pton(AF_INET, host, &a.sin_addr) != 1) { fprintf(stderr, "nat: bad address %s\n", host); return -1; }
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) { perror("socket"); return -1; }
+    if (connect(s, (struct sockaddr*)&a, sizeof(a)) != 0) {
+        fprintf(stderr, "nat: connect %s: %s\n", g_nat_target, strerror(errno));
+        close(s);
+        return -1;
+    }
+    static char buf[4096];
+    unsigned long long written = 0;
+    uint64_t t0 = now_us(), t_end = t0 + (uint64_t)g_nat_s * 1000000u;
+    while (now_us() < t_end) {
+        struct pollfd p = { s, POLLOUT, 0 };
+        if (poll(&p, 1, 100) <= 0) continue;
+        ssize_t n = send(s, buf, sizeof(buf), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) { perror("nat: send"); break; }
+        if (n > 0) written += (unsigned long long)n;
+    }
+    int unacked = 0;
+    if (ioctl(s, SIOCOUTQ, &unacked) != 0) unacked = 0;
+    double secs = (double)(now_us() - t0) / 1e6;
+    close(s);
+    unsigned long long acked = written > (unsigned long long)unacked ? written - (unsigned long long)unacked : 0;
+    nat_report("target", acked, secs);
+    return 0;
+}
+
+static int test_nat(void) {
+    if (!g_nat_listen && !g_nat_target[0]) {
+        printf("nat     skipped (set LINK_NAT_LISTEN and/or LINK_NAT_TARGET)\n");
+        return 0;
+    }
+    int failed = 0;
+    if (g_nat_listen && test_nat_listen() != 0) failed = 1;
+    if (g_nat_target[0] && test_nat_target() != 0) failed = 1;
+    return failed ? -1 : 0;
+}
+
+// Non-blocking connect to the broker port with a short timeout.
+static int tcp_probe(int timeout_ms) {
+    struct sockaddr_in a;
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port = htons((uint16_t)g_port);
+    if (inet_pton(AF_INET, g_broker, &a.sin_addr) != 1) return -1;
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (s < 0) return -1;
+    int ok = 0;
+    if (connect(s, (struct sockaddr*)&a, sizeof(a)) == 0) {
+        ok = 1;
+    } else if (errno == EINPROGRESS) {
+        struct pollfd p = { s, POLLOUT, 0 };
+        int err = 0;
+        socklen_t el = sizeof(err);
+        if (poll(&p, 1, timeout_ms) == 1 && getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &el) == 0 && err == 0) ok = 1;
+    }
+    close(s);
+    return ok ? 0 : -1;
+}
+
+static void pppd_terminate(void) {
+    if (!g_pppd_pidfile[0]) return;
+    FILE *f = fopen(g_pppd_pidfile, "r");
+    long pid = 0;
+    if (f) { if (fscanf(f, "%ld", &pid) != 1) pid = 0; fclose(f); }
+    if (pid > 1 && kill((pid_t)pid, SIGTERM) == 0) return;
+    fprintf(stderr, "reset: no pppd to stop via %s\n", g_pppd_pidfile);
+}
+
+static int test_reset(struct mosquitto *mosq, char *payload) {
+    if (inet_addr(g_broker) == INADDR_NONE) { fprintf(stderr, "reset: LINK_BROKER must be an IPv4 address\n"); return -1; }
+    int failed = 0;
+    for (int i = 1; i <= g_reset_count; ++i) {
+        if (echo_ready(mosq, g_reset_timeout_s * 1000, payload) != 0) { fprintf(stderr, "reset: link not up before pulse %d\n", i); return -1; }
+        uint64_t t0 = now_us();
+        int rc = wemos_reset(g_dev, (unsigned)g_pulse_ms, 50);
+        if (rc < 0) { fprintf(stderr, "reset: %s: %s\n", g_dev, strerror(-rc)); return -1; }
+        pppd_terminate();
+        uint64_t end = t0 + (uint64_t)g_reset_timeout_s * 1000000u;
+        usleep((unsigned)g_pulse_ms * 1000u + 500 * 1000u);   // the old link is gone by now
+
+        uint64_t t_ip = 0, t_mqtt = 0;
+        while (!t_ip && now_us() < end) {
+            if (tcp_probe(300) == 0) t_ip = now_us();
+            else usleep(100 * 1000);
+        }
+        unsigned run = echo_new_run();
+        for (unsigned long seq = 1; t_ip && !t_mqtt && now_us() < end; ++seq) {
+            if (echo_publish(mosq, run, seq, payload, 8) == MOSQ_ERR_SUCCESS && echo_wait(seq, 200)) t_mqtt = now_us();
+        }
+        char param[16];
+        snprintf(param, sizeof(param), "%d", i);
+        if (!t_mqtt) {
+            printf("reset   #%d: no recovery within %d s\n", i, g_reset_timeout_s);
+            csv_row("reset", param, "timeout_s", g_reset_timeout_s);
+            failed = 1;
+            continue;
+        }
+        double ip_ms = (double)(t_ip - t0) / 1000.0, mqtt_ms = (double)(t_mqtt - t0) / 1000.0;
+        printf("reset   #%d: broker port after %.0f ms, first echo after %.0f ms\n", i, ip_ms, mqtt_ms);
+        csv_row("reset", param, "tcp_ms", ip_ms);
+        csv_row("reset", param, "mqtt_ms", mqtt_ms);
+    }
+    return failed ? -1 : 0;
+}
+
+int main(void) {
+    snprintf(g_broker, sizeof(g_broker), "%s", env_or_default("LINK_BROKER", "192.168.178.50"));
+    g_port            = env_or_default_int("LINK_PORT", 1883);
+    snprintf(g_variant, sizeof(g_variant), "%s", env_or_default("LINK_VARIANT", "ppp"));
+    snprintf(g_tests, sizeof(g_tests), "%s", env_or_default("LINK_TESTS", "rtt,tput,nat,reset"));
+    g_rtt_count       = env_or_default_int("LINK_RTT_COUNT", 200);
+    g_rtt_payload     = env_or_default_int("LINK_RTT_PAYLOAD", 32);
+    g_timeout_ms      = env_or_default_int("LINK_TIMEOUT_MS", 2000);
+    snprintf(g_sizes, sizeof(g_sizes), "%s", env_or_default("LINK_SIZES", "32,128,512,1024"));
+    g_tput_s          = env_or_default_int("LINK_TPUT_S", 10);
+    g_window          = env_or_default_int("LINK_WINDOW", 8);
+    g_nat_listen      = env_or_default_int("LINK_NAT_LISTEN", 0);
+    snprintf(g_nat_target, sizeof(g_nat_target), "%s", env_or_default("LINK_NAT_TARGET", ""));
+    g_nat_s           = env_or_default_int("LINK_NAT_S", 10);
+    g_nat_wait_s      = env_or_default_int("LINK_NAT_WAIT_S", 60);
+    snprintf(g_dev, sizeof(g_dev), "%s", env_or_default("LINK_DEV", "/dev/ttyUSB0"));
+    g_pulse_ms        = env_or_default_int("LINK_PULSE_MS", 120);
+    g_reset_count     = env_or_default_int("LINK_RESET_COUNT", 3);
+    g_reset_timeout_s = env_or_default_int("LINK_RESET_TIMEOUT_S", 90);
+    snprintf(g_pppd_pidfile, sizeof(g_pppd_pidfile), "%s", env_or_default("LINK_PPPD_PIDFILE", ""));
+    snprintf(g_csv_path, sizeof(g_csv_path), "%s", env_or_default("LINK_CSV", "link_bench.csv"));
+    if (g_rtt_count < 1) g_rtt_count = 1;
+    if (g_rtt_payload < 24) g_rtt_payload = 24;   // "<seq> <send_us>" must fit
+    if (g_rtt_payload > 65536) g_rtt_payload = 65536;
+    if (g_timeout_ms < 100) g_timeout_ms = 100;
+    if (g_window < 1) g_window = 1;
+    signal(SIGPIPE, SIG_IGN);
+
+    g_run_ts = time(NULL);
+    if (csv_open() != 0) return 1;
+    snprintf(g_prefix, sizeof(g_prefix), "linkbench/%d", (int)getpid());
+    char *payload = malloc(65536 + 48);
+    if (!payload) return 1;
+
+    mosquitto_lib_init();
+    char id[64];
+    snprintf(id, sizeof(id), "link-bench-%d", (int)getpid());
+    struct mosquitto *mosq = mosquitto_new(id, true, NULL);
+    if (!mosq) { fprintf(stderr, "mosquitto_new failed\n"); return 1; }
+    mosquitto_connect_callback_set(mosq, on_connect);
+    mosquitto_message_callback_set(mosq, on_message);
+    mosquitto_reconnect_delay_set(mosq, 1, 1, false);   // after a reset: retry every second
+    int rc = mosquitto_connect(mosq, g_broker, g_port, 5);
+    if (rc != MOSQ_ERR_SUCCESS) {
+        fprintf(stderr, "connect %s:%d failed: %s\n", g_broker, g_port, mosquitto_strerror(rc));
+        return 1;
+    }
+    mosquitto_loop_start(mosq);
+    if (echo_ready(mosq, 10000, payload) != 0) {
+        fprintf(stderr, "no echo from %s:%d within 10 s\n", g_broker, g_port);
+        return 1;
+    }
+
+    printf("# %s: broker %s:%d, CSV %s\n", g_variant, g_broker, g_port, g_csv_path);
+    int failed = 0;
+    char *save = NULL;
+    for (char *t = strtok_r(g_tests, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+        if      (strcmp(t, "rtt") == 0)   rc = test_rtt(mosq, payload);
+        else if (strcmp(t, "tput") == 0)  rc = test_tput(mosq, payload);
+        else if (strcmp(t, "nat") == 0)   rc = test_nat();
+        else if (strcmp(t, "reset") == 0) rc = test_reset(mosq, payload);
+        else { fprintf(stderr, "unknown test '%s' (rtt, tput, nat, reset)\n", t); rc = -1; }
+        if (rc != 0) failed = 1;
+        fflush(stdout);
+    }
+
+    mosquitto_disconnect(mosq);
+    mosquitto_loop_stop(mosq, false);
+    mosquitto_destroy(mosq);
+    mosquitto_lib_cleanup();
+    free(payload);
+    fclose(g_csv);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,113 @@
+// mqtt_archive.c
+// Inspect and export the compressed archive of mqtt_to_sqlite (MQTT_ARCHIVE_AFTER_DAYS).
+// Usage:
+//   ./mqtt_archive <db> stats                          # blocks, points, bytes per point
+//   ./mqtt_archive <db> export [topic [from [to]]]     # CSV ts,topic,value (unix seconds)
+// topic "" or "*" means all topics. Reads through the mqtt_archive virtual table
+// (archive_vtab.c), so the same queries work in the sqlite3 shell after
+// '.load ./archive_vtab'.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "archive_vtab.h"
+
+// Shortest decimal that reads back as the same double.
+static void print_value(double v) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", v);
+    if (strtod(buf, NULL) != v) snprintf(buf, sizeof(buf), "%.17g", v);
+    fputs(buf, stdout);
+}
+
+// CSV field; quoted only when needed.
+static void print_text(const char *s) {
+    if (!strpbrk(s, ",\"\r\n")) { fputs(s, stdout); return; }
+    putchar('"');
+    for (; *s; ++s) {
+        if (*s == '"') putchar('"');
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+static int cmd_stats(sqlite3 *db) {
+    sqlite3_stmt *st = NULL;
+    int rc = sqlite3_prepare_v2(db,
+        "SELECT count(*), count(DISTINCT topic_id), coalesce(sum(count), 0), coalesce(sum(length(data)), 0),"
+        " min(t_first), max(t_last) FROM archive_blocks;", -1, &st, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "mqtt_archive: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    if (sqlite3_step(st) == SQLITE_ROW) {
+        long long blocks = sqlite3_column_int64(st, 0), topics = sqlite3_column_int64(st, 1);
+        long long points = sqlite3_column_int64(st, 2), bytes = sqlite3_column_int64(st, 3);
+        printf("blocks=%lld topics=%lld points=%lld bytes=%lld", blocks, topics, points, bytes);
+        if (points > 0) {
+            printf(" bytes_per_point=%.2f first=%lld last=%lld", (double)bytes / (double)points,
+                   (long long)sqlite3_column_int64(st, 4), (long long)sqlite3_column_int64(st, 5));
+        }
+        putchar('\n');
+    }
+    sqlite3_finalize(st);
+    return 0;
+}
+
+static int cmd_export(sqlite3 *db, const char *topic, const char *from, const char *to) {
+    // Plain conjuncts only, so that xBestIndex sees every constraint.
+    char sql[160];
+    snprintf(sql, sizeof(sql), "SELECT ts, topic, value FROM mqtt_archive WHERE 1%s%s%s;",
+             topic ? " AND topic = ?1" : "", from ? " AND ts >= ?2" : "", to ? " AND ts <= ?3" : "");
+    sqlite3_stmt *st = NULL;
+    if (sqlite3_prepare_v2(db, sql, -1, &st, NULL) != SQLITE_OK) {
+        fprintf(stderr, "mqtt_archive: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    if (topic) sqlite3_bind_text(st, 1, topic, -1, SQLITE_STATIC);
+    if (from)  sqlite3_bind_int64(st, 2, strtoll(from, NULL, 10));
+    if (to)    sqlite3_bind_int64(st, 3, strtoll(to, NULL, 10));
+
+    int rc;
+    puts("ts,topic,value");
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+        printf("%lld,", (long long)sqlite3_column_int64(st, 0));
+        print_text((const char*)sqlite3_column_text(st, 1));
+        putchar(',');
+        print_value(sqlite3_column_double(st, 2));
+        putchar('\n');
+    }
+    if (rc != SQLITE_DONE) fprintf(stderr, "mqtt_archive: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(st);
+    return rc == SQLITE_DONE ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3 || (strcmp(argv[2], "stats") != 0 && strcmp(argv[2], "export") != 0)) {
+        fprintf(stderr, "usage: %s <db> stats | export [topic [from [to]]]\n", argv[0]);
+        return 2;
+    }
+    sqlite3 *db = NULL;
+    if (sqlite3_open_v2(argv[1], &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        fprintf(stderr, "mqtt_archive: %s: %s\n", argv[1], sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return 1;
+    }
+    sqlite3_busy_timeout(db, 5000);
+    int rc;
+    if (strcmp(argv[2], "stats") == 0) {
+        rc = cmd_stats(db);
+    } else if (archive_vtab_register(db) != SQLITE_OK) {
+        fprintf(stderr, "mqtt_archive: cannot register the virtual table: %s\n", sqlite3_errmsg(db));
+        rc = 1;
+    } else {
+        const char *topic = argc >= 4 && argv[3][0] && strcmp(argv[3], "*") != 0 ? argv[3] : NULL;
+        rc = cmd_export(db, topic, argc >= 5 ? argv[4] : NULL, argc >= 6 ? argv[5] : NULL);
+    }
+    sqlite3_close(db);
+    return rc;
+}
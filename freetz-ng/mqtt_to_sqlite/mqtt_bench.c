@@ -0,0 +1,379 @@
+// mqtt_bench.c
+// Ingest benchmark for mqtt_to_sqlite: starts the collector once per insert
+// mode against a fresh database, publishes a configurable load to the broker
+// and reads the rows back from the DB to measure what actually got committed.
+//
+// Reports per mode: offered and sustained msg/s, rows lost, publish->commit
+// latency (p50/p99/p999/max, payload carries the send time) and DB bytes per
+// message. Latency is "visible to a reader", i.e. it includes batching delay.
+//
+// Environment:
+//   BENCH_BROKER=127.0.0.1  BENCH_PORT=1883
+//   BENCH_TOPICS=16         topic cardinality (bench/<pid>/t0..tN-1)
+//   BENCH_PAYLOAD=16        payload bytes (numeric send time, space padded)
+//   BENCH_RATE=500          msg/s offered (0 = as fast as possible)
+//   BENCH_SECONDS=10        publish duration per mode
+//   BENCH_DRAIN_S=5         max wait for outstanding rows after publishing
+//   BENCH_MODES=row,batch,thread
+//   BENCH_BATCH_MAX=200     BENCH_BATCH_MS=1000   (batch/thread modes)
+//   BENCH_COLLECTOR=./mqtt_to_sqlite
+//   BENCH_DIR=/tmp          where bench_<mode>.db and .log are written
+//
+// Build: make bench   (also runs it; or `make mqtt_bench` to only build)
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <mosquitto.h>
+#include <sqlite3.h>
+
+/* ---------- Config ---------- */
+static char g_broker[256] = "127.0.0.1";
+static int  g_port = 1883;
+static int  g_topics = 16;
+static int  g_payload = 16;
+static int  g_rate = 500;
+static int  g_seconds = 10;
+static int  g_drain_s = 5;
+static int  g_batch_max = 200;
+static int  g_batch_ms = 1000;
+static char g_modes[128] = "row,batch,thread";
+static char g_collector[256] = "./mqtt_to_sqlite";
+static char g_dir[256] = "/tmp";
+
+static const char *env_or_default(const char *name, const char *defval) {
+    const char *v = getenv(name);
+    return (v && *v) ? v : defval;
+}
+
+static int env_or_default_int(const char *name, int defval) {
+    const char *v = getenv(name);
+    if (!v || !*v) return defval;
+    char *end = NULL;
+    long x = strtol(v, &end, 10);
+    if (end == v) return defval;
+    return (int)x;
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)(ts.tv_nsec / 1000);
+}
+
+static void sleep_until_us(uint64_t t) {
+    uint64_t n = now_us();
+    if (t <= n) return;
+    struct timespec ts = { (time_t)((t - n) / 1000000u), (long)((t - n) % 1000000u) * 1000 };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {}
+}
+
+/* ---------- Collector process ---------- */
+static pid_t collector_start(const char *mode, const char *db, const char *log, const char *topic_filter) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) { dup2(fd, 1); dup2(fd, 2); close(fd); }
+
+    char buf[32];
+    setenv("MQTT_BROKER", g_broker, 1);
+    snprintf(buf, sizeof(buf), "%d", g_port);
+    setenv("MQTT_PORT", buf, 1);
+    setenv("MQTT_TOPIC", topic_filter, 1);
+    setenv("MQTT_DB_PATH", db, 1);
+    snprintf(buf, sizeof(buf), "bench-collector-%d", (int)getpid());
+    setenv("MQTT_CLIENT_ID", buf, 1);
+    setenv("MQTT_LOG_INSERTS", "0", 1);
+    setenv("MQTT_MAINT_EVERY_S", "0", 1);   // no maintenance passes during the run
+    unsetenv("MQTT_RULES_FILE");
+
+    int batched = strcmp(mode, "row") != 0;
+    snprintf(buf, sizeof(buf), "%d", batched ? g_batch_max : 1);
+    setenv("MQTT_BATCH_MAX", buf, 1);
+    snprintf(buf, sizeof(buf), "%d", g_batch_ms);
+    setenv("MQTT_BATCH_MS", buf, 1);
+    setenv("MQTT_WRITER_THREAD", strcmp(mode, "thread") == 0 ? "1" : "0", 1);
+
+    execl(g_collector, g_collector, (char*)NULL);
+    perror(g_collector);
+    _exit(127);
+}
+
+static void collector_stop(pid_t pid) {
+    if (pid <= 0) return;
+    kill(pid, SIGTERM);
+    for (int i = 0; i < 100; ++i) {   // up to 10 s for the final flush
+        if (waitpid(pid, NULL, WNOHANG) == pid) return;
+        usleep(100 * 1000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+/* ---------- DB reader ---------- */
+typedef struct {
+    sqlite3       *db;
+    sqlite3_stmt  *rows;     // SELECT id, payload FROM messages_raw WHERE id > ?
+    sqlite3_int64  last_id;
+    uint32_t      *lat_us;   // one latency sample per stored row
+    size_t         n, cap;
+    uint64_t       last_seen_us;
+} reader_t;
+
+static int reader_open(reader_t *r, const char *path, int wait_s) {
+    uint64_t deadline = now_us() + (uint64_t)wait_s * 1000000u;
+    while (now_us() < deadline) {
+        if (sqlite3_open_v2(path, &r->db, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK) {
+            sqlite3_busy_timeout(r->db, 100);
+            if (sqlite3_prepare_v2(r->db, "SELECT id, payload FROM messages_raw WHERE id > ? ORDER BY id",
+                                   -1, &r->rows, NULL) == SQLITE_OK) return 0;
+        }
+        sqlite3_close(r->db);
+        r->db = NULL;
+        usleep(100 * 1000);
+    }
+    return -1;
+}
+
+static void reader_close(reader_t *r) {
+    if (r->rows) sqlite3_finalize(r->rows);
+    if (r->db) sqlite3_close(r->db);
+    free(r->lat_us);
+    memset(r, 0, sizeof(*r));
+}
+
+// Read rows committed since the last poll; record latencies if requested.
+static size_t reader_poll(reader_t *r, int record) {
+    size_t got = 0;
+    uint64_t t = now_us();
+    sqlite3_bind_int64(r->rows, 1, r->last_id);
+    while (sqlite3_step(r->rows) == SQLITE_ROW) {
+        r->last_id = sqlite3_column_int64(r->rows, 0);
+        got++;
+        if (!record) continue;
+        const char *p = (const char*)sqlite3_column_text(r->rows, 1);
+        uint64_t sent = p ? strtoull(p, NULL, 10) : 0;
+        if (!sent) continue;
+        if (r->n == r->cap) {
+            size_t nc = r->cap ? r->cap * 2 : 4096;
+            uint32_t *nl = realloc(r->lat_us, nc * sizeof(*nl));
+            if (!nl) continue;
+            r->lat_us = nl;
+            r->cap = nc;
+        }
+        uint64_t d = t > sent ? t - sent : 0;
+        r->lat_us[r->n++] = d > UINT32_MAX ? UINT32_MAX : (uint32_t)d;
+    }
+    sqlite3_reset(r->rows);
+    if (got) r->last_seen_us = t;
+    return got;
+}
+
+static sqlite3_int64 db_logical_bytes(const char *path) {
+    sqlite3 *db = NULL;
+    sqlite3_int64 bytes = -1;
+    if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK) {
+        sqlite3_stmt *st = NULL;
+        if (sqlite3_prepare_v2(db, "SELECT (SELECT page_count FROM pragma_page_count()) - "
+                                   "(SELECT freelist_count FROM pragma_freelist_count()), "
+                                   "(SELECT page_size FROM pragma_page_size())", -1, &st, NULL) == SQLITE_OK &&
+            sqlite3_step(st) == SQLITE_ROW) {
+            bytes = sqlite3_column_int64(st, 0) * sqlite3_column_int64(st, 1);
+        }
+        sqlite3_finalize(st);
+    }
+    sqlite3_close(db);
+    return bytes;
+}
+
+/* ---------- Poller thread (reads the DB while main publishes) ---------- */
+typedef struct {
+    reader_t        *r;
+    atomic_int       stop;
+    atomic_size_t    seen;   // r->n as published to the main thread
+} poller_t;
+
+static void *poller_main(void *arg) {
+    poller_t *p = arg;
+    while (!p->stop) {
+        if (reader_poll(p->r, 1)) atomic_store_explicit(&p->seen, p->r->n, memory_order_relaxed);
+        usleep(2000);   // 2 ms poll granularity bounds the latency resolution
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double pct_ms(const uint32_t *v, size_t n, double p) {
+    if (!n) return 0.0;
+    size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+    return v[i] / 1000.0;
+}
+
+/* ---------- One run ---------- */
+static int run_mode(struct mosquitto *mosq, const char *mode) {
+    char db[512], log[512], wal[520], shm[520], filter[64], topic[96];
+    snprintf(db, sizeof(db), "%s/bench_%s.db", g_dir, mode);
+    snprintf(log, sizeof(log), "%s/bench_%s.log", g_dir, mode);
+    snprintf(wal, sizeof(wal), "%s-wal", db);
+    snprintf(shm, sizeof(shm), "%s-shm", db);
+    unlink(db); unlink(wal); unlink(shm);
+
+    char prefix[48];
+    snprintf(prefix, sizeof(prefix), "bench/%d/%s", (int)getpid(), mode);
+    snprintf(filter, sizeof(filter), "%s/#", prefix);
+
+    pid_t pid = collector_start(mode, db, log, filter);
+    if (pid < 0) { perror("fork"); return -1; }
+
+    reader_t r;
+    memset(&r, 0, sizeof(r));
+    if (reader_open(&r, db, 10) != 0) {
+        fprintf(stderr, "[%s] collector did not create %s (see %s)\n", mode, db, log);
+        collector_stop(pid);
+        return -1;
+    }
+
+    // Warm-up: publish probes until one is stored, so the subscription is live.
+    snprintf(topic, sizeof(topic), "%s/probe", prefix);
+    int live = 0;
+    for (int i = 0; i < 100 && !live; ++i) {
+        mosquitto_publish(mosq, NULL, topic, 5, "probe", 0, false);
+        usleep(100 * 1000);
+        if (reader_poll(&r, 0) > 0) live = 1;
+    }
+    if (!live) {
+        fprintf(stderr, "[%s] no rows arrived within 10 s (see %s)\n", mode, log);
+        reader_close(&r);
+        collector_stop(pid);
+        return -1;
+    }
+    usleep((unsigned)(g_batch_ms + 200) * 1000);   // let the last probe batch commit
+    reader_poll(&r, 0);
+    sqlite3_int64 base_bytes = db_logical_bytes(db);
+
+    poller_t poller;
+    poller.r = &r;
+    atomic_init(&poller.stop, 0);
+    atomic_init(&poller.seen, 0);
+    pthread_t th;
+    if (pthread_create(&th, NULL, poller_main, &poller) != 0) {
+        reader_close(&r);
+        collector_stop(pid);
+        return -1;
+    }
+
+    char *payload = malloc((size_t)g_payload + 32);
+    if (!payload) { atomic_store(&poller.stop, 1); pthread_join(th, NULL); reader_close(&r); collector_stop(pid); return -1; }
+    unsigned long sent = 0, pub_err = 0;
+    uint64_t t0 = now_us(), t_end = t0 + (uint64_t)g_seconds * 1000000u;
+    uint64_t next = t0;
+    double step_us = g_rate > 0 ? 1e6 / g_rate : 0.0;
+    while (now_us() < t_end) {
+        if (g_rate > 0) {
+            sleep_until_us(next);
+            next = t0 + (uint64_t)((double)(sent + 1) * step_us);
+        }
+        snprintf(topic, sizeof(topic), "%s/t%lu", prefix, sent % (unsigned long)g_topics);
+        int len = snprintf(payload, (size_t)g_payload + 32, "%llu", (unsigned long long)now_us());
+        if (len < g_payload) { memset(payload + len, ' ', (size_t)(g_payload - len)); len = g_payload; }
+        if (mosquitto_publish(mosq, NULL, topic, len, payload, 0, false) == MOSQ_ERR_SUCCESS) sent++;
+        else pub_err++;
+    }
+    uint64_t t_pub = now_us();
+    free(payload);
+
+    // Drain: wait until every row is visible, at most BENCH_DRAIN_S.
+    uint64_t drain_end = t_pub + (uint64_t)g_drain_s * 1000000u;
+    while (now_us() < drain_end && atomic_load_explicit(&poller.seen, memory_order_relaxed) < sent) usleep(10 * 1000);
+    atomic_store(&poller.stop, 1);
+    pthread_join(th, NULL);
+
+    collector_stop(pid);
+    sqlite3_int64 final_bytes = db_logical_bytes(db);
+
+    qsort(r.lat_us, r.n, sizeof(*r.lat_us), cmp_u32);
+    double pub_s = (double)(t_pub - t0) / 1e6;
+    double act_s = r.last_seen_us > t0 ? (double)(r.last_seen_us - t0) / 1e6 : pub_s;
+    double bpm = (r.n && base_bytes >= 0 && final_bytes >= base_bytes)
+                 ? (double)(final_bytes - base_bytes) / (double)r.n : 0.0;
+    printf("%-7s %9lu %9zu %7lu %9.0f %9.0f %8.2f %8.2f %8.2f %8.2f %8.1f\n",
+           mode, sent, r.n, sent > r.n ? sent - (unsigned long)r.n : 0ul,
+           pub_s > 0 ? sent / pub_s : 0.0, act_s > 0 ? r.n / act_s : 0.0,
+           pct_ms(r.lat_us, r.n, 0.50), pct_ms(r.lat_us, r.n, 0.99), pct_ms(r.lat_us, r.n, 0.999),
+           r.n ? r.lat_us[r.n - 1] / 1000.0 : 0.0, bpm);
+    fflush(stdout);
+    if (pub_err) fprintf(stderr, "[%s] %lu publish errors\n", mode, pub_err);
+
+    reader_close(&r);
+    return 0;
+}
+
+int main(void) {
+    snprintf(g_broker, sizeof(g_broker), "%s", env_or_default("BENCH_BROKER", "127.0.0.1"));
+    g_port      = env_or_default_int("BENCH_PORT", 1883);
+    g_topics    = env_or_default_int("BENCH_TOPICS", 16);
+    g_payload   = env_or_default_int("BENCH_PAYLOAD", 16);
+    g_rate      = env_or_default_int("BENCH_RATE", 500);
+    g_seconds   = env_or_default_int("BENCH_SECONDS", 10);
+    g_drain_s   = env_or_default_int("BENCH_DRAIN_S", 5);
+    g_batch_max = env_or_default_int("BENCH_BATCH_MAX", 200);
+    g_batch_ms  = env_or_default_int("BENCH_BATCH_MS", 1000);
+    snprintf(g_modes, sizeof(g_modes), "%s", env_or_default("BENCH_MODES", "row,batch,thread"));
+    snprintf(g_collector, sizeof(g_collector), "%s", env_or_default("BENCH_COLLECTOR", "./mqtt_to_sqlite"));
+    snprintf(g_dir, sizeof(g_dir), "%s", env_or_default("BENCH_DIR", "/tmp"));
+    if (g_topics < 1) g_topics = 1;
+    if (g_payload < 1) g_payload = 1;
+    if (g_payload > 65536) g_payload = 65536;
+    signal(SIGPIPE, SIG_IGN);
+
+    mosquitto_lib_init();
+    char id[64];
+    snprintf(id, sizeof(id), "bench-pub-%d", (int)getpid());
+    struct mosquitto *mosq = mosquitto_new(id, true, NULL);
+    if (!mosq) { fprintf(stderr, "mosquitto_new failed\n"); return 1; }
+    int rc = mosquitto_connect(mosq, g_broker, g_port, 30);
+    if (rc != MOSQ_ERR_SUCCESS) {
+        fprintf(stderr, "connect %s:%d failed: %s\n", g_broker, g_port, mosquitto_strerror(rc));
+        return 1;
+    }
+    mosquitto_loop_start(mosq);
+
+    printf("# broker %s:%d, %d topic(s), %d byte payload, rate %s%d msg/s, %d s per mode\n",
+           g_broker, g_port, g_topics, g_payload, g_rate > 0 ? "" : "max/", g_rate, g_seconds);
+    printf("%-7s %9s %9s %7s %9s %9s %8s %8s %8s %8s %8s\n",
+           "mode", "sent", "stored", "lost", "offer/s", "store/s", "p50ms", "p99ms", "p999ms", "maxms", "B/msg");
+
+    int failed = 0;
+    char *save = NULL;
+    for (char *m = strtok_r(g_modes, ",", &save); m; m = strtok_r(NULL, ",", &save)) {
+        if (strcmp(m, "row") && strcmp(m, "batch") && strcmp(m, "thread")) {
+            fprintf(stderr, "unknown mode '%s' (row, batch, thread)\n", m);
+            failed = 1;
+            continue;
+        }
+        if (run_mode(mosq, m) != 0) failed = 1;
+    }
+
+    mosquitto_disconnect(mosq);
+    mosquitto_loop_stop(mosq, false);
+    mosquitto_destroy(mosq);
+    mosquitto_lib_cleanup();
+    return failed ? 1 : 0;
+}
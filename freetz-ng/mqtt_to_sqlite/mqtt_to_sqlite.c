@@ -5,11 +5,44 @@
 //  - Sleep after running network repair script.
 //  - Exponential backoff between reconnect attempts.
 //  - Exits ONLY on SIGINT/SIGTERM.
+//  - Optional batched inserts: MQTT_BATCH_MAX rows or MQTT_BATCH_MS per transaction.
+//  - Optional writer thread (MQTT_WRITER_THREAD=1): the MQTT callback only copies
+//    messages into a preallocated bounded queue; SQLite runs on its own thread.
+//  - Topics live in a 'topics' dictionary (cached in-process); rows in
+//    'messages_raw' store topic_id. A 'messages' view keeps the old columns.
+//  - Numeric payloads are also stored as REAL 'value' (covering index on
+//    topic_id, ts, value) for Grafana time-series queries.
+//  - rollup_1m / rollup_1h (min/max/avg/count/last) maintained in memory and
+//    written with the insert batches, for long-range panels; last_ts keeps
+//    replayed older samples from replacing 'last'.
+//  - Retention/compaction while idle: per-topic-prefix max age for raw rows
+//    (MQTT_RETENTION), chunked deletes, incremental vacuum, passive checkpoint.
+//  - Optional rules file (MQTT_RULES_FILE): several subscriptions, exclude
+//    filters and per-topic sampling ("every N s", "on change > delta").
+//  - Runtime metrics (MQTT_METRICS_EVERY_S): counters and latency histograms,
+//    published under MQTT_METRICS_TOPIC and/or written as a Prometheus file.
+//  - Spool replays from the Wemos ("spool/<age_ms>/<topic>") are stored under
+//    the original topic with the original event time (MQTT_SPOOL_PREFIX).
+//  - Optional supervisor (MQTT_SUPERVISOR=1) instead of the repair script:
+//    follows ppp0 via rtnetlink, reconnects as soon as it is back, and
+//    escalates to SIGHUP pppd and a DTR/RTS hard reset (wemos_reset.c).
+//  - Several gateways in one process (MQTT_BROKERS): one mosquitto network
+//    thread each, all feeding the writer queue; rows carry gateway_id
+//    (view messages_gw; 'messages' stays index-only for panels).
+//  - Optional read replica for Grafana (MQTT_REPLICA_PATH): rollups plus a
+//    recent raw window, refreshed incrementally in small steps; or a full
+//    copy with the online backup API (MQTT_REPLICA_MODE=full).
+//  - Optional archive (MQTT_ARCHIVE_AFTER_DAYS): old numeric rows become one
+//    Gorilla-compressed block per topic and day (tsz.c), read back through
+//    the mqtt_archive virtual table (archive_vtab.c).
 
 #define _POSIX_C_SOURCE 200809L
 
 #include <mosquitto.h>
 #include <sqlite3.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,7 +50,18 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "wemos_reset.h"
+#include "tsz.h"
 
 static volatile sig_atomic_t g_should_stop = 0;
 
@@ -30,6 +74,26 @@ static int  g_broker_port = 1883;
 static char g_topic[128] = "#";  // subscribe to all (your request)
 static char g_db_path[256] = "./mqtt_messages.db";
 static char g_netfix_script[256] = "./handle_network_error.sh";
+static char g_rules_path[256] = "";
+
+// Gateways (Wemos brokers) rows are collected from. Without MQTT_BROKERS there
+// is a single one, MQTT_BROKER, driven by the manual loop in main(). With it,
+// each gateway gets its own mosquitto network thread (mosquitto_loop_start) and
+// all of them feed the writer queue, so one SQLite connection serves N links.
+enum { GATEWAYS_MAX = 8 };
+typedef struct {
+    char              name[48];    // gateways.name, default: host
+    char              host[128];
+    int               port;
+    struct mosquitto *mosq;
+    sqlite3_int64     db_id;       // gateways.id
+    int               on_link;     // host is the supervisor's PPP peer
+    atomic_int        connected;
+    atomic_ulong      msgs_rx;
+} gateway_t;
+static gateway_t g_gw[GATEWAYS_MAX];
+static int       g_gw_n  = 0;
+static int       g_fanin = 0;      // MQTT_BROKERS given
 
 static int  g_reconnect_min = 2;    // seconds
 static int  g_reconnect_max = 60;   // seconds
@@ -38,6 +102,41 @@ static int  g_sleep_after_script = 5; // seconds
 static time_t g_last_script_run = 0;
 static const int SCRIPT_MIN_INTERVAL_SEC = 20;
 
+// Batched inserts: rows collect in one open transaction (SQLite page cache)
+// and are committed every g_batch_max rows or g_batch_ms, whichever is first.
+// g_batch_max <= 1 keeps the classic one-implicit-transaction-per-row mode.
+static int       g_batch_max = 1;
+static int       g_batch_ms  = 1000;
+static int       g_batch_rows = 0;        // rows inside the open transaction
+static long long g_batch_started_ms = 0;  // monotonic time of BEGIN
+
+// Writer thread: receive and SQLite writes are decoupled by a bounded queue.
+static int  g_writer_thread  = 0;
+static int  g_queue_cap      = 1024;  // queued messages
+static int  g_queue_slot     = 512;   // bytes per message (topic + NUL + payload)
+static int  g_queue_block    = 0;     // 0 = drop oldest when full, 1 = block receiver
+
+// Retention: raw rows older than the max age of the longest matching topic
+// prefix are deleted (rollups stay). Runs in small chunks while idle.
+enum { RETENTION_RULES_MAX = 32 };
+static struct { char prefix[96]; int days; } g_retention[RETENTION_RULES_MAX];
+static int  g_retention_n = 0;
+static int  g_retention_default_days = 0;  // 0 = keep forever
+static int  g_rollup_1m_days = 0;          // rollup_1m max age, 0 = forever
+static int  g_maint_every_s  = 60;
+static int  g_maint_budget_ms = 50;
+static int  g_maint_chunk    = 500;
+
+// Metrics export (0 = off). Topic prefix "" disables publishing, file "" the
+// Prometheus text file.
+static int  g_metrics_every_s = 0;
+static char g_metrics_topic[128] = "$SYS/mqtt2sqlite";
+static char g_metrics_file[256] = "";
+
+// Messages the Wemos buffered in flash during a PPP outage are replayed as
+// "<prefix><age_ms>/<topic>" ("-" = age unknown). "" disables unwrapping.
+static char g_spool_prefix[64] = "spool/";
+
 static const char *env_or_default(const char *name, const char *defval) {
     const char *v = getenv(name);
     return (v && *v) ? v : defval;
@@ -53,6 +152,12 @@ static int env_or_default_int(const char *name, int defval) {
     return (int)x;
 }
 
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000L;
+}
+
 static void log_ts(const char *level, const char *msg) {
     time_t now = time(NULL);
     struct tm tm;
@@ -96,6 +201,65 @@ static void print_inserted_message(time_t ts, const char *topic, const void *pay
             (payloadlen > MAX_SHOW ? "…" : ""));
 }
 
+/* ---------- Metrics ---------- */
+
+// Lock-free: counters and histograms are relaxed atomics, so the receive
+// thread, the writer and the exporter never contend. Histogram bucket i
+// counts samples of at most 2^i microseconds (up to ~67 s), matching the Prometheus
+// "le" bound it is exported with; the last one collects the rest.
+enum { HIST_BUCKETS = 28 };
+typedef struct {
+    atomic_ulong bucket[HIST_BUCKETS];
+    atomic_ulong count, sum_us, max_us;
+} hist_t;
+
+enum { H_STEP, H_COMMIT, H_LOOP, H_RECOVERY, H_COUNT };
+static const char *const HIST_NAME[H_COUNT] = { "insert_step", "commit", "loop", "recovery" };
+static hist_t g_hist[H_COUNT];
+
+typedef struct {
+    atomic_ulong msgs_rx, rows, insert_errors, commits, commit_errors;
+    atomic_ulong reconnects, reconnect_failures, repair_runs;
+    atomic_ulong sup_hups, sup_resets;
+} counters_t;
+static counters_t g_ctr;
+
+#define CTR_INC(c) atomic_fetch_add_explicit(&g_ctr.c, 1, memory_order_relaxed)
+#define CTR_GET(c) atomic_load_explicit(&g_ctr.c, memory_order_relaxed)
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000L;
+}
+
+static void hist_add(int h, long long us) {
+    hist_t *x = &g_hist[h];
+    unsigned long v = us > 0 ? (unsigned long)us : 0ul;
+    int b = 0;
+    while (b < HIST_BUCKETS - 1 && v > (1ul << b)) b++;
+    atomic_fetch_add_explicit(&x->bucket[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&x->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&x->sum_us, v, memory_order_relaxed);
+    // one writer per histogram, so load+store is enough for the max
+    if (v > atomic_load_explicit(&x->max_us, memory_order_relaxed))
+        atomic_store_explicit(&x->max_us, v, memory_order_relaxed);
+}
+
+// Upper bound (us) of the bucket holding quantile q, capped at the maximum seen.
+static unsigned long hist_quantile_us(int h, double q) {
+    const hist_t *x = &g_hist[h];
+    unsigned long n = atomic_load_explicit(&x->count, memory_order_relaxed), acc = 0;
+    if (!n) return 0;
+    unsigned long want = (unsigned long)(q * (double)n), max = atomic_load_explicit(&x->max_us, memory_order_relaxed);
+    if (want < 1) want = 1;
+    for (int b = 0; b < HIST_BUCKETS - 1; ++b) {
+        acc += atomic_load_explicit(&x->bucket[b], memory_order_relaxed);
+        if (acc >= want) return ((1ul << b) < max) ? (1ul << b) : max;
+    }
+    return max;
+}
+
 static void on_signal(int sig) {
     (void)sig;
     g_should_stop = 1;
@@ -108,6 +272,7 @@ static int run_network_repair_script(void) {
         return 0;
     }
     g_last_script_run = now;
+    CTR_INC(repair_runs);
 
     char cmd[512];
     snprintf(cmd, sizeof(cmd), "sh -c '%s'", g_netfix_script);
@@ -129,100 +294,2057 @@ static int run_network_repair_script(void) {
 
 /* ---------- SQLite ---------- */
 
+static sqlite3_stmt *g_stmt_topic_ins = NULL;
+static sqlite3_stmt *g_stmt_topic_sel = NULL;
+
+// Rollup tiers, in the order of topic_entry_t.roll[].
+enum { ROLLUP_TIERS = 2 };
+static const struct { const char *table; int secs; } ROLLUP[ROLLUP_TIERS] = {
+    { "rollup_1m", 60 },
+    { "rollup_1h", 3600 },
+};
+static sqlite3_stmt *g_stmt_rollup[ROLLUP_TIERS];
+
+static int db_exec(const char *sql) {
+    char *errmsg = NULL;
+    int rc = sqlite3_exec(g_db, sql, NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_exec(%.60s) failed: %s\n", sql, errmsg ? errmsg : sqlite3_errmsg(g_db));
+        sqlite3_free(errmsg);
+    }
+    return rc;
+}
+
+static int db_pragma_int(const char *sql) {
+    sqlite3_stmt *st = NULL;
+    int v = -1;
+    if (sqlite3_prepare_v2(g_db, sql, -1, &st, NULL) == SQLITE_OK &&
+        sqlite3_step(st) == SQLITE_ROW) {
+        v = sqlite3_column_int(st, 0);
+    }
+    sqlite3_finalize(st);
+    return v;
+}
+
+static int db_user_version(void) { return db_pragma_int("PRAGMA user_version;"); }
+
+static int db_has_table(const char *name) {
+    sqlite3_stmt *st = NULL;
+    int found = 0;
+    if (sqlite3_prepare_v2(g_db, "SELECT 1 FROM sqlite_master WHERE type='table' AND name=?;", -1, &st, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(st, 1, name, -1, SQLITE_STATIC);
+        found = (sqlite3_step(st) == SQLITE_ROW);
+    }
+    sqlite3_finalize(st);
+    return found;
+}
+
+// Schema v1: topics are stored once in a dictionary; rows carry topic_id.
+// The 'messages' view keeps the original column set for Grafana & friends.
+static const char *SCHEMA_V1 =
+    "CREATE TABLE IF NOT EXISTS topics ("
+    "  id    INTEGER PRIMARY KEY,"
+    "  name  TEXT    NOT NULL UNIQUE"
+    ");"
+    "CREATE TABLE IF NOT EXISTS messages_raw ("
+    "  id       INTEGER PRIMARY KEY AUTOINCREMENT,"
+    "  ts       INTEGER NOT NULL,"
+    "  topic_id INTEGER NOT NULL REFERENCES topics(id),"
+    "  payload  TEXT    NOT NULL,"
+    "  qos      INTEGER NOT NULL,"
+    "  retain   INTEGER NOT NULL"
+    ");"
+    "CREATE INDEX IF NOT EXISTS idx_messages_raw_ts ON messages_raw(ts);"
+    "CREATE INDEX IF NOT EXISTS idx_messages_raw_topic_ts ON messages_raw(topic_id, ts);";
+
+static const char *VIEW_V1 =
+    "CREATE VIEW messages AS"
+    "  SELECT m.id, m.ts, t.name AS topic, m.payload, m.qos, m.retain"
+    "  FROM messages_raw m JOIN topics t ON t.id = m.topic_id;";
+
+// Schema v2: numeric payloads parsed at ingest into 'value' (NULL otherwise)
+// and a covering (topic_id, ts, value) index, so time-series panels are
+// index-only range scans.
+static const char *SCHEMA_V2 =
+    "ALTER TABLE messages_raw ADD COLUMN value REAL;"
+    "UPDATE messages_raw SET value = mqtt_num(payload);"
+    "DROP INDEX IF EXISTS idx_messages_raw_topic_ts;"
+    "CREATE INDEX IF NOT EXISTS idx_messages_raw_topic_ts_value ON messages_raw(topic_id, ts, value);"
+    "DROP VIEW IF EXISTS messages;"
+    "CREATE VIEW messages AS"
+    "  SELECT m.id, m.ts, t.name AS topic, m.payload, m.qos, m.retain, m.value"
+    "  FROM messages_raw m JOIN topics t ON t.id = m.topic_id;"
+    "PRAGMA user_version=2;";
+
+// Schema v3: 1-minute / 1-hour aggregates per topic, kept incrementally at
+// ingest (see rollup_add) and backfilled once from existing rows.
+static const char *SCHEMA_V3 =
+    "CREATE TABLE IF NOT EXISTS rollup_1m ("
+    "  topic_id INTEGER NOT NULL,"
+    "  bucket   INTEGER NOT NULL,"   // bucket start, unix seconds
+    "  min REAL, max REAL, avg REAL, count INTEGER NOT NULL, last REAL,"
+    "  PRIMARY KEY (topic_id, bucket)"
+    ") WITHOUT ROWID;"
+    "CREATE TABLE IF NOT EXISTS rollup_1h ("
+    "  topic_id INTEGER NOT NULL,"
+    "  bucket   INTEGER NOT NULL,"
+    "  min REAL, max REAL, avg REAL, count INTEGER NOT NULL, last REAL,"
+    "  PRIMARY KEY (topic_id, bucket)"
+    ") WITHOUT ROWID;"
+    "INSERT OR IGNORE INTO rollup_1m"
+    "  SELECT g.topic_id, g.b, g.mn, g.mx, g.av, g.n, (SELECT value FROM messages_raw x WHERE x.id = g.last_id)"
+    "  FROM (SELECT topic_id, ts - ts % 60 AS b, MIN(value) mn, MAX(value) mx, AVG(value) av, COUNT(value) n, MAX(id) last_id"
+    "        FROM messages_raw WHERE value IS NOT NULL GROUP BY topic_id, b) g;"
+    "INSERT OR IGNORE INTO rollup_1h"
+    "  SELECT g.topic_id, g.b, g.mn, g.mx, g.av, g.n, (SELECT value FROM messages_raw x WHERE x.id = g.last_id)"
+    "  FROM (SELECT topic_id, ts - ts % 3600 AS b, MIN(value) mn, MAX(value) mx, AVG(value) av, COUNT(value) n, MAX(id) last_id"
+    "        FROM messages_raw WHERE value IS NOT NULL GROUP BY topic_id, b) g;"
+    "PRAGMA user_version=3;";
+
+// Schema v4: rows remember the gateway (broker) they arrived through; NULL for
+// rows from before. The view exposes its name.
+static const char *SCHEMA_V4 =
+    "CREATE TABLE IF NOT EXISTS gateways ("
+    "  id    INTEGER PRIMARY KEY,"
+    "  name  TEXT    NOT NULL UNIQUE"
+    ");"
+    "ALTER TABLE messages_raw ADD COLUMN gateway_id INTEGER REFERENCES gateways(id);"
+    "DROP VIEW IF EXISTS messages;"
+    "CREATE VIEW messages AS"
+    "  SELECT m.id, m.ts, t.name AS topic, m.payload, m.qos, m.retain, m.value, g.name AS gateway"
+    "  FROM messages_raw m JOIN topics t ON t.id = m.topic_id LEFT JOIN gateways g ON g.id = m.gateway_id;"
+    "PRAGMA user_version=4;";
+
+// Schema v5: compressed archive of closed days (MQTT_ARCHIVE_AFTER_DAYS).
+// topics.archived_until: everything of that topic before it is archived.
+static const char *SCHEMA_V5 =
+    "ALTER TABLE topics ADD COLUMN archived_until INTEGER NOT NULL DEFAULT 0;"
+    "CREATE TABLE IF NOT EXISTS archive_blocks ("
+    "  id        INTEGER PRIMARY KEY,"
+    "  topic_id  INTEGER NOT NULL REFERENCES topics(id),"
+    "  day       INTEGER NOT NULL,"   // UTC day start, unix seconds
+    "  t_first   INTEGER NOT NULL,"
+    "  t_last    INTEGER NOT NULL,"
+    "  count     INTEGER NOT NULL,"
+    "  data      BLOB    NOT NULL,"   // tsz.c stream
+    "  UNIQUE(topic_id, day)"
+    ");"
+    "PRAGMA user_version=5;";
+
+// Schema v6: 'messages' goes back to the v2 columns; the gateway join made
+// SQLite read gateway_id from the table row, so time-series panels lost the
+// index-only scans on idx_messages_raw_topic_ts_value. The gateway name is in
+// 'messages_gw' instead.
+static const char *SCHEMA_V6 =
+    "DROP VIEW IF EXISTS messages;"
+    "CREATE VIEW messages AS"
+    "  SELECT m.id, m.ts, t.name AS topic, m.payload, m.qos, m.retain, m.value"
+    "  FROM messages_raw m JOIN topics t ON t.id = m.topic_id;"
+    "DROP VIEW IF EXISTS messages_gw;"
+    "CREATE VIEW messages_gw AS"
+    "  SELECT m.id, m.ts, t.name AS topic, m.payload, m.qos, m.retain, m.value, g.name AS gateway"
+    "  FROM messages_raw m JOIN topics t ON t.id = m.topic_id LEFT JOIN gateways g ON g.id = m.gateway_id;"
+    "PRAGMA user_version=6;";
+
+// Schema v7: rollup_*.last_ts is the time of the sample in 'last', so a spool
+// replay of older data cannot replace the newest value of its bucket.
+// Backfilled from the raw rows still there; NULL (no raw rows) takes the next
+// write.
+static const char *SCHEMA_V7 =
+    "ALTER TABLE rollup_1m ADD COLUMN last_ts INTEGER;"
+    "ALTER TABLE rollup_1h ADD COLUMN last_ts INTEGER;"
+    "UPDATE rollup_1m SET last_ts = (SELECT MAX(m.ts) FROM messages_raw m WHERE m.topic_id = rollup_1m.topic_id"
+    "  AND m.ts >= rollup_1m.bucket AND m.ts < rollup_1m.bucket + 60 AND m.value IS NOT NULL);"
+    "UPDATE rollup_1h SET last_ts = (SELECT MAX(m.ts) FROM messages_raw m WHERE m.topic_id = rollup_1h.topic_id"
+    "  AND m.ts >= rollup_1h.bucket AND m.ts < rollup_1h.bucket + 3600 AND m.value IS NOT NULL);"
+    "PRAGMA user_version=7;";
+
+// Strict decimal number ("23.5", " -4 ", "1e3"); no hex, inf or nan.
+static int parse_numeric(const void *payload, int len, double *out) {
+    const char *p = (const char*)payload;
+    while (len > 0 && (*p == ' ' || *p == '\t')) { p++; len--; }
+    while (len > 0 && (p[len-1] == ' ' || p[len-1] == '\t' || p[len-1] == '\r' || p[len-1] == '\n')) len--;
+    char buf[64];
+    if (len <= 0 || len >= (int)sizeof(buf)) return 0;
+    int digits = 0;
+    for (int i = 0; i < len; ++i) {
+        char c = p[i];
+        if (c >= '0' && c <= '9') digits = 1;
+        else if (c != '.' && c != '-' && c != '+' && c != 'e' && c != 'E') return 0;
+    }
+    if (!digits) return 0;
+    memcpy(buf, p, (size_t)len);
+    buf[len] = '\0';
+    char *end = NULL;
+    double v = strtod(buf, &end);
+    if (end != buf + len) return 0;
+    *out = v;
+    return 1;
+}
+
+// SQL mqtt_num(payload): same parser, used to backfill 'value' on migration.
+static void sql_mqtt_num(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    (void)argc;
+    double v;
+    const unsigned char *t = sqlite3_value_text(argv[0]);
+    if (t && parse_numeric(t, sqlite3_value_bytes(argv[0]), &v)) sqlite3_result_double(ctx, v);
+    else sqlite3_result_null(ctx);
+}
+
+// Bring the file up to the current schema. Each step runs in its own
+// transaction and bumps PRAGMA user_version.
+static int db_migrate(void) {
+    int v = db_user_version();
+    if (v < 0) return -1;
+
+    if (v < 1) {
+        int legacy = db_has_table("messages");
+        if (legacy) log_ts("INFO", "Migrating 'messages' to topics/messages_raw (one-time)…");
+        if (db_exec("BEGIN;") != SQLITE_OK) return -1;
+        int ok = db_exec(SCHEMA_V1) == SQLITE_OK;
+        if (ok && legacy) {
+            ok = db_exec("INSERT OR IGNORE INTO topics(name) SELECT DISTINCT topic FROM messages;") == SQLITE_OK &&
+                 db_exec("INSERT INTO messages_raw (id, ts, topic_id, payload, qos, retain)"
+                         "  SELECT m.id, m.ts, t.id, m.payload, m.qos, m.retain"
+                         "  FROM messages m JOIN topics t ON t.name = m.topic ORDER BY m.id;") == SQLITE_OK &&
+                 db_exec("DROP TABLE messages;") == SQLITE_OK;  // also drops idx_messages_ts/_topic
+        }
+        ok = ok && db_exec(VIEW_V1) == SQLITE_OK && db_exec("PRAGMA user_version=1;") == SQLITE_OK;
+        if (!ok) { db_exec("ROLLBACK;"); return -1; }
+        if (db_exec("COMMIT;") != SQLITE_OK) return -1;
+        v = 1;
+    }
+    if (v < 2) {
+        log_ts("INFO", "Schema v2: adding numeric 'value' column and covering index…");
+        if (db_exec("BEGIN;") != SQLITE_OK) return -1;
+        if (db_exec(SCHEMA_V2) != SQLITE_OK) { db_exec("ROLLBACK;"); return -1; }
+        if (db_exec("COMMIT;") != SQLITE_OK) return -1;
+    }
+    if (v < 3) {
+        log_ts("INFO", "Schema v3: creating rollup_1m/rollup_1h…");
+        if (db_exec("BEGIN;") != SQLITE_OK) return -1;
+        if (db_exec(SCHEMA_V3) != SQLITE_OK) { db_exec("ROLLBACK;"); return -1; }
+        if (db_exec("COMMIT;") != SQLITE_OK) return -1;
+    }
+    if (v < 4) {
+        log_ts("INFO", "Schema v4: adding gateways and messages_raw.gateway_id…");
+        if (db_exec("BEGIN;") != SQLITE_OK) return -1;
+        if (db_exec(SCHEMA_V4) != SQLITE_OK) { db_exec("ROLLBACK;"); return -1; }
+        if (db_exec("COMMIT;") != SQLITE_OK) return -1;
+    }
+    if (v < 5) {
+        log_ts("INFO", "Schema v5: adding archive_blocks…");
+        if (db_exec("BEGIN;") != SQLITE_OK) return -1;
+        if (db_exec(SCHEMA_V5) != SQLITE_OK) { db_exec("ROLLBACK;"); return -1; }
+        if (db_exec("COMMIT;") != SQLITE_OK) return -1;
+    }
+    if (v < 6) {
+        log_ts("INFO", "Schema v6: messages view without gateway, adding messages_gw…");
+        if (db_exec("BEGIN;") != SQLITE_OK) return -1;
+        if (db_exec(SCHEMA_V6) != SQLITE_OK) { db_exec("ROLLBACK;"); return -1; }
+        if (db_exec("COMMIT;") != SQLITE_OK) return -1;
+    }
+    if (v < 7) {
+        log_ts("INFO", "Schema v7: adding rollup last_ts…");
+        if (db_exec("BEGIN;") != SQLITE_OK) return -1;
+        if (db_exec(SCHEMA_V7) != SQLITE_OK) { db_exec("ROLLBACK;"); return -1; }
+        if (db_exec("COMMIT;") != SQLITE_OK) return -1;
+    }
+    return 0;
+}
+
+static int db_prepare(const char *sql, sqlite3_stmt **st) {
+    int rc = sqlite3_prepare_v2(g_db, sql, -1, st, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_prepare_v2(%.60s) failed: %s\n", sql, sqlite3_errmsg(g_db));
+        return -1;
+    }
+    return 0;
+}
+
 static int db_init(const char *path) {
     int rc = sqlite3_open(path, &g_db);
     if (rc != SQLITE_OK) {
         fprintf(stderr, "sqlite3_open failed: %s\n", sqlite3_errmsg(g_db));
         return -1;
     }
+    // Only takes effect on a new file (so it goes first); existing ones need a one-time VACUUM.
+    sqlite3_exec(g_db, "PRAGMA auto_vacuum=INCREMENTAL;", NULL, NULL, NULL);
     // Tolerant pragmas for low-end devices and concurrent readers like Grafana.
     sqlite3_exec(g_db, "PRAGMA journal_mode=WAL;", NULL, NULL, NULL);
     sqlite3_exec(g_db, "PRAGMA synchronous=NORMAL;", NULL, NULL, NULL);
     sqlite3_exec(g_db, "PRAGMA temp_store=MEMORY;", NULL, NULL, NULL);
 
-    const char *ddl =
-        "CREATE TABLE IF NOT EXISTS messages ("
-        "  id       INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "  ts       INTEGER NOT NULL,"
-        "  topic    TEXT    NOT NULL,"
-        "  payload  TEXT    NOT NULL,"
-        "  qos      INTEGER NOT NULL,"
-        "  retain   INTEGER NOT NULL"
-        ");"
-        "CREATE INDEX IF NOT EXISTS idx_messages_ts ON messages(ts);"
-        "CREATE INDEX IF NOT EXISTS idx_messages_topic ON messages(topic);";
+    sqlite3_create_function(g_db, "mqtt_num", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sql_mqtt_num, NULL, NULL);
+    if (db_migrate() != 0) {
+        fprintf(stderr, "schema migration failed\n");
+        return -1;
+    }
 
-    char *errmsg = NULL;
-    rc = sqlite3_exec(g_db, ddl, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "sqlite3_exec(DDL) failed: %s\n", errmsg);
-        sqlite3_free(errmsg);
+    if (db_prepare("INSERT INTO messages_raw (ts, topic_id, payload, qos, retain, value, gateway_id) VALUES (?, ?, ?, ?, ?, ?, ?);", &g_stmt_insert) ||
+        db_prepare("INSERT OR IGNORE INTO topics (name) VALUES (?);", &g_stmt_topic_ins) ||
+        db_prepare("SELECT id FROM topics WHERE name = ?;", &g_stmt_topic_sel)) {
+        return -1;
+    }
+    // Merge a partial bucket aggregate into what is already stored; 'last'
+    // only moves forward in time (replays may bring older samples).
+    for (int i = 0; i < ROLLUP_TIERS; ++i) {
+        char sql[512];
+        snprintf(sql, sizeof(sql),
+                 "INSERT INTO %s (topic_id, bucket, min, max, avg, count, last, last_ts) VALUES (?, ?, ?, ?, ?, ?, ?, ?) "
+                 "ON CONFLICT(topic_id, bucket) DO UPDATE SET "
+                 "  min = MIN(min, excluded.min), max = MAX(max, excluded.max),"
+                 "  avg = (avg * count + excluded.avg * excluded.count) / (count + excluded.count),"
+                 "  count = count + excluded.count,"
+                 "  last = CASE WHEN last_ts IS NULL OR excluded.last_ts >= last_ts THEN excluded.last ELSE last END,"
+                 "  last_ts = MAX(coalesce(last_ts, excluded.last_ts), excluded.last_ts);",
+                 ROLLUP[i].table);
+        if (db_prepare(sql, &g_stmt_rollup[i])) return -1;
+    }
+    // Gateways are known from the environment; resolve their ids once.
+    sqlite3_stmt *gi = NULL, *gs = NULL;
+    if (db_prepare("INSERT OR IGNORE INTO gateways (name) VALUES (?);", &gi) ||
+        db_prepare("SELECT id FROM gateways WHERE name = ?;", &gs)) {
+        sqlite3_finalize(gi);
         return -1;
     }
+    for (int i = 0; i < g_gw_n; ++i) {
+        sqlite3_bind_text(gi, 1, g_gw[i].name, -1, SQLITE_STATIC);
+        sqlite3_step(gi);
+        sqlite3_reset(gi);
+        sqlite3_bind_text(gs, 1, g_gw[i].name, -1, SQLITE_STATIC);
+        if (sqlite3_step(gs) == SQLITE_ROW) g_gw[i].db_id = sqlite3_column_int64(gs, 0);
+        sqlite3_reset(gs);
+    }
+    sqlite3_finalize(gi);
+    sqlite3_finalize(gs);
+    return 0;
+}
 
-    const char *ins =
-        "INSERT INTO messages (ts, topic, payload, qos, retain) "
-        "VALUES (?, ?, ?, ?, ?);";
+/* ---------- Topic rules (subscriptions, exclude, sampling) ---------- */
 
-    rc = sqlite3_prepare_v2(g_db, ins, -1, &g_stmt_insert, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "sqlite3_prepare_v2 failed: %s\n", sqlite3_errmsg(g_db));
-        return -1;
+// Rules file, one rule per line ('#' starts a comment):
+//   subscribe <filter> [qos]     subscribe instead of MQTT_TOPIC (repeatable)
+//   exclude   <filter>           never store matching topics
+//   every     <filter> <sec>     store at most one row per <sec> seconds
+//   delta     <filter> <delta>   store only when the value moved by more than <delta>
+// Filters use MQTT wildcards and are compiled into a trie, so matching a new
+// topic costs O(topic depth); the result is cached per topic. If several
+// rules of a kind match, the first one in the file wins; 'every' and
+// 'delta' may combine (both must allow the row). Rollups still see every
+// numeric value of non-excluded topics.
+
+typedef struct rule_node {
+    char             *level;   // "+", "#" or a literal level
+    struct rule_node *child, *next;
+    int    exclude_line;       // line numbers, 0 = no rule ends here
+    int    every_line, every_s;
+    int    delta_line;
+    double delta;
+} rule_node_t;
+
+typedef struct {
+    int    exclude_line, every_line, every_s, delta_line;
+    double delta;
+} rule_match_t;
+
+enum { SUBS_MAX = 32 };
+static rule_node_t g_rules_root;
+static struct { char filter[128]; int qos; } g_subs[SUBS_MAX];
+static int g_subs_n = 0;
+static unsigned long g_rules_excluded = 0, g_rules_sampled = 0;
+
+static int filter_valid(const char *f) {
+    if (!*f) return 0;
+    for (const char *p = f; *p; ++p) {
+        int at_start = (p == f || p[-1] == '/');
+        int at_end = (p[1] == '\0' || p[1] == '/');
+        if (*p == '+' && !(at_start && at_end)) return 0;
+        if (*p == '#' && !(at_start && p[1] == '\0')) return 0;
+    }
+    return 1;
+}
+
+static rule_node_t *rules_insert(const char *filter) {
+    rule_node_t *n = &g_rules_root;
+    const char *lvl = filter;
+    for (;;) {
+        const char *slash = strchr(lvl, '/');
+        size_t len = slash ? (size_t)(slash - lvl) : strlen(lvl);
+        rule_node_t *c = n->child;
+        while (c && !(strlen(c->level) == len && strncmp(c->level, lvl, len) == 0)) c = c->next;
+        if (!c) {
+            c = calloc(1, sizeof(*c));
+            if (!c || !(c->level = strndup(lvl, len))) { free(c); return NULL; }
+            c->next = n->child;
+            n->child = c;
+        }
+        n = c;
+        if (!slash) return n;
+        lvl = slash + 1;
+    }
+}
+
+static void rules_collect(const rule_node_t *n, rule_match_t *m) {
+#define TAKE(line, ...) do { if (n->line && (!m->line || n->line < m->line)) { m->line = n->line; __VA_ARGS__; } } while (0)
+    TAKE(exclude_line, (void)0);
+    TAKE(every_line, m->every_s = n->every_s);
+    TAKE(delta_line, m->delta = n->delta);
+#undef TAKE
+}
+
+// lvl points at the current topic level, NULL once all levels are consumed.
+static void rules_match_from(const rule_node_t *n, const char *lvl, int first, rule_match_t *m) {
+    if (!lvl) {
+        rules_collect(n, m);
+        for (const rule_node_t *c = n->child; c; c = c->next) {
+            if (strcmp(c->level, "#") == 0) rules_collect(c, m);  // "a/#" also matches "a"
+        }
+        return;
+    }
+    const char *slash = strchr(lvl, '/');
+    size_t len = slash ? (size_t)(slash - lvl) : strlen(lvl);
+    const char *next = slash ? slash + 1 : NULL;
+    int wild_ok = !(first && lvl[0] == '$');  // wildcards never match $SYS & co. at the top
+    for (const rule_node_t *c = n->child; c; c = c->next) {
+        if (c->level[0] == '#' && !c->level[1]) {
+            if (wild_ok) rules_collect(c, m);
+        } else if (c->level[0] == '+' && !c->level[1]) {
+            if (wild_ok) rules_match_from(c, next, 0, m);
+        } else if (strlen(c->level) == len && strncmp(c->level, lvl, len) == 0) {
+            rules_match_from(c, next, 0, m);
+        }
+    }
+}
+
+static void rules_match(const char *topic, rule_match_t *m) {
+    memset(m, 0, sizeof(*m));
+    rules_match_from(&g_rules_root, topic, 1, m);
+}
+
+static void rules_free_node(rule_node_t *n) {
+    while (n) {
+        rule_node_t *next = n->next;
+        rules_free_node(n->child);
+        free(n->level);
+        free(n);
+        n = next;
+    }
+}
+
+static void rules_free(void) {
+    rules_free_node(g_rules_root.child);
+    memset(&g_rules_root, 0, sizeof(g_rules_root));
+}
+
+static int rules_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror(path); return -1; }
+    char line[512], msg[640];
+    int lineno = 0, nrules = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char kind[16], filter[256], arg[64];
+        int n = sscanf(line, "%15s %255s %63s", kind, filter, arg);
+        // '#' starts a comment as the first field or in place of the argument;
+        // the filter field is always a filter ("subscribe #", "every # 60")
+        if (n <= 0 || kind[0] == '#') continue;
+        if (n >= 3 && arg[0] == '#') n = 2;
+
+        int ok = (n >= 2) && filter_valid(filter);
+        if (ok && strcmp(kind, "subscribe") == 0) {
+            if (g_subs_n < SUBS_MAX && strlen(filter) < sizeof(g_subs[0].filter)) {
+                snprintf(g_subs[g_subs_n].filter, sizeof(g_subs[0].filter), "%s", filter);
+                g_subs[g_subs_n].qos = (n >= 3) ? atoi(arg) : 0;
+                g_subs_n++;
+            } else ok = 0;
+        } else if (ok && (strcmp(kind, "exclude") == 0 || (n >= 3 && (strcmp(kind, "every") == 0 || strcmp(kind, "delta") == 0)))) {
+            rule_node_t *node = rules_insert(filter);
+            if (!node) ok = 0;
+            else if (strcmp(kind, "exclude") == 0) { if (!node->exclude_line) node->exclude_line = lineno; }
+            else if (strcmp(kind, "every") == 0)   { if (!node->every_line) { node->every_line = lineno; node->every_s = atoi(arg); } }
+            else                                 { if (!node->delta_line) { node->delta_line = lineno; node->delta = strtod(arg, NULL); } }
+            nrules += ok;
+        } else {
+            ok = 0;
+        }
+        if (!ok) {
+            snprintf(msg, sizeof(msg), "%s:%d: ignoring invalid rule", path, lineno);
+            log_ts("WARN", msg);
+        }
+    }
+    fclose(f);
+    snprintf(msg, sizeof(msg), "Rules: %d subscription(s), %d filter rule(s) from %s", g_subs_n, nrules, path);
+    log_ts("INFO", msg);
+    return 0;
+}
+
+/* ---------- Topic dictionary cache ---------- */
+
+// topic -> topics.id, open addressing (linear probing) over stable entry
+// pointers. Only the thread that owns the DB connection touches it.
+// In-memory aggregate of the current bucket, not yet written to rollup_*.
+typedef struct {
+    long long bucket;
+    double    min, max, sum, last;
+    long long last_ts;      // sample time of 'last'
+    long      count;
+} rollup_acc_t;
+
+// Last stored row of one sample stream (see topic_sample_keep).
+typedef struct {
+    int            has;
+    time_t         ts;
+    double         value;
+    uint32_t       hash;
+} sample_state_t;
+
+typedef struct {
+    char          *name;
+    sqlite3_int64  id;      // 0 = not resolved yet
+    rollup_acc_t   roll[ROLLUP_TIERS];
+    // topic rules, resolved once through the trie
+    int            rules_done, excluded, every_s, has_delta;
+    double         delta;
+    // sampling state: live rows, and late rows (spool replays older than live.ts)
+    sample_state_t live, late;
+} topic_entry_t;
+
+static struct {
+    topic_entry_t **slots;
+    size_t cap, used;
+} g_topics;
+
+static uint32_t topic_hash(const char *s) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619u; }
+    return h;
+}
+
+static int topic_cache_grow(void) {
+    size_t ncap = g_topics.cap ? g_topics.cap * 2 : 256;
+    topic_entry_t **ns = calloc(ncap, sizeof(*ns));
+    if (!ns) return -1;
+    for (size_t i = 0; i < g_topics.cap; ++i) {
+        topic_entry_t *e = g_topics.slots[i];
+        if (!e) continue;
+        size_t j = topic_hash(e->name) & (ncap - 1);
+        while (ns[j]) j = (j + 1) & (ncap - 1);
+        ns[j] = e;
     }
+    free(g_topics.slots);
+    g_topics.slots = ns;
+    g_topics.cap = ncap;
     return 0;
 }
 
+// Find or create the cache entry for a topic (NULL only on OOM).
+static topic_entry_t *topic_cache_get(const char *name) {
+    if ((g_topics.used + 1) * 4 > g_topics.cap * 3 && topic_cache_grow() != 0) return NULL;
+    size_t j = topic_hash(name) & (g_topics.cap - 1);
+    for (topic_entry_t *e; (e = g_topics.slots[j]) != NULL; j = (j + 1) & (g_topics.cap - 1)) {
+        if (strcmp(e->name, name) == 0) return e;
+    }
+    topic_entry_t *e = calloc(1, sizeof(*e));
+    if (!e || !(e->name = strdup(name))) { free(e); return NULL; }
+    g_topics.slots[j] = e;
+    g_topics.used++;
+    return e;
+}
+
+// After a rolled-back transaction, ids assigned inside it are gone again.
+static void topic_cache_forget_ids(void) {
+    for (size_t i = 0; i < g_topics.cap; ++i) {
+        if (g_topics.slots[i]) g_topics.slots[i]->id = 0;
+    }
+}
+
+static void topic_cache_free(void) {
+    for (size_t i = 0; i < g_topics.cap; ++i) {
+        if (g_topics.slots[i]) { free(g_topics.slots[i]->name); free(g_topics.slots[i]); }
+    }
+    free(g_topics.slots);
+    memset(&g_topics, 0, sizeof(g_topics));
+}
+
+// Resolve topics.id, inserting the topic on first sight. Returns 0 on error.
+static sqlite3_int64 topic_resolve(topic_entry_t *e) {
+    if (e->id) return e->id;
+    sqlite3_bind_text(g_stmt_topic_ins, 1, e->name, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(g_stmt_topic_ins);
+    sqlite3_reset(g_stmt_topic_ins);
+    sqlite3_clear_bindings(g_stmt_topic_ins);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "sqlite3_step(topic insert) failed: %s\n", sqlite3_errmsg(g_db));
+        return 0;
+    }
+    sqlite3_bind_text(g_stmt_topic_sel, 1, e->name, -1, SQLITE_STATIC);
+    if (sqlite3_step(g_stmt_topic_sel) == SQLITE_ROW) e->id = sqlite3_column_int64(g_stmt_topic_sel, 0);
+    sqlite3_reset(g_stmt_topic_sel);
+    sqlite3_clear_bindings(g_stmt_topic_sel);
+    return e->id;
+}
+
+static void topic_rules_resolve(topic_entry_t *e) {
+    rule_match_t m;
+    rules_match(e->name, &m);
+    e->excluded  = m.exclude_line != 0;
+    e->every_s   = m.every_line ? m.every_s : 0;
+    e->has_delta = m.delta_line != 0;
+    e->delta     = m.delta;
+    e->rules_done = 1;
+}
+
+static int sample_state_keep(const topic_entry_t *e, sample_state_t *st, time_t ts,
+                             const void *payload, int payloadlen, int numeric, double value) {
+    uint32_t h = 0;
+    if (e->has_delta && !numeric) {
+        h = 2166136261u;
+        for (int i = 0; i < payloadlen; ++i) { h ^= ((const unsigned char*)payload)[i]; h *= 16777619u; }
+    }
+    if (st->has) {
+        if (e->every_s > 0 && ts - st->ts < e->every_s) return 0;
+        if (e->has_delta) {
+            if (numeric) {
+                double d = value - st->value;
+                if ((d < 0 ? -d : d) <= e->delta) return 0;
+            } else if (h == st->hash) {
+                return 0;               // unchanged text payload
+            }
+        }
+    }
+    st->has = 1;
+    st->ts = ts;
+    if (numeric) st->value = value;
+    else st->hash = h;
+    return 1;
+}
+
+// Sampling decision for one message of a non-excluded topic; updates the
+// per-topic state when the row is going to be stored. A row older than the
+// last live one (spool replay; the gateway flushes newer rows first) is
+// sampled against the previous late row instead and leaves the live state
+// alone; the first of a replay run is always kept.
+static int topic_sample_keep(topic_entry_t *e, time_t ts, const void *payload, int payloadlen, int numeric, double value) {
+    if (e->live.has && ts < e->live.ts) {
+        if (e->late.has && ts < e->late.ts) e->late.has = 0;   // a new, older replay run
+        return sample_state_keep(e, &e->late, ts, payload, payloadlen, numeric, value);
+    }
+    return sample_state_keep(e, &e->live, ts, payload, payloadlen, numeric, value);
+}
+
 static void db_close(void) {
     if (g_stmt_insert) { sqlite3_finalize(g_stmt_insert); g_stmt_insert = NULL; }
+    if (g_stmt_topic_ins) { sqlite3_finalize(g_stmt_topic_ins); g_stmt_topic_ins = NULL; }
+    if (g_stmt_topic_sel) { sqlite3_finalize(g_stmt_topic_sel); g_stmt_topic_sel = NULL; }
+    for (int i = 0; i < ROLLUP_TIERS; ++i) {
+        if (g_stmt_rollup[i]) { sqlite3_finalize(g_stmt_rollup[i]); g_stmt_rollup[i] = NULL; }
+    }
+    topic_cache_free();
     if (g_db) { sqlite3_close(g_db); g_db = NULL; }
 }
 
-static void db_insert_message(const char *topic, const void *payload, int payloadlen, int qos, int retain) {
-    if (!g_stmt_insert) return;
-    time_t now = time(NULL);
+/* ---------- Rollups ---------- */
 
-    sqlite3_reset(g_stmt_insert);
-    sqlite3_clear_bindings(g_stmt_insert);
+static long long g_last_insert_ms = 0;      // for idle detection (maintenance)
+static int       g_rollup_dirty = 0;        // accumulators with unwritten data
+// Oldest bucket per tier written since the rollup replica last copied it.
+static long long g_rollup_changed_from[ROLLUP_TIERS] = { LLONG_MAX, LLONG_MAX };
+static long long g_rollup_flushed_ms = 0;
 
-    sqlite3_bind_int64(g_stmt_insert, 1, (sqlite3_int64)now);
-    sqlite3_bind_text (g_stmt_insert, 2, topic, -1, SQLITE_TRANSIENT);
+static void rollup_write(topic_entry_t *e, int tier) {
+    rollup_acc_t *a = &e->roll[tier];
+    if (a->count <= 0 || !e->id) return;
+    sqlite3_stmt *st = g_stmt_rollup[tier];
+    sqlite3_bind_int64 (st, 1, e->id);
+    sqlite3_bind_int64 (st, 2, a->bucket);
+    sqlite3_bind_double(st, 3, a->min);
+    sqlite3_bind_double(st, 4, a->max);
+    sqlite3_bind_double(st, 5, a->sum / (double)a->count);
+    sqlite3_bind_int64 (st, 6, a->count);
+    sqlite3_bind_double(st, 7, a->last);
+    sqlite3_bind_int64 (st, 8, a->last_ts);
+    if (a->bucket < g_rollup_changed_from[tier]) g_rollup_changed_from[tier] = a->bucket;
+    if (sqlite3_step(st) != SQLITE_DONE) {
+        fprintf(stderr, "sqlite3_step(%s) failed: %s\n", ROLLUP[tier].table, sqlite3_errmsg(g_db));
+    }
+    sqlite3_reset(st);
+    a->count = 0;
+}
+
+// Fold one numeric sample into the per-topic buckets. A bucket that is
+// left behind is written immediately; open buckets go out with the batch.
+static void rollup_add(topic_entry_t *e, time_t ts, double v) {
+    for (int i = 0; i < ROLLUP_TIERS; ++i) {
+        rollup_acc_t *a = &e->roll[i];
+        long long b = (long long)ts - (long long)ts % ROLLUP[i].secs;
+        if (a->count > 0 && a->bucket != b) rollup_write(e, i);
+        if (a->count == 0) {
+            a->bucket = b;
+            a->min = a->max = a->sum = v;
+            a->last = v; a->last_ts = ts;
+        } else {
+            if (v < a->min) a->min = v;
+            if (v > a->max) a->max = v;
+            a->sum += v;
+            if (ts >= a->last_ts) { a->last = v; a->last_ts = ts; }
+        }
+        a->count++;
+    }
+    g_rollup_dirty = 1;
+}
+
+static void rollup_flush_all(void) {
+    if (g_rollup_dirty) {
+        for (size_t i = 0; i < g_topics.cap; ++i) {
+            topic_entry_t *e = g_topics.slots[i];
+            if (!e) continue;
+            for (int t = 0; t < ROLLUP_TIERS; ++t) rollup_write(e, t);
+        }
+        g_rollup_dirty = 0;
+    }
+    g_rollup_flushed_ms = now_ms();
+}
+
+/* ---------- Query replica (MQTT_REPLICA_PATH) ---------- */
+
+// Grafana reads a separate file instead of the live one, so long dashboard
+// queries can neither block WAL checkpoints nor wait for ingest. The DB thread
+// refreshes it every MQTT_REPLICA_EVERY_S, in small steps and only between its
+// own transactions. The replica is in rollback-journal mode (readers need no
+// -wal/-shm) and each refresh commits at once, so a query sees one complete
+// snapshot. Two modes (MQTT_REPLICA_MODE):
+//  - rollups (default): a persistent file with topics, gateways, rollup_1m/1h
+//    and the last MQTT_REPLICA_RAW_HOURS of messages_raw. A refresh copies only
+//    what changed: rollup buckets written since the last one
+//    (g_rollup_changed_from) and raw rows past the last copied id. Small
+//    enough for flash or tmpfs.
+//  - full: a complete copy with the online backup API into "<path>.tmp",
+//    MQTT_REPLICA_STEP_PAGES pages per step, renamed over <path>. Reads and
+//    writes the whole database every time; opt-in for small databases.
+static char      g_replica_path[256] = "";
+static int       g_replica_full = 0;
+static int       g_replica_every_s = 30;
+static int       g_replica_step_pages = 128;
+static int       g_replica_raw_hours = 24;
+enum { REPLICA_STEP_GAP_MS = 50, REPLICA_STEP_ROWS = 5000, REPLICA_STEP_TOPICS = 16 };
+
+// Rollup replica refresh: one write transaction on the replica, spread over
+// steps; the attached source is read from one snapshot throughout.
+enum { RP_IDLE, RP_DIMS, RP_ROLLUPS, RP_RAW, RP_TRIM, RP_COMMIT };
+
+static struct {
+    sqlite3        *db;
+    sqlite3_backup *bk;                      // full mode
+    long long       next_ms, started_ms, step_ms;
+    int             steps;
+    // rollups mode
+    int             phase, tier;
+    long long       from[ROLLUP_TIERS];      // buckets to copy in this refresh
+    sqlite3_int64   topic_cur, raw_id, rows;
+} g_rep;
+
+static const char *REPLICA_SCHEMA =
+    "PRAGMA journal_mode=DELETE;"
+    "CREATE TABLE IF NOT EXISTS topics (id INTEGER PRIMARY KEY, name TEXT NOT NULL UNIQUE,"
+    "  archived_until INTEGER NOT NULL DEFAULT 0);"
+    "CREATE TABLE IF NOT EXISTS gateways (id INTEGER PRIMARY KEY, name TEXT NOT NULL UNIQUE);"
+    "CREATE TABLE IF NOT EXISTS messages_raw (id INTEGER PRIMARY KEY, ts INTEGER NOT NULL,"
+    "  topic_id INTEGER NOT NULL, payload TEXT NOT NULL, qos INTEGER NOT NULL, retain INTEGER NOT NULL,"
+    "  value REAL, gateway_id INTEGER);"
+    "CREATE INDEX IF NOT EXISTS idx_messages_raw_ts ON messages_raw(ts);"
+    "CREATE INDEX IF NOT EXISTS idx_messages_raw_topic_ts_value ON messages_raw(topic_id, ts, value);"
+    "CREATE TABLE IF NOT EXISTS rollup_1m (topic_id INTEGER NOT NULL, bucket INTEGER NOT NULL,"
+    "  min REAL, max REAL, avg REAL, count INTEGER NOT NULL, last REAL, last_ts INTEGER,"
+    "  PRIMARY KEY (topic_id, bucket)) WITHOUT ROWID;"
+    "CREATE TABLE IF NOT EXISTS rollup_1h (topic_id INTEGER NOT NULL, bucket INTEGER NOT NULL,"
+    "  min REAL, max REAL, avg REAL, count INTEGER NOT NULL, last REAL, last_ts INTEGER,"
+    "  PRIMARY KEY (topic_id, bucket)) WITHOUT ROWID;"
+    "CREATE VIEW IF NOT EXISTS messages AS"
+    "  SELECT m.id, m.ts, t.name AS topic, m.payload, m.qos, m.retain, m.value"
+    "  FROM messages_raw m JOIN topics t ON t.id = m.topic_id;"
+    "CREATE VIEW IF NOT EXISTS messages_gw AS"
+    "  SELECT m.id, m.ts, t.name AS topic, m.payload, m.qos, m.retain, m.value, g.name AS gateway"
+    "  FROM messages_raw m JOIN topics t ON t.id = m.topic_id LEFT JOIN gateways g ON g.id = m.gateway_id;";
+
+static void replica_abort(void) {
+    char tmp[272];
+    if (!g_replica_path[0]) return;
+    if (g_rep.bk) { sqlite3_backup_finish(g_rep.bk); g_rep.bk = NULL; }
+    if (g_rep.db && g_rep.phase != RP_IDLE) {
+        sqlite3_exec(g_rep.db, "ROLLBACK;", NULL, NULL, NULL);
+        for (int i = 0; i < ROLLUP_TIERS; ++i)          // not copied after all
+            if (g_rep.from[i] < g_rollup_changed_from[i]) g_rollup_changed_from[i] = g_rep.from[i];
+        g_rep.phase = RP_IDLE;
+    }
+    if (g_rep.db) { sqlite3_close(g_rep.db); g_rep.db = NULL; }
+    if (g_replica_full) {
+        snprintf(tmp, sizeof(tmp), "%s.tmp", g_replica_path);
+        unlink(tmp);
+    }
+}
+
+static void replica_full_finish(void) {
+    char tmp[272], buf[400];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g_replica_path);
+    int pages = sqlite3_backup_pagecount(g_rep.bk);
+    int rc = sqlite3_backup_finish(g_rep.bk);
+    g_rep.bk = NULL;
+    if (rc == SQLITE_OK) rc = sqlite3_exec(g_rep.db, "PRAGMA journal_mode=DELETE;", NULL, NULL, NULL);
+    sqlite3_close(g_rep.db);
+    g_rep.db = NULL;
+    if (rc != SQLITE_OK || rename(tmp, g_replica_path) != 0) {
+        snprintf(buf, sizeof(buf), "Replica: refresh of %s failed (%s)", g_replica_path,
+                 rc != SQLITE_OK ? sqlite3_errstr(rc) : strerror(errno));
+        log_ts("WARN", buf);
+        unlink(tmp);
+        return;
+    }
+    snprintf(buf, sizeof(buf), "Replica: %s refreshed, %d pages in %d steps, %lld ms",
+             g_replica_path, pages, g_rep.steps, now_ms() - g_rep.started_ms);
+    log_ts("INFO", buf);
+}
+
+static void replica_full_step(long long t) {
+    if (!g_rep.bk) {
+        if (t < g_rep.next_ms) return;
+        g_rep.next_ms = t + (long long)g_replica_every_s * 1000;
+        char tmp[272];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", g_replica_path);
+        unlink(tmp);
+        if (sqlite3_open(tmp, &g_rep.db) != SQLITE_OK ||
+            !(g_rep.bk = sqlite3_backup_init(g_rep.db, "main", g_db, "main"))) {
+            char buf[400];
+            snprintf(buf, sizeof(buf), "Replica: cannot start copy to %s: %s", tmp, sqlite3_errmsg(g_rep.db));
+            log_ts("WARN", buf);
+            replica_abort();
+            return;
+        }
+        g_rep.started_ms = t;
+        g_rep.steps = 0;
+    } else if (t - g_rep.step_ms < REPLICA_STEP_GAP_MS) {
+        return;
+    }
+    g_rep.step_ms = t;
+    g_rep.steps++;
+    int rc = sqlite3_backup_step(g_rep.bk, g_replica_step_pages);
+    if (rc == SQLITE_DONE) replica_full_finish();
+    else if (rc != SQLITE_OK && rc != SQLITE_BUSY && rc != SQLITE_LOCKED) {
+        char buf[200];
+        snprintf(buf, sizeof(buf), "Replica: backup step failed: %s", sqlite3_errstr(rc));
+        log_ts("WARN", buf);
+        replica_abort();
+    }
+}
+
+// Runs sql on the replica connection with up to three int64 parameters;
+// returns the sqlite3 result code and, for queries, the first column of the
+// first row in *out (left alone when there is none or it is NULL).
+static int replica_exec(const char *sql, sqlite3_int64 a, sqlite3_int64 b, sqlite3_int64 c, sqlite3_int64 *out) {
+    sqlite3_stmt *st = NULL;
+    int rc = sqlite3_prepare_v2(g_rep.db, sql, -1, &st, NULL);
+    if (rc != SQLITE_OK) return rc;
+    int np = sqlite3_bind_parameter_count(st);
+    if (np >= 1) sqlite3_bind_int64(st, 1, a);
+    if (np >= 2) sqlite3_bind_int64(st, 2, b);
+    if (np >= 3) sqlite3_bind_int64(st, 3, c);
+    rc = sqlite3_step(st);
+    if (rc == SQLITE_ROW && out && sqlite3_column_type(st, 0) != SQLITE_NULL) *out = sqlite3_column_int64(st, 0);
+    if (rc == SQLITE_ROW || rc == SQLITE_DONE) rc = SQLITE_OK;
+    sqlite3_finalize(st);
+    return rc;
+}
+
+// Opens (or creates) the persistent rollup replica and attaches the live file
+// as 'src'. What the first refresh copies follows from what the file has.
+static int replica_rollups_open(void) {
+    const char *src = sqlite3_db_filename(g_db, "main");
+    sqlite3_stmt *st = NULL;
+    int rc = sqlite3_open(g_replica_path, &g_rep.db);
+    if (rc == SQLITE_OK) rc = sqlite3_exec(g_rep.db, REPLICA_SCHEMA, NULL, NULL, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(g_rep.db, "ATTACH ?1 AS src;", -1, &st, NULL);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_text(st, 1, src && *src ? src : g_db_path, -1, SQLITE_STATIC);
+        rc = sqlite3_step(st) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(g_rep.db);
+    }
+    sqlite3_finalize(st);
+    if (rc != SQLITE_OK) {
+        char buf[400];
+        snprintf(buf, sizeof(buf), "Replica: cannot open %s: %s", g_replica_path,
+                 g_rep.db ? sqlite3_errmsg(g_rep.db) : sqlite3_errstr(rc));
+        log_ts("WARN", buf);
+        sqlite3_close(g_rep.db);
+        g_rep.db = NULL;
+        return -1;
+    }
+    // Buckets from the newest one the file has (it may have changed since);
+    // an empty table gets everything.
+    for (int i = 0; i < ROLLUP_TIERS; ++i) {
+        char sql[96];
+        sqlite3_int64 b = LLONG_MIN;
+        snprintf(sql, sizeof(sql), "SELECT max(bucket) FROM main.%s;", ROLLUP[i].table);
+        replica_exec(sql, 0, 0, 0, &b);
+        if (b < g_rollup_changed_from[i]) g_rollup_changed_from[i] = b;
+    }
+    // Raw rows after the newest copied one, but not before the window.
+    sqlite3_int64 id = 0, first = 0;
+    replica_exec("SELECT max(id) FROM main.messages_raw;", 0, 0, 0, &id);
+    if (g_replica_raw_hours > 0)
+        replica_exec("SELECT min(id) - 1 FROM src.messages_raw WHERE ts >= ?1;",
+                     (sqlite3_int64)time(NULL) - (sqlite3_int64)g_replica_raw_hours * 3600, 0, 0, &first);
+    else
+        replica_exec("SELECT max(id) FROM src.messages_raw;", 0, 0, 0, &first);
+    g_rep.raw_id = id > first ? id : first;
+    return 0;
+}
+
+// One bounded piece of a rollup replica refresh. SQLITE_BUSY (a reader on the
+// replica, or the live file busy) just retries on the next call.
+static int replica_rollups_piece(void) {
+    char sql[640];
+    int rc = SQLITE_OK;
+    const sqlite3_int64 cutoff = (sqlite3_int64)time(NULL) - (sqlite3_int64)g_replica_raw_hours * 3600;
+    switch (g_rep.phase) {
+    case RP_DIMS:
+        rc = replica_exec("INSERT INTO main.topics SELECT id, name, archived_until FROM src.topics WHERE true"
+                          " ON CONFLICT(id) DO UPDATE SET archived_until = excluded.archived_until"
+                          " WHERE archived_until != excluded.archived_until;", 0, 0, 0, NULL);
+        if (rc == SQLITE_OK)
+            rc = replica_exec("INSERT OR IGNORE INTO main.gateways SELECT id, name FROM src.gateways;", 0, 0, 0, NULL);
+        if (rc == SQLITE_OK) { g_rep.phase = RP_ROLLUPS; g_rep.tier = 0; g_rep.topic_cur = 0; }
+        break;
+    case RP_ROLLUPS: {
+        // REPLICA_STEP_TOPICS topics at a time, each a seek on (topic_id, bucket)
+        sqlite3_int64 hi = -1;
+        rc = replica_exec("SELECT max(id) FROM (SELECT id FROM src.topics WHERE id > ?1 ORDER BY id LIMIT ?2);",
+                          g_rep.topic_cur, REPLICA_STEP_TOPICS, 0, &hi);
+        if (rc != SQLITE_OK) break;
+        if (hi < 0 || g_rep.from[g_rep.tier] == LLONG_MAX) {
+            g_rep.topic_cur = 0;
+            if (++g_rep.tier == ROLLUP_TIERS) g_rep.phase = RP_RAW;
+            break;
+        }
+        const char *tb = ROLLUP[g_rep.tier].table;
+        snprintf(sql, sizeof(sql),
+                 "INSERT INTO main.%s SELECT r.topic_id, r.bucket, r.min, r.max, r.avg, r.count, r.last, r.last_ts"
+                 "  FROM src.topics t JOIN src.%s r ON r.topic_id = t.id AND r.bucket >= ?3"
+                 "  WHERE t.id > ?1 AND t.id <= ?2"
+                 " ON CONFLICT(topic_id, bucket) DO UPDATE SET min = excluded.min, max = excluded.max,"
+                 "  avg = excluded.avg, count = excluded.count, last = excluded.last, last_ts = excluded.last_ts;",
+                 tb, tb);
+        rc = replica_exec(sql, g_rep.topic_cur, hi, g_rep.from[g_rep.tier], NULL);
+        if (rc == SQLITE_OK) { g_rep.rows += sqlite3_changes(g_rep.db); g_rep.topic_cur = hi; }
+        break;
+    }
+    case RP_RAW: {
+        sqlite3_int64 hi = -1;
+        if (g_replica_raw_hours <= 0) { g_rep.phase = RP_TRIM; break; }
+        rc = replica_exec("SELECT max(id) FROM (SELECT id FROM src.messages_raw WHERE id > ?1 ORDER BY id LIMIT ?2);",
+                          g_rep.raw_id, REPLICA_STEP_ROWS, 0, &hi);
+        if (rc != SQLITE_OK) break;
+        if (hi < 0) { g_rep.phase = RP_TRIM; break; }
+        rc = replica_exec("INSERT OR REPLACE INTO main.messages_raw"
+                          "  SELECT id, ts, topic_id, payload, qos, retain, value, gateway_id FROM src.messages_raw"
+                          "  WHERE id > ?1 AND id <= ?2 AND ts >= ?3;", g_rep.raw_id, hi, cutoff, NULL);
+        if (rc == SQLITE_OK) { g_rep.rows += sqlite3_changes(g_rep.db); g_rep.raw_id = hi; }
+        break;
+    }
+    case RP_TRIM:
+        // Follow the window and the live file's rollup_1m retention.
+        rc = replica_exec("DELETE FROM main.messages_raw WHERE ts < ?1;", cutoff, 0, 0, NULL);
+        if (rc == SQLITE_OK && g_rollup_1m_days > 0)
+            rc = replica_exec("DELETE FROM main.rollup_1m WHERE topic_id IN (SELECT id FROM main.topics) AND bucket < ?1;",
+                              (sqlite3_int64)time(NULL) - (sqlite3_int64)g_rollup_1m_days * 86400, 0, 0, NULL);
+        if (rc == SQLITE_OK) g_rep.phase = RP_COMMIT;
+        break;
+    case RP_COMMIT:
+        rc = replica_exec("COMMIT;", 0, 0, 0, NULL);
+        if (rc == SQLITE_OK) {
+            char buf[400];
+            g_rep.phase = RP_IDLE;
+            snprintf(buf, sizeof(buf), "Replica: %s refreshed, %lld rows in %d steps, %lld ms",
+                     g_replica_path, (long long)g_rep.rows, g_rep.steps, now_ms() - g_rep.started_ms);
+            if (g_rep.rows > 0) log_ts("INFO", buf);
+        }
+        break;
+    }
+    return rc;
+}
 
-    char *pl = NULL;
-    if (payload && payloadlen >= 0) {
-        pl = (char*)malloc((size_t)payloadlen + 1);
-        if (pl) {
-            memcpy(pl, payload, (size_t)payloadlen);
-            pl[payloadlen] = '\0';
+static void replica_rollups_step(long long t) {
+    if (g_rep.phase == RP_IDLE) {
+        if (t < g_rep.next_ms) return;
+        g_rep.next_ms = t + (long long)g_replica_every_s * 1000;
+        if (!g_rep.db && replica_rollups_open() != 0) return;
+        if (replica_exec("BEGIN IMMEDIATE;", 0, 0, 0, NULL) != SQLITE_OK) return;   // a writer? try next time
+        for (int i = 0; i < ROLLUP_TIERS; ++i) {
+            g_rep.from[i] = g_rollup_changed_from[i];
+            g_rollup_changed_from[i] = LLONG_MAX;
         }
+        g_rep.phase = RP_DIMS;
+        g_rep.started_ms = t;
+        g_rep.steps = 0;
+        g_rep.rows = 0;
+    } else if (t - g_rep.step_ms < REPLICA_STEP_GAP_MS) {
+        return;
+    }
+    g_rep.step_ms = t;
+    g_rep.steps++;
+    int rc = replica_rollups_piece();
+    if (rc != SQLITE_OK && rc != SQLITE_BUSY && rc != SQLITE_LOCKED) {
+        char buf[400];
+        snprintf(buf, sizeof(buf), "Replica: refresh of %s failed: %s", g_replica_path, sqlite3_errmsg(g_rep.db));
+        log_ts("WARN", buf);
+        replica_abort();                          // reopened on the next refresh
+    }
+}
+
+// Called by the DB thread after each insert (so right after a batch commit)
+// and when idle. Never inside a transaction.
+static void replica_maybe_step(void) {
+    if (!g_replica_path[0] || !g_db || !sqlite3_get_autocommit(g_db)) return;
+    if (g_replica_full) replica_full_step(now_ms());
+    else replica_rollups_step(now_ms());
+}
+
+/* ---------- Batching ---------- */
+
+static void db_batch_begin(void) {
+    if (g_batch_max <= 1 || g_batch_rows > 0 || !sqlite3_get_autocommit(g_db)) return;
+    if (db_exec("BEGIN;") == SQLITE_OK) g_batch_started_ms = now_ms();
+}
+
+// Commit the open batch (if any). On failure the transaction is kept open
+// when SQLite still has it (e.g. SQLITE_BUSY) so the next flush retries.
+// Open rollup buckets are written inside the same transaction.
+static void db_batch_flush(void) {
+    if (!g_db) return;
+    if (g_rollup_dirty) {
+        if (sqlite3_get_autocommit(g_db) && db_exec("BEGIN;") == SQLITE_OK) g_batch_started_ms = now_ms();
+        rollup_flush_all();
+    }
+    if (sqlite3_get_autocommit(g_db)) { g_batch_rows = 0; return; }
+    long long t0 = now_us();
+    int rc = db_exec("COMMIT;");
+    hist_add(H_COMMIT, now_us() - t0);
+    if (rc == SQLITE_OK) {
+        CTR_INC(commits);
+        g_batch_rows = 0;
+    } else {
+        CTR_INC(commit_errors);
+    }
+    if (rc != SQLITE_OK && sqlite3_get_autocommit(g_db)) {
+        char buf[120];
+        snprintf(buf, sizeof(buf), "Batch of %d rows rolled back", g_batch_rows);
+        log_ts("ERROR", buf);
+        g_batch_rows = 0;
+        topic_cache_forget_ids();
+    }
+}
+
+static int db_batch_pending(void) { return g_batch_rows > 0 || g_rollup_dirty; }
+
+static long long db_batch_deadline_ms(void) {
+    return (g_batch_rows > 0 ? g_batch_started_ms : g_rollup_flushed_ms) + g_batch_ms;
+}
+
+static void db_batch_maybe_flush(void) {
+    if (!db_batch_pending()) return;
+    if (g_batch_rows >= g_batch_max || now_ms() >= db_batch_deadline_ms()) db_batch_flush();
+}
+
+// How long the MQTT loop may block without overrunning the batch window.
+static int db_batch_wait_ms(int max_ms) {
+    if (!db_batch_pending()) return max_ms;
+    long long left = db_batch_deadline_ms() - now_ms();
+    if (left < 0) return 0;
+    return (left < max_ms) ? (int)left : max_ms;
+}
+
+static void db_insert_message(time_t now, const char *topic, const void *payload, int payloadlen, int qos, int retain, int gw) {
+    if (!g_stmt_insert) return;
+
+    g_last_insert_ms = now_ms();
+    topic_entry_t *te = topic_cache_get(topic);
+    if (!te) return;
+    if (!te->rules_done) topic_rules_resolve(te);
+    if (te->excluded) { g_rules_excluded++; return; }
+    sqlite3_int64 topic_id = topic_resolve(te);
+    if (!topic_id) return;
+
+    if (!payload || payloadlen < 0) { payload = ""; payloadlen = 0; }
+    double value;
+    int numeric = parse_numeric(payload, payloadlen, &value);
+    if (numeric) rollup_add(te, now, value);
+    if (!topic_sample_keep(te, now, payload, payloadlen, numeric, value)) {
+        g_rules_sampled++;
+        db_batch_maybe_flush();
+        return;
     }
-    sqlite3_bind_text (g_stmt_insert, 3, pl ? pl : "", -1, SQLITE_TRANSIENT);
+
+    db_batch_begin();
+
+    // Zero-copy: bind the payload in place with an explicit length. The
+    // buffers (mosquitto message or queue slot) outlive the step, and the
+    // bindings are cleared right after it, so SQLITE_STATIC is safe and the
+    // hot path does no allocation.
+    sqlite3_bind_int64(g_stmt_insert, 1, (sqlite3_int64)now);
+    sqlite3_bind_int64(g_stmt_insert, 2, topic_id);
+    sqlite3_bind_text (g_stmt_insert, 3, (const char*)payload, payloadlen, SQLITE_STATIC);
     sqlite3_bind_int  (g_stmt_insert, 4, qos);
     sqlite3_bind_int  (g_stmt_insert, 5, retain);
+    if (numeric) sqlite3_bind_double(g_stmt_insert, 6, value);
+    else sqlite3_bind_null(g_stmt_insert, 6);
+    if (g_gw[gw].db_id) sqlite3_bind_int64(g_stmt_insert, 7, g_gw[gw].db_id);
+    else sqlite3_bind_null(g_stmt_insert, 7);
 
+    long long t0 = now_us();
     int rc = sqlite3_step(g_stmt_insert);
+    hist_add(H_STEP, now_us() - t0);  // per-row mode: includes the implicit commit
     if (rc != SQLITE_DONE) {
+        CTR_INC(insert_errors);
         fprintf(stderr, "sqlite3_step(insert) failed: %s\n", sqlite3_errmsg(g_db));
     } else {
-        print_inserted_message(now, topic, payload, payloadlen, qos, retain);
+        CTR_INC(rows);
+        if (!sqlite3_get_autocommit(g_db)) g_batch_rows++;
+        if (g_log_inserts) print_inserted_message(now, topic, payload, payloadlen, qos, retain);
     }
+    sqlite3_reset(g_stmt_insert);
+    sqlite3_clear_bindings(g_stmt_insert);
 
-    if (pl) free(pl);
+    db_batch_maybe_flush();
+    replica_maybe_step();
 }
 
-/* ---------- MQTT callbacks (lightweight; no exits) ---------- */
+/* ---------- Retention / compaction ---------- */
 
-static void handle_connect(struct mosquitto *mosq, void *obj, int rc) {
-    (void)obj;
-    (void)mosq;
+enum { MAINT_IDLE_MS = 250, MAINT_TOPICS_PER_STEP = 64, MAINT_VACUUM_PAGES = 256 };
 
+static long long g_maint_next_ms = 0;
+static sqlite3_int64 g_maint_cursor = 0;   // resume after this topic id
+static long long g_maint_last_pass_ms = 0; // duration of the last pass
+
+// "obk=30,diag/=7,*=365": prefix=days, '*' is the default.
+static void retention_parse(const char *spec) {
+    g_retention_n = 0;
+    while (spec && *spec) {
+        const char *comma = strchr(spec, ',');
+        size_t len = comma ? (size_t)(comma - spec) : strlen(spec);
+        const char *eq = memchr(spec, '=', len);
+        if (eq) {
+            size_t plen = (size_t)(eq - spec);
+            int days = atoi(eq + 1);
+            if (plen == 1 && spec[0] == '*') {
+                g_retention_default_days = days;
+            } else if (g_retention_n < RETENTION_RULES_MAX && plen < sizeof(g_retention[0].prefix)) {
+                memcpy(g_retention[g_retention_n].prefix, spec, plen);
+                g_retention[g_retention_n].prefix[plen] = '\0';
+                g_retention[g_retention_n].days = days;
+                g_retention_n++;
+            }
+        }
+        spec = comma ? comma + 1 : NULL;
+    }
+}
+
+static int retention_days_for(const char *topic) {
+    size_t best = 0;
+    int days = g_retention_default_days;
+    for (int i = 0; i < g_retention_n; ++i) {
+        size_t plen = strlen(g_retention[i].prefix);
+        if (plen > best && strncmp(topic, g_retention[i].prefix, plen) == 0) {
+            best = plen;
+            days = g_retention[i].days;
+        }
+    }
+    return days;
+}
+
+static int retention_enabled(void) {
+    if (g_retention_default_days > 0 || g_rollup_1m_days > 0) return 1;
+    for (int i = 0; i < g_retention_n; ++i) if (g_retention[i].days > 0) return 1;
+    return 0;
+}
+
+// Delete rows of one topic older than cutoff, one autocommit chunk at a
+// time. Returns rows deleted; *more is set when the budget ran out first.
+static long maint_delete_chunks(const char *sql, sqlite3_int64 topic_id, long long cutoff, long long deadline, int *more) {
+    sqlite3_stmt *st = NULL;
+    long total = 0;
+    if (db_prepare(sql, &st)) return 0;
+    for (;;) {
+        sqlite3_bind_int64(st, 1, topic_id);
+        sqlite3_bind_int64(st, 2, cutoff);
+        sqlite3_bind_int  (st, 3, g_maint_chunk);
+        int rc = sqlite3_step(st);
+        sqlite3_reset(st);
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "retention delete failed: %s\n", sqlite3_errmsg(g_db));
+            break;
+        }
+        int n = sqlite3_changes(g_db);
+        total += n;
+        if (n < g_maint_chunk) break;
+        if (now_ms() >= deadline) { *more = 1; break; }
+    }
+    sqlite3_finalize(st);
+    return total;
+}
+
+/* ---------- Archive (MQTT_ARCHIVE_AFTER_DAYS) ---------- */
+
+// Closed UTC days of numeric rows older than MQTT_ARCHIVE_AFTER_DAYS move into
+// one archive_blocks row per topic and day, compressed by tsz.c (delta-of-delta
+// timestamps, XOR'd doubles: a few bytes per point instead of a row plus two
+// index entries). Only ts and value survive; text rows stay in messages_raw and
+// the rollups are not touched. topics.archived_until records the progress.
+// Read back with the mqtt_archive virtual table / tool (archive_vtab.c).
+static int           g_archive_after_days = 0;  // 0 = off
+static sqlite3_int64 g_archive_cursor = 0;      // resume after this topic id
+
+static int archive_bind_step(sqlite3_stmt *st, sqlite3_int64 topic_id, long long a, long long b) {
+    sqlite3_bind_int64(st, 1, topic_id);
+    sqlite3_bind_int64(st, 2, a);
+    sqlite3_bind_int64(st, 3, b);
+    return sqlite3_step(st);
+}
+
+// Encodes one topic-day and replaces its numeric rows by the block, atomically.
+// Returns the number of points, or -1 (rolled back).
+static long archive_day(sqlite3_int64 topic_id, long long day) {
+    sqlite3_stmt *sel = NULL, *ins = NULL, *del = NULL, *upd = NULL;
+    tsz_enc_t enc;
+    long n = 0;
+    long long t_first = 0, t_last = 0;
+    if (tsz_enc_init(&enc) != 0) return -1;
+    int ok = db_exec("BEGIN;") == SQLITE_OK &&
+        !db_prepare("SELECT ts, value FROM messages_raw"
+                    " WHERE topic_id = ?1 AND ts >= ?2 AND ts < ?3 AND value IS NOT NULL ORDER BY ts, id;", &sel) &&
+        !db_prepare("INSERT INTO archive_blocks (topic_id, day, t_first, t_last, count, data) VALUES (?, ?, ?, ?, ?, ?);", &ins) &&
+        !db_prepare("DELETE FROM messages_raw"
+                    " WHERE topic_id = ?1 AND ts >= ?2 AND ts < ?3 AND value IS NOT NULL;", &del) &&
+        !db_prepare("UPDATE topics SET archived_until = ?2 WHERE id = ?1;", &upd);
+    if (ok) {
+        int rc;
+        sqlite3_bind_int64(sel, 1, topic_id);
+        sqlite3_bind_int64(sel, 2, day);
+        sqlite3_bind_int64(sel, 3, day + 86400);
+        while ((rc = sqlite3_step(sel)) == SQLITE_ROW) {
+            long long t = sqlite3_column_int64(sel, 0);
+            if (tsz_enc_add(&enc, t, sqlite3_column_double(sel, 1)) != 0) { rc = SQLITE_NOMEM; break; }
+            if (!n++) t_first = t;
+            t_last = t;
+        }
+        ok = rc == SQLITE_DONE;
+    }
+    size_t len = 0;
+    const uint8_t *blob = (ok && n > 0) ? tsz_enc_finish(&enc, &len) : NULL;
+    if (ok && n > 0) {
+        sqlite3_bind_int64(ins, 1, topic_id);
+        sqlite3_bind_int64(ins, 2, day);
+        sqlite3_bind_int64(ins, 3, t_first);
+        sqlite3_bind_int64(ins, 4, t_last);
+        sqlite3_bind_int64(ins, 5, n);
+        if (blob) sqlite3_bind_blob(ins, 6, blob, (int)len, SQLITE_STATIC);
+        ok = blob && sqlite3_step(ins) == SQLITE_DONE &&
+             archive_bind_step(del, topic_id, day, day + 86400) == SQLITE_DONE;
+    }
+    if (ok) {
+        sqlite3_bind_int64(upd, 1, topic_id);
+        sqlite3_bind_int64(upd, 2, day + 86400);
+        ok = sqlite3_step(upd) == SQLITE_DONE;
+    }
+    sqlite3_finalize(sel);
+    sqlite3_finalize(ins);
+    sqlite3_finalize(del);
+    sqlite3_finalize(upd);
+    tsz_enc_free(&enc);
+    if (ok && db_exec("COMMIT;") == SQLITE_OK) return n;
+    fprintf(stderr, "archive of topic %lld day %lld failed: %s\n", (long long)topic_id, day, sqlite3_errmsg(g_db));
+    if (!sqlite3_get_autocommit(g_db)) db_exec("ROLLBACK;");
+    return -1;
+}
+
+// Works through the topics whose archive lags behind the cutoff, day by day.
+// Returns the number of points archived in this pass.
+static long archive_run(long long deadline, int *more) {
+    long long cutoff = (long long)time(NULL);
+    cutoff -= cutoff % 86400;                                  // start of today (UTC)
+    cutoff -= (long long)(g_archive_after_days - 1) * 86400;   // 1 = everything before today
+    long points = 0;
+    while (!*more && now_ms() < deadline) {
+        sqlite3_int64 ids[MAINT_TOPICS_PER_STEP];
+        long long from[MAINT_TOPICS_PER_STEP];
+        int n = 0;
+        sqlite3_stmt *st = NULL;
+        if (db_prepare("SELECT id, archived_until FROM topics WHERE id > ? AND archived_until < ? ORDER BY id LIMIT ?;", &st)) break;
+        sqlite3_bind_int64(st, 1, g_archive_cursor);
+        sqlite3_bind_int64(st, 2, cutoff);
+        sqlite3_bind_int  (st, 3, MAINT_TOPICS_PER_STEP);
+        while (sqlite3_step(st) == SQLITE_ROW) {
+            ids[n]  = sqlite3_column_int64(st, 0);
+            from[n] = sqlite3_column_int64(st, 1);
+            n++;
+        }
+        sqlite3_finalize(st);
+        if (n == 0) { g_archive_cursor = 0; break; }  // all topics caught up
+
+        sqlite3_stmt *next = NULL;
+        if (db_prepare("SELECT ts FROM messages_raw WHERE topic_id = ?1 AND ts >= ?2 AND ts < ?3"
+                       " AND value IS NOT NULL ORDER BY ts LIMIT 1;", &next)) break;
+        for (int i = 0; i < n && !*more; ++i) {
+            for (;;) {
+                // next day of this topic that still has numeric rows
+                int rc = archive_bind_step(next, ids[i], from[i], cutoff);
+                long long ts = rc == SQLITE_ROW ? sqlite3_column_int64(next, 0) : -1;
+                sqlite3_reset(next);
+                long long day = ts >= 0 ? ts - ts % 86400 : cutoff;
+                if (ts < 0) {
+                    // none left: only move the mark (archive_day with an empty day)
+                    day = cutoff - 86400;
+                    if (day < from[i]) day = from[i];
+                }
+                long got = archive_day(ids[i], day);
+                if (got < 0) break;  // leave this topic for the next pass
+                points += got;
+                from[i] = day + 86400;
+                if (ts < 0 || from[i] >= cutoff) break;
+                if (now_ms() >= deadline) { *more = 1; break; }
+            }
+            if (!*more) g_archive_cursor = ids[i];
+        }
+        sqlite3_finalize(next);
+    }
+    return points;
+}
+
+static void maint_run(void) {
+    long long t0 = now_ms();
+    long long deadline = t0 + g_maint_budget_ms;
+    long raw = 0, roll = 0, blocks = 0, archived = 0;
+    int more = 0;
+    time_t now = time(NULL);
+
+    db_batch_flush();  // never delete inside an ingest transaction
+
+    // Topic ids are fetched in small groups so no read statement stays open
+    // across the deletes (that would turn them into one long transaction).
+    while (retention_enabled() && !more && now_ms() < deadline) {
+        sqlite3_int64 ids[MAINT_TOPICS_PER_STEP];
+        int days[MAINT_TOPICS_PER_STEP];
+        int n = 0;
+        sqlite3_stmt *st = NULL;
+        if (db_prepare("SELECT id, name FROM topics WHERE id > ? ORDER BY id LIMIT ?;", &st)) break;
+        sqlite3_bind_int64(st, 1, g_maint_cursor);
+        sqlite3_bind_int  (st, 2, MAINT_TOPICS_PER_STEP);
+        while (sqlite3_step(st) == SQLITE_ROW) {
+            ids[n]  = sqlite3_column_int64(st, 0);
+            days[n] = retention_days_for((const char*)sqlite3_column_text(st, 1));
+            n++;
+        }
+        sqlite3_finalize(st);
+        if (n == 0) { g_maint_cursor = 0; break; }  // full sweep done
+
+        for (int i = 0; i < n && !more; ++i) {
+            if (days[i] > 0) {
+                raw += maint_delete_chunks(
+                    "DELETE FROM messages_raw WHERE id IN"
+                    " (SELECT id FROM messages_raw WHERE topic_id = ?1 AND ts < ?2 LIMIT ?3);",
+                    ids[i], (long long)now - (long long)days[i] * 86400, deadline, &more);
+            }
+            if (days[i] > 0 && g_archive_after_days > 0 && !more) {
+                blocks += maint_delete_chunks(
+                    "DELETE FROM archive_blocks WHERE id IN"
+                    " (SELECT id FROM archive_blocks WHERE topic_id = ?1 AND t_last < ?2 LIMIT ?3);",
+                    ids[i], (long long)now - (long long)days[i] * 86400, deadline, &more);
+            }
+            if (g_rollup_1m_days > 0 && !more) {
+                roll += maint_delete_chunks(
+                    "DELETE FROM rollup_1m WHERE topic_id = ?1 AND bucket IN"
+                    " (SELECT bucket FROM rollup_1m WHERE topic_id = ?1 AND bucket < ?2 LIMIT ?3);",
+                    ids[i], (long long)now - (long long)g_rollup_1m_days * 86400, deadline, &more);
+            }
+            if (!more) g_maint_cursor = ids[i];  // resume with the next topic
+        }
+    }
+
+    if (g_archive_after_days > 0 && !more && now_ms() < deadline) archived = archive_run(deadline, &more);
+
+    char sql[64];
+    snprintf(sql, sizeof(sql), "PRAGMA incremental_vacuum(%d);", MAINT_VACUUM_PAGES);
+    if (raw + roll + blocks + archived > 0) sqlite3_exec(g_db, sql, NULL, NULL, NULL);
+    int wal_pages = 0, ckpt_pages = 0;
+    sqlite3_wal_checkpoint_v2(g_db, NULL, SQLITE_CHECKPOINT_PASSIVE, &wal_pages, &ckpt_pages);
+
+    g_maint_last_pass_ms = now_ms() - t0;
+    if (raw + roll + blocks + archived > 0 || more) {
+        char buf[240];
+        snprintf(buf, sizeof(buf),
+                 "Maintenance: deleted %ld raw + %ld rollup_1m rows + %ld archive blocks, archived %ld points,"
+                 " checkpoint %d/%d pages, %lld ms%s",
+                 raw, roll, blocks, archived, ckpt_pages, wal_pages, g_maint_last_pass_ms, more ? " (budget hit, continuing)" : "");
+        log_ts("INFO", buf);
+    }
+    // Come back soon while a backlog is being worked off.
+    g_maint_next_ms = now_ms() + (more ? 1000 : (long long)g_maint_every_s * 1000);
+}
+
+// Called from the thread that owns the DB whenever it has nothing else to do.
+static void maint_maybe_run(void) {
+    if (g_maint_every_s <= 0) return;
+    long long now = now_ms();
+    if (now < g_maint_next_ms || now - g_last_insert_ms < MAINT_IDLE_MS) return;
+    if (!retention_enabled() && g_archive_after_days <= 0) {
+        // Still keep the WAL short.
+        sqlite3_wal_checkpoint_v2(g_db, NULL, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+        g_maint_next_ms = now + (long long)g_maint_every_s * 1000;
+        return;
+    }
+    maint_run();
+}
+
+/* ---------- Writer thread + bounded queue ---------- */
+
+// All message storage is allocated once at startup: nslots fixed-size slots,
+// a FIFO ring of queued slot indices and a stack of free ones. The queue holds
+// at most cap messages; the extra slots are the batch the writer is working
+// on, so drop-oldest never has to touch a slot that SQLite is still reading.
+typedef struct {
+    time_t ts;
+    int    qos, retain;
+    int    payloadlen;
+    int    gw;        // index into g_gw
+    char  *data;      // topic '\0' payload
+} msg_slot_t;
+
+enum { WRITER_CLAIM_MAX = 64 };
+
+static struct {
+    msg_slot_t *slots;
+    char       *arena;
+    int        *ring;     // queued slot indices, oldest at ring[head]
+    int        *freel;    // free slot indices
+    int cap, head, count, nfree;
+    int stopping;
+    pthread_mutex_t mu;
+    pthread_cond_t  not_empty, not_full;
+    pthread_t       thread;
+    // stats (under mu)
+    unsigned long enqueued, dropped, oversize;
+    int hwm;
+} g_q;
+
+static int queue_init(int cap, int slot_bytes) {
+    int claim = (cap < WRITER_CLAIM_MAX) ? cap : WRITER_CLAIM_MAX;
+    int nslots = cap + claim;
+    memset(&g_q, 0, sizeof(g_q));
+    g_q.slots = calloc((size_t)nslots, sizeof(*g_q.slots));
+    g_q.arena = malloc((size_t)nslots * (size_t)slot_bytes);
+    g_q.ring  = calloc((size_t)cap, sizeof(int));
+    g_q.freel = calloc((size_t)nslots, sizeof(int));
+    if (!g_q.slots || !g_q.arena || !g_q.ring || !g_q.freel) return -1;
+    for (int i = 0; i < nslots; ++i) {
+        g_q.slots[i].data = g_q.arena + (size_t)i * (size_t)slot_bytes;
+        g_q.freel[i] = i;
+    }
+    g_q.cap = cap;
+    g_q.nfree = nslots;
+
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_mutex_init(&g_q.mu, NULL);
+    pthread_cond_init(&g_q.not_empty, &ca);
+    pthread_cond_init(&g_q.not_full, NULL);
+    pthread_condattr_destroy(&ca);
+    return 0;
+}
+
+static void queue_free(void) {
+    free(g_q.slots); free(g_q.arena); free(g_q.ring); free(g_q.freel);
+    pthread_mutex_destroy(&g_q.mu);
+    pthread_cond_destroy(&g_q.not_empty);
+    pthread_cond_destroy(&g_q.not_full);
+    memset(&g_q, 0, sizeof(g_q));
+}
+
+// Strips the spool prefix from a replayed topic and moves *ts back by its age.
+// Returns the topic to store (unchanged if it is not a well-formed replay).
+static const char *spool_unwrap(const char *topic, time_t *ts) {
+    size_t pl = strlen(g_spool_prefix);
+    if (!pl || strncmp(topic, g_spool_prefix, pl) != 0) return topic;
+    const char *p = topic + pl;
+    if (p[0] == '-' && p[1] == '/') return p + 2;
+    char *end = NULL;
+    errno = 0;
+    unsigned long long age_ms = strtoull(p, &end, 10);
+    if (end == p || *end != '/' || !end[1] || errno) return topic;
+    *ts -= (time_t)((age_ms + 500) / 1000);
+    return end + 1;
+}
+
+// Called from the mosquitto callbacks (one network thread per gateway in
+// fan-in mode). Never touches SQLite.
+static void queue_push(const struct mosquitto_message *msg, int gw) {
+    time_t ts = time(NULL);
+    const char *topic = spool_unwrap(msg->topic, &ts);
+    size_t tlen = strlen(topic);
+    int plen = (msg->payload && msg->payloadlen > 0) ? msg->payloadlen : 0;
+
+    pthread_mutex_lock(&g_q.mu);
+    if (tlen + 1 + (size_t)plen > (size_t)g_queue_slot) {
+        if (g_q.oversize++ == 0) log_ts("WARN", "Message larger than MQTT_QUEUE_SLOT_BYTES dropped");
+        g_q.dropped++;
+        pthread_mutex_unlock(&g_q.mu);
+        return;
+    }
+    while (g_queue_block && g_q.count == g_q.cap && !g_q.stopping) {
+        pthread_cond_wait(&g_q.not_full, &g_q.mu);
+    }
+    int idx;
+    if (g_q.count == g_q.cap || g_q.nfree == 0) {
+        // drop-oldest (or shutting down while full): recycle the oldest queued slot
+        if (g_q.count == 0) { g_q.dropped++; pthread_mutex_unlock(&g_q.mu); return; }
+        idx = g_q.ring[g_q.head];
+        g_q.head = (g_q.head + 1) % g_q.cap;
+        g_q.count--;
+        g_q.dropped++;
+    } else {
+        idx = g_q.freel[--g_q.nfree];
+    }
+
+    msg_slot_t *s = &g_q.slots[idx];
+    s->ts = ts;
+    s->qos = msg->qos;
+    s->retain = msg->retain;
+    s->payloadlen = plen;
+    s->gw = gw;
+    memcpy(s->data, topic, tlen + 1);
+    if (plen) memcpy(s->data + tlen + 1, msg->payload, (size_t)plen);
+
+    g_q.ring[(g_q.head + g_q.count) % g_q.cap] = idx;
+    g_q.count++;
+    g_q.enqueued++;
+    if (g_q.count > g_q.hwm) g_q.hwm = g_q.count;
+    pthread_cond_signal(&g_q.not_empty);
+    pthread_mutex_unlock(&g_q.mu);
+}
+
+static void queue_log_stats(const char *level) {
+    pthread_mutex_lock(&g_q.mu);
+    char buf[200];
+    snprintf(buf, sizeof(buf), "Queue: enqueued=%lu depth=%d/%d high-water=%d dropped=%lu (oversize=%lu)",
+             g_q.enqueued, g_q.count, g_q.cap, g_q.hwm, g_q.dropped, g_q.oversize);
+    pthread_mutex_unlock(&g_q.mu);
+    log_ts(level, buf);
+}
+
+// Main thread, about once a minute: log the queue stats if it dropped messages.
+static void queue_maybe_warn(void) {
+    static unsigned long drops_logged = 0;
+    static long long next_ms = 0;
+    long long t = now_ms();
+    if (!next_ms) next_ms = t + 60000;
+    if (t < next_ms) return;
+    next_ms = t + 60000;
+    pthread_mutex_lock(&g_q.mu);
+    unsigned long drops = g_q.dropped;
+    pthread_mutex_unlock(&g_q.mu);
+    if (drops != drops_logged) { drops_logged = drops; queue_log_stats("WARN"); }
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    int batch[WRITER_CLAIM_MAX];
+
+    pthread_mutex_lock(&g_q.mu);
+    for (;;) {
+        while (g_q.count == 0 && !g_q.stopping) {
+            // Wake up in time to commit the open batch and for maintenance.
+            struct timespec dl;
+            clock_gettime(CLOCK_MONOTONIC, &dl);
+            long long add = db_batch_wait_ms(1000);
+            dl.tv_sec  += (time_t)(add / 1000);
+            dl.tv_nsec += (long)(add % 1000) * 1000000L;
+            if (dl.tv_nsec >= 1000000000L) { dl.tv_sec++; dl.tv_nsec -= 1000000000L; }
+            if (pthread_cond_timedwait(&g_q.not_empty, &g_q.mu, &dl) == ETIMEDOUT && g_q.count == 0) {
+                pthread_mutex_unlock(&g_q.mu);
+                db_batch_maybe_flush();
+                maint_maybe_run();
+                replica_maybe_step();
+                pthread_mutex_lock(&g_q.mu);
+            }
+        }
+        if (g_q.count == 0) break;  // stopping and drained
+
+        int n = 0;
+        while (g_q.count > 0 && n < WRITER_CLAIM_MAX) {
+            batch[n++] = g_q.ring[g_q.head];
+            g_q.head = (g_q.head + 1) % g_q.cap;
+            g_q.count--;
+        }
+        pthread_cond_broadcast(&g_q.not_full);
+        pthread_mutex_unlock(&g_q.mu);
+
+        for (int i = 0; i < n; ++i) {
+            const msg_slot_t *s = &g_q.slots[batch[i]];
+            const char *topic = s->data;
+            db_insert_message(s->ts, topic, topic + strlen(topic) + 1, s->payloadlen, s->qos, s->retain, s->gw);
+        }
+
+        pthread_mutex_lock(&g_q.mu);
+        for (int i = 0; i < n; ++i) g_q.freel[g_q.nfree++] = batch[i];
+    }
+    pthread_mutex_unlock(&g_q.mu);
+
+    db_batch_flush();
+    replica_abort();
+    return NULL;
+}
+
+static int writer_start(void) {
+    if (queue_init(g_queue_cap, g_queue_slot) != 0) {
+        fprintf(stderr, "writer queue allocation failed\n");
+        queue_free();
+        return -1;
+    }
+    if (pthread_create(&g_q.thread, NULL, writer_main, NULL) != 0) {
+        perror("pthread_create");
+        queue_free();
+        return -1;
+    }
+    return 0;
+}
+
+// Drains everything still queued, commits, and joins the writer.
+static void writer_stop(void) {
+    pthread_mutex_lock(&g_q.mu);
+    g_q.stopping = 1;
+    pthread_cond_broadcast(&g_q.not_empty);
+    pthread_cond_broadcast(&g_q.not_full);
+    pthread_mutex_unlock(&g_q.mu);
+    pthread_join(g_q.thread, NULL);
+    queue_log_stats("INFO");
+    queue_free();
+}
+
+/* ---------- Metrics export ---------- */
+
+static long long     g_metrics_next_ms = 0;
+static long long     g_metrics_last_ms = 0;
+static unsigned long g_metrics_last_rx = 0;
+
+static void metrics_publish(const char *name, const char *value) {
+    char topic[192];
+    snprintf(topic, sizeof(topic), "%s/%s", g_metrics_topic, name);
+    mosquitto_publish(g_mosq, NULL, topic, (int)strlen(value), value, 0, false);
+}
+
+static void metrics_write_prom(int qdepth, int qhwm, unsigned long qdropped) {
+    char tmp[272];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g_metrics_file);
+    FILE *f = fopen(tmp, "w");
+    if (!f) { perror(tmp); return; }
+    static const struct { const char *name; size_t off; } C[] = {
+        { "messages_received_total",    offsetof(counters_t, msgs_rx) },
+        { "rows_inserted_total",        offsetof(counters_t, rows) },
+        { "insert_errors_total",        offsetof(counters_t, insert_errors) },
+        { "commits_total",              offsetof(counters_t, commits) },
+        { "commit_errors_total",        offsetof(counters_t, commit_errors) },
+        { "reconnects_total",           offsetof(counters_t, reconnects) },
+        { "reconnect_failures_total",   offsetof(counters_t, reconnect_failures) },
+        { "repair_script_runs_total",   offsetof(counters_t, repair_runs) },
+        { "pppd_restarts_total",        offsetof(counters_t, sup_hups) },
+        { "hard_resets_total",          offsetof(counters_t, sup_resets) },
+    };
+    for (size_t i = 0; i < sizeof(C) / sizeof(C[0]); ++i) {
+        const atomic_ulong *c = (const atomic_ulong*)((const char*)&g_ctr + C[i].off);
+        fprintf(f, "# TYPE mqtt2sqlite_%s counter\nmqtt2sqlite_%s %lu\n",
+                C[i].name, C[i].name, atomic_load_explicit(c, memory_order_relaxed));
+    }
+    fprintf(f, "# TYPE mqtt2sqlite_queue_depth gauge\nmqtt2sqlite_queue_depth %d\n", qdepth);
+    fprintf(f, "# TYPE mqtt2sqlite_queue_high_water gauge\nmqtt2sqlite_queue_high_water %d\n", qhwm);
+    fprintf(f, "# TYPE mqtt2sqlite_queue_dropped_total counter\nmqtt2sqlite_queue_dropped_total %lu\n", qdropped);
+    if (g_fanin) {
+        fprintf(f, "# TYPE mqtt2sqlite_gateway_connected gauge\n");
+        for (int i = 0; i < g_gw_n; ++i)
+            fprintf(f, "mqtt2sqlite_gateway_connected{gateway=\"%s\"} %d\n", g_gw[i].name, atomic_load(&g_gw[i].connected));
+        fprintf(f, "# TYPE mqtt2sqlite_gateway_messages_received_total counter\n");
+        for (int i = 0; i < g_gw_n; ++i)
+            fprintf(f, "mqtt2sqlite_gateway_messages_received_total{gateway=\"%s\"} %lu\n", g_gw[i].name,
+                    atomic_load_explicit(&g_gw[i].msgs_rx, memory_order_relaxed));
+    }
+    for (int h = 0; h < H_COUNT; ++h) {
+        const hist_t *x = &g_hist[h];
+        fprintf(f, "# TYPE mqtt2sqlite_%s_seconds histogram\n", HIST_NAME[h]);
+        unsigned long acc = 0;
+        for (int b = 0; b < HIST_BUCKETS - 1; ++b) {
+            acc += atomic_load_explicit(&x->bucket[b], memory_order_relaxed);
+            fprintf(f, "mqtt2sqlite_%s_seconds_bucket{le=\"%g\"} %lu\n", HIST_NAME[h], (double)(1ul << b) / 1e6, acc);
+        }
+        unsigned long n = atomic_load_explicit(&x->count, memory_order_relaxed);
+        fprintf(f, "mqtt2sqlite_%s_seconds_bucket{le=\"+Inf\"} %lu\n", HIST_NAME[h], n);
+        fprintf(f, "mqtt2sqlite_%s_seconds_sum %g\n", HIST_NAME[h],
+                (double)atomic_load_explicit(&x->sum_us, memory_order_relaxed) / 1e6);
+        fprintf(f, "mqtt2sqlite_%s_seconds_count %lu\n", HIST_NAME[h], n);
+    }
+    if (fclose(f) != 0 || rename(tmp, g_metrics_file) != 0) perror(g_metrics_file);
+}
+
+// Called from the main loop (the thread that owns g_mosq).
+static void metrics_maybe_export(int connected) {
+    if (g_metrics_every_s <= 0) return;
+    long long t = now_ms();
+    if (t < g_metrics_next_ms) return;
+    g_metrics_next_ms = t + (long long)g_metrics_every_s * 1000;
+
+    int qdepth = 0, qhwm = 0;
+    unsigned long qdropped = 0;
+    if (g_writer_thread) {
+        pthread_mutex_lock(&g_q.mu);
+        qdepth = g_q.count; qhwm = g_q.hwm; qdropped = g_q.dropped;
+        pthread_mutex_unlock(&g_q.mu);
+    }
+    unsigned long rx = CTR_GET(msgs_rx);
+    double rate = (g_metrics_last_ms && t > g_metrics_last_ms)
+                  ? (double)(rx - g_metrics_last_rx) * 1000.0 / (double)(t - g_metrics_last_ms) : 0.0;
+    g_metrics_last_ms = t;
+    g_metrics_last_rx = rx;
+
+    if (g_metrics_file[0]) metrics_write_prom(qdepth, qhwm, qdropped);
+    if (!g_metrics_topic[0] || !connected) return;
+
+    char v[256];
+    snprintf(v, sizeof(v), "%.1f", rate);                metrics_publish("messages_per_s", v);
+    snprintf(v, sizeof(v), "%lu", rx);                   metrics_publish("messages_received", v);
+    snprintf(v, sizeof(v), "%lu", CTR_GET(rows));        metrics_publish("rows_inserted", v);
+    snprintf(v, sizeof(v), "%lu", CTR_GET(insert_errors) + CTR_GET(commit_errors)); metrics_publish("db_errors", v);
+    snprintf(v, sizeof(v), "%lu", CTR_GET(reconnects));  metrics_publish("reconnects", v);
+    snprintf(v, sizeof(v), "%lu", CTR_GET(repair_runs)); metrics_publish("repair_script_runs", v);
+    snprintf(v, sizeof(v), "%lu", CTR_GET(sup_hups));    metrics_publish("pppd_restarts", v);
+    snprintf(v, sizeof(v), "%lu", CTR_GET(sup_resets));  metrics_publish("hard_resets", v);
+    snprintf(v, sizeof(v), "%d", qdepth);                metrics_publish("queue/depth", v);
+    snprintf(v, sizeof(v), "%d", qhwm);                  metrics_publish("queue/high_water", v);
+    snprintf(v, sizeof(v), "%lu", qdropped);             metrics_publish("queue/dropped", v);
+    for (int i = 0; g_fanin && i < g_gw_n; ++i) {
+        char name[96];
+        snprintf(name, sizeof(name), "gateway/%.47s", g_gw[i].name);
+        snprintf(v, sizeof(v), "{\"connected\":%d,\"messages_received\":%lu}", atomic_load(&g_gw[i].connected),
+                 atomic_load_explicit(&g_gw[i].msgs_rx, memory_order_relaxed));
+        metrics_publish(name, v);
+    }
+    for (int h = 0; h < H_COUNT; ++h) {
+        char name[48];
+        snprintf(name, sizeof(name), "latency/%s", HIST_NAME[h]);
+        snprintf(v, sizeof(v), "{\"count\":%lu,\"p50_us\":%lu,\"p99_us\":%lu,\"p999_us\":%lu,\"max_us\":%lu}",
+                 atomic_load_explicit(&g_hist[h].count, memory_order_relaxed),
+                 hist_quantile_us(h, 0.50), hist_quantile_us(h, 0.99), hist_quantile_us(h, 0.999),
+                 atomic_load_explicit(&g_hist[h].max_us, memory_order_relaxed));
+        metrics_publish(name, v);
+    }
+}
+
+/* ---------- Supervisor (MQTT_SUPERVISOR=1) ---------- */
+
+// Replaces the repair script. A thread follows the PPP interface through
+// rtnetlink events (no polling, no fork/exec) and, while the link or the broker
+// is down, climbs a ladder of recovery steps:
+//   0  reconnect MQTT the moment the interface has its address again; pppd
+//      redials by itself (persist, LCP echo)
+//   1  after MQTT_SUP_HUP_MS: SIGHUP pppd, which drops the link and redials
+//   2  after MQTT_SUP_RESET_MS: pulse RESET over DTR/RTS (wemos_reset.c), then
+//      SIGTERM pppd so its service reruns the line speed negotiation
+// Step 2 is repeated every MQTT_SUP_RESET_MS until the link comes back. Each
+// step is logged with the time since the outage began; the outage length goes
+// into the "recovery" histogram.
+#ifndef IFF_UP
+#  define IFF_UP 0x1     // <net/if.h> hides it under _POSIX_C_SOURCE
+#endif
+
+static int  g_sup_enabled = 0;
+static char g_sup_ifname[IF_NAMESIZE] = "ppp0";
+static char g_sup_pidfile[256] = "/var/run/ppp-wemos.pid";
+static char g_sup_dev[128] = "/dev/ttyUSB0";
+static char g_sup_peer[INET_ADDRSTRLEN] = "192.168.178.50";
+static char g_sup_route[64] = "192.168.4.0/24";  // via peer on the interface; "" = leave routes alone
+static int  g_sup_hup_ms   = 4000;
+static int  g_sup_reset_ms = 15000;
+static int  g_sup_pulse_ms = 120;
+
+static struct {
+    pthread_t       thread;
+    pthread_mutex_t mu;
+    pthread_cond_t  cv;          // broadcast on every link-up transition
+    int             nl;          // rtnetlink socket (link + IPv4 address groups)
+    unsigned        nl_seq;
+    atomic_int      link_up;     // interface present, up and has an IPv4 address
+    atomic_uint     up_epoch;    // bumped on each up transition
+    atomic_uint     down_epoch;  // bumped on each down transition
+    atomic_int      mqtt_up;     // set by the MQTT callbacks
+    int             broker_on_link;  // MQTT_BROKER is the peer: a dead session counts as an outage
+    pid_t           pppd;        // last pid read from the pid file
+    // ladder state, owned by the supervisor thread
+    long long       outage_ms, step_ms;
+    int             step;
+} g_sup = { .nl = -1 };
+
+static const char *const SUP_STEP_NAME[] = { "reconnect", "pppd restart", "hard reset" };
+
+static void sup_set_link(int up) {
+    if (atomic_exchange(&g_sup.link_up, up) == up) return;
+    char buf[128];
+    snprintf(buf, sizeof(buf), "Supervisor: %s %s", g_sup_ifname, up ? "up" : "down");
+    log_ts(up ? "INFO" : "WARN", buf);
+    if (!up) { atomic_fetch_add(&g_sup.down_epoch, 1); return; }
+    pthread_mutex_lock(&g_sup.mu);
+    atomic_fetch_add(&g_sup.up_epoch, 1);
+    pthread_cond_broadcast(&g_sup.cv);
+    pthread_mutex_unlock(&g_sup.mu);
+}
+
+static void sup_rta_add(struct nlmsghdr *n, size_t cap, int type, const void *data, size_t len) {
+    struct rtattr *a = (struct rtattr*)((char*)n + NLMSG_ALIGN(n->nlmsg_len));
+    if (NLMSG_ALIGN(n->nlmsg_len) + RTA_SPACE(len) > cap) return;
+    a->rta_type = (unsigned short)type;
+    a->rta_len  = (unsigned short)RTA_LENGTH(len);
+    memcpy(RTA_DATA(a), data, len);
+    n->nlmsg_len = (unsigned)(NLMSG_ALIGN(n->nlmsg_len) + RTA_SPACE(len));
+}
+
+// Same as the ip-up.d script's "ip route add <route> via <peer> dev <if>"; the
+// kernel's ack (or error) is logged by sup_nl_read().
+static void sup_route_add(int ifindex) {
+    char net[64];
+    snprintf(net, sizeof(net), "%s", g_sup_route);
+    char *slash = strchr(net, '/');
+    int plen = slash ? atoi(slash + 1) : 32;
+    if (slash) *slash = '\0';
+    struct in_addr dst, gw;
+    if (inet_pton(AF_INET, net, &dst) != 1 || inet_pton(AF_INET, g_sup_peer, &gw) != 1 || plen < 0 || plen > 32) {
+        log_ts("WARN", "Supervisor: bad MQTT_SUP_ROUTE/MQTT_SUP_PEER, route not added");
+        return;
+    }
+    struct { struct nlmsghdr n; struct rtmsg r; char attr[64]; } req;
+    memset(&req, 0, sizeof(req));
+    req.n.nlmsg_len   = NLMSG_LENGTH(sizeof(struct rtmsg));
+    req.n.nlmsg_type  = RTM_NEWROUTE;
+    req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_REPLACE;
+    req.n.nlmsg_seq   = ++g_sup.nl_seq;
+    req.r.rtm_family   = AF_INET;
+    req.r.rtm_dst_len  = (unsigned char)plen;
+    req.r.rtm_table    = RT_TABLE_MAIN;
+    req.r.rtm_protocol = RTPROT_BOOT;
+    req.r.rtm_scope    = RT_SCOPE_UNIVERSE;
+    req.r.rtm_type     = RTN_UNICAST;
+    sup_rta_add(&req.n, sizeof(req), RTA_DST, &dst, sizeof(dst));
+    sup_rta_add(&req.n, sizeof(req), RTA_GATEWAY, &gw, sizeof(gw));
+    sup_rta_add(&req.n, sizeof(req), RTA_OIF, &ifindex, sizeof(ifindex));
+    if (send(g_sup.nl, &req, req.n.nlmsg_len, 0) < 0) log_ts("WARN", "Supervisor: route request not sent");
+}
+
+static void sup_nl_dump(int type) {
+    struct { struct nlmsghdr n; struct rtgenmsg g; } req;
+    memset(&req, 0, sizeof(req));
+    req.n.nlmsg_len   = NLMSG_LENGTH(sizeof(struct rtgenmsg));
+    req.n.nlmsg_type  = (unsigned short)type;
+    req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.n.nlmsg_seq   = ++g_sup.nl_seq;
+    req.g.rtgen_family = AF_INET;
+    send(g_sup.nl, &req, req.n.nlmsg_len, 0);
+}
+
+// Handles one datagram from the rtnetlink socket.
+static void sup_nl_read(void) {
+    char buf[8192];
+    ssize_t got = recv(g_sup.nl, buf, sizeof(buf), MSG_DONTWAIT);
+    if (got <= 0) return;
+    int len = (int)got;
+    for (struct nlmsghdr *n = (struct nlmsghdr*)buf; NLMSG_OK(n, len); n = NLMSG_NEXT(n, len)) {
+        if (n->nlmsg_type == NLMSG_DONE) continue;
+        if (n->nlmsg_type == NLMSG_ERROR) {
+            const struct nlmsgerr *e = (const struct nlmsgerr*)NLMSG_DATA(n);
+            if (e->error) {
+                char m[160];
+                snprintf(m, sizeof(m), "Supervisor: netlink request failed: %s", strerror(-e->error));
+                log_ts("WARN", m);
+            }
+            continue;
+        }
+        if (n->nlmsg_type == RTM_NEWLINK || n->nlmsg_type == RTM_DELLINK) {
+            const struct ifinfomsg *ifi = (const struct ifinfomsg*)NLMSG_DATA(n);
+            int alen = (int)IFLA_PAYLOAD(n);
+            for (const struct rtattr *a = IFLA_RTA(ifi); RTA_OK(a, alen); a = RTA_NEXT(a, alen)) {
+                if (a->rta_type != IFLA_IFNAME || strcmp((const char*)RTA_DATA(a), g_sup_ifname) != 0) continue;
+                // the address event says "up"; link events can only take it away
+                if (n->nlmsg_type == RTM_DELLINK || !(ifi->ifi_flags & IFF_UP)) sup_set_link(0);
+            }
+        } else if (n->nlmsg_type == RTM_NEWADDR || n->nlmsg_type == RTM_DELADDR) {
+            const struct ifaddrmsg *ifa = (const struct ifaddrmsg*)NLMSG_DATA(n);
+            int alen = (int)IFA_PAYLOAD(n);
+            if (ifa->ifa_family != AF_INET) continue;
+            for (const struct rtattr *a = IFA_RTA(ifa); RTA_OK(a, alen); a = RTA_NEXT(a, alen)) {
+                if (a->rta_type != IFA_LABEL || strcmp((const char*)RTA_DATA(a), g_sup_ifname) != 0) continue;
+                int up = n->nlmsg_type == RTM_NEWADDR;
+                if (up && !atomic_load(&g_sup.link_up) && g_sup_route[0]) sup_route_add((int)ifa->ifa_index);
+                sup_set_link(up);
+            }
+        }
+    }
+}
+
+static pid_t sup_pppd_pid(void) {
+    char alt[64];
+    snprintf(alt, sizeof(alt), "/var/run/%s.pid", g_sup_ifname);
+    const char *files[] = { g_sup_pidfile, alt };
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i) {
+        FILE *f = fopen(files[i], "r");
+        long pid = 0;
+        if (!f) continue;
+        if (fscanf(f, "%ld", &pid) != 1) pid = 0;
+        fclose(f);
+        if (pid > 1 && kill((pid_t)pid, 0) == 0) return g_sup.pppd = (pid_t)pid;
+    }
+    // pppd removes the interface pid file with the link; the last one is still good
+    if (g_sup.pppd > 1 && kill(g_sup.pppd, 0) == 0) return g_sup.pppd;
+    return 0;
+}
+
+static void sup_signal_pppd(int sig, const char *why) {
+    pid_t pid = sup_pppd_pid();
+    char buf[200];
+    if (!pid) {
+        snprintf(buf, sizeof(buf), "Supervisor: %s skipped, no pppd pid in %.160s", why, g_sup_pidfile);
+        log_ts("WARN", buf);
+        return;
+    }
+    int rc = kill(pid, sig);
+    snprintf(buf, sizeof(buf), "Supervisor: %s: signal %d to pppd %ld%s", why, sig, (long)pid, rc ? " failed" : "");
+    log_ts("WARN", buf);
+}
+
+static void sup_climb(long long t) {
+    char buf[200];
+    long long since = t - g_sup.outage_ms;
+    if (g_sup.step == 0) {
+        if (t - g_sup.step_ms < g_sup_hup_ms) return;
+        g_sup.step = 1;
+        CTR_INC(sup_hups);
+        sup_signal_pppd(SIGHUP, "pppd restart");
+    } else {
+        if (g_sup.step == 1 ? since < g_sup_reset_ms : t - g_sup.step_ms < g_sup_reset_ms) return;
+        g_sup.step = 2;
+        CTR_INC(sup_resets);
+        long long t0 = now_ms();
+        int rc = wemos_reset(g_sup_dev, (unsigned)g_sup_pulse_ms, 0);
+        snprintf(buf, sizeof(buf), "Supervisor: hard reset via %s %s (%lld ms)", g_sup_dev,
+                 rc ? strerror(-rc) : "done", now_ms() - t0);
+        log_ts("WARN", buf);
+        // the Wemos restarts at 115200; let the service negotiate the speed again
+        sup_signal_pppd(SIGTERM, "pppd exit after reset");
+    }
+    g_sup.step_ms = now_ms();
+    snprintf(buf, sizeof(buf), "Supervisor: step %d (%s) at +%lld ms", g_sup.step, SUP_STEP_NAME[g_sup.step], since);
+    log_ts("WARN", buf);
+}
+
+static void sup_evaluate(long long t) {
+    int healthy = atomic_load(&g_sup.link_up) && (!g_sup.broker_on_link || atomic_load(&g_sup.mqtt_up));
+    char buf[200];
+    if (healthy) {
+        if (!g_sup.outage_ms) return;
+        long long took = t - g_sup.outage_ms;
+        hist_add(H_RECOVERY, took * 1000);
+        snprintf(buf, sizeof(buf), "Supervisor: recovered after %lld ms (last step: %s)", took, SUP_STEP_NAME[g_sup.step]);
+        log_ts("INFO", buf);
+        g_sup.outage_ms = 0;
+        return;
+    }
+    if (!g_sup.outage_ms) {
+        g_sup.outage_ms = g_sup.step_ms = t;
+        g_sup.step = 0;
+        snprintf(buf, sizeof(buf), "Supervisor: outage (%s %s, MQTT %s)", g_sup_ifname,
+                 atomic_load(&g_sup.link_up) ? "up" : "down", atomic_load(&g_sup.mqtt_up) ? "up" : "down");
+        log_ts("WARN", buf);
+        return;
+    }
+    sup_climb(t);
+}
+
+static void *sup_main(void *arg) {
+    (void)arg;
+    // Initial state: the address dump reports an interface that is already up.
+    sup_nl_dump(RTM_GETADDR);
+    while (!g_should_stop) {
+        // the timeout only bounds the wait for stop and the next ladder step
+        struct pollfd pfd = { .fd = g_sup.nl, .events = POLLIN };
+        if (poll(&pfd, 1, 250) > 0) do sup_nl_read(); while (poll(&pfd, 1, 0) > 0);
+        sup_evaluate(now_ms());
+    }
+    return NULL;
+}
+
+static int sup_start(void) {
+    g_sup.nl = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    struct sockaddr_nl sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+    if (g_sup.nl < 0 || bind(g_sup.nl, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
+        perror("netlink");
+        if (g_sup.nl >= 0) close(g_sup.nl);
+        return -1;
+    }
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_sup.cv, &ca);
+    pthread_condattr_destroy(&ca);
+    pthread_mutex_init(&g_sup.mu, NULL);
+    if (pthread_create(&g_sup.thread, NULL, sup_main, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        close(g_sup.nl);
+        return -1;
+    }
+    return 0;
+}
+
+static void sup_stop(void) {
+    pthread_join(g_sup.thread, NULL);
+    close(g_sup.nl);
+}
+
+// Main thread, reconnect path: wait up to ms for the next link-up transition
+// after epoch. Returns 1 if it happened (reconnect now), 0 on timeout/stop.
+static int sup_wait_up(unsigned epoch, int ms) {
+    long long deadline = now_ms() + ms;
+    pthread_mutex_lock(&g_sup.mu);
+    while (!g_should_stop && atomic_load(&g_sup.up_epoch) == epoch) {
+        long long left = deadline - now_ms();
+        if (left <= 0) break;
+        if (left > 500) left = 500;  // signals do not interrupt the wait
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec  += (time_t)(left / 1000);
+        ts.tv_nsec += (long)(left % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+        pthread_cond_timedwait(&g_sup.cv, &g_sup.mu, &ts);
+    }
+    int woke = atomic_load(&g_sup.up_epoch) != epoch;
+    pthread_mutex_unlock(&g_sup.mu);
+    return woke;
+}
+
+/* ---------- MQTT callbacks (lightweight; no exits) ---------- */
+
+static void subscribe_one(struct mosquitto *mosq, int rc, const char *topic, int qos) {
     enum { TOPIC_PREVIEW = 120 };
     char topic_preview[TOPIC_PREVIEW + 1];
-    size_t tlen = strlen(g_topic);
+    size_t tlen = strlen(topic);
     if (tlen > TOPIC_PREVIEW) {
-        memcpy(topic_preview, g_topic, TOPIC_PREVIEW);
+        memcpy(topic_preview, topic, TOPIC_PREVIEW);
         topic_preview[TOPIC_PREVIEW] = '\0';
     } else {
-        memcpy(topic_preview, g_topic, tlen + 1);
+        memcpy(topic_preview, topic, tlen + 1);
     }
 
     char buf[256];
@@ -234,26 +2356,52 @@ static void handle_connect(struct mosquitto *mosq, void *obj, int rc) {
     log_ts("INFO", buf);
 
     if (rc == 0) {
-        int s = mosquitto_subscribe(mosq, NULL, g_topic, 0);
+        int s = mosquitto_subscribe(mosq, NULL, topic, qos);
         if (s != MOSQ_ERR_SUCCESS) {
             fprintf(stderr, "mosquitto_subscribe failed: %s\n", mosquitto_strerror(s));
         }
     }
 }
 
+static void handle_connect(struct mosquitto *mosq, void *obj, int rc) {
+    gateway_t *gw = obj;
+    if (rc == 0) {
+        atomic_store(&gw->connected, 1);
+        if (gw->on_link) atomic_store(&g_sup.mqtt_up, 1);
+    }
+    if (g_fanin) {
+        char buf[96];
+        snprintf(buf, sizeof(buf), "Gateway %.47s connected (rc=%d)", gw->name, rc);
+        log_ts("INFO", buf);
+    }
+    if (g_subs_n == 0) { subscribe_one(mosq, rc, g_topic, 0); return; }
+    for (int i = 0; i < g_subs_n; ++i) subscribe_one(mosq, rc, g_subs[i].filter, g_subs[i].qos);
+}
+
 
 static void handle_disconnect(struct mosquitto *mosq, void *obj, int rc) {
-    (void)mosq; (void)obj;
-    char buf[160];
-    snprintf(buf, sizeof(buf), "Disconnected (rc=%d). Will try to recover…", rc);
+    (void)mosq;
+    gateway_t *gw = obj;
+    atomic_store(&gw->connected, 0);
+    if (gw->on_link) atomic_store(&g_sup.mqtt_up, 0);
+    char buf[224];
+    snprintf(buf, sizeof(buf), "Disconnected from %.47s (rc=%d). Will try to recover…", gw->name, rc);
     log_ts("WARN", buf);
     // NOTE: We do NOT exit here; the main loop will handle reconnects.
 }
 
 static void handle_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg) {
-    (void)mosq; (void)obj;
+    (void)mosq;
+    gateway_t *gw = obj;
     if (!msg) return;
-    db_insert_message(msg->topic, msg->payload, msg->payloadlen, msg->qos, msg->retain);
+    CTR_INC(msgs_rx);
+    atomic_fetch_add_explicit(&gw->msgs_rx, 1, memory_order_relaxed);
+    if (g_writer_thread) queue_push(msg, (int)(gw - g_gw));
+    else {
+        time_t ts = time(NULL);
+        const char *topic = spool_unwrap(msg->topic, &ts);
+        db_insert_message(ts, topic, msg->payload, msg->payloadlen, msg->qos, msg->retain, 0);
+    }
 }
 
 /* ---------- util ---------- */
@@ -266,6 +2414,101 @@ static void install_sig_handlers(void) {
     sigaction(SIGTERM, &sa, NULL);
 }
 
+// After the MQTT side is gone: forced flush of the pending batch (SIGINT/SIGTERM;
+// the writer drains its queue first), then everything else.
+static void storage_shutdown(void) {
+    mosquitto_lib_cleanup();
+    if (g_writer_thread) writer_stop();
+    else { db_batch_flush(); replica_abort(); }
+    if (g_sup_enabled) sup_stop();
+    if (g_rules_path[0]) {
+        char buf[160];
+        snprintf(buf, sizeof(buf), "Rules: %lu message(s) excluded, %lu sampled out", g_rules_excluded, g_rules_sampled);
+        log_ts("INFO", buf);
+    }
+    db_close();
+    rules_free();
+}
+
+/* ---------- Fan-in (MQTT_BROKERS) ---------- */
+
+// "[name=]host[:port],..." -> g_gw[]; the name defaults to the host.
+static int gateways_parse(const char *spec) {
+    g_gw_n = 0;
+    while (spec && *spec && g_gw_n < GATEWAYS_MAX) {
+        const char *comma = strchr(spec, ',');
+        size_t len = comma ? (size_t)(comma - spec) : strlen(spec);
+        char item[192];
+        if (len && len < sizeof(item)) {
+            memcpy(item, spec, len);
+            item[len] = '\0';
+            gateway_t *gw = &g_gw[g_gw_n];
+            char *host = strchr(item, '=');
+            if (host) *host++ = '\0';
+            else host = item;
+            char *colon = strrchr(host, ':');
+            gw->port = 1883;
+            if (colon) { *colon = '\0'; gw->port = atoi(colon + 1); }
+            snprintf(gw->host, sizeof(gw->host), "%.127s", host);
+            snprintf(gw->name, sizeof(gw->name), "%.47s", host == item ? host : item);
+            if (gw->host[0] && gw->port > 0) g_gw_n++;
+        }
+        spec = comma ? comma + 1 : NULL;
+    }
+    return g_gw_n;
+}
+
+// One network thread per gateway; they reconnect on their own (RECONNECT_MIN_S
+// doubling up to RECONNECT_MAX_S). The main thread only exports metrics.
+static int fanin_run(const char *cid) {
+    char buf[256];
+    int started = 0, rc = 0;
+    for (; started < g_gw_n; ++started) {
+        gateway_t *gw = &g_gw[started];
+        char id[128];
+        snprintf(id, sizeof(id), "%.60s-%.47s", cid, gw->name);
+        gw->mosq = mosquitto_new(id, true, gw);
+        if (!gw->mosq) { fprintf(stderr, "mosquitto_new failed\n"); rc = 1; break; }
+        mosquitto_connect_callback_set(gw->mosq, handle_connect);
+        mosquitto_disconnect_callback_set(gw->mosq, handle_disconnect);
+        mosquitto_message_callback_set(gw->mosq, handle_message);
+        mosquitto_reconnect_delay_set(gw->mosq, (unsigned)g_reconnect_min, (unsigned)g_reconnect_max, true);
+        int c = mosquitto_connect_async(gw->mosq, gw->host, gw->port, 30);
+        if (c != MOSQ_ERR_SUCCESS) {
+            snprintf(buf, sizeof(buf), "Gateway %.47s: initial connect failed: %.100s (retrying)", gw->name, mosquitto_strerror(c));
+            log_ts("WARN", buf);
+        }
+        if (mosquitto_loop_start(gw->mosq) != MOSQ_ERR_SUCCESS) {
+            fprintf(stderr, "mosquitto_loop_start(%.47s) failed\n", gw->name);
+            mosquitto_destroy(gw->mosq);
+            gw->mosq = NULL;
+            rc = 1;
+            break;
+        }
+        snprintf(buf, sizeof(buf), "Gateway %.47s: %.127s:%d", gw->name, gw->host, gw->port);
+        log_ts("INFO", buf);
+    }
+    g_mosq = g_gw[0].mosq;  // metrics are published through the first gateway
+
+    while (!rc && !g_should_stop) {
+        sleep(1);  // returns early on SIGINT/SIGTERM
+        long long loop_t0 = now_us();
+        metrics_maybe_export(atomic_load(&g_gw[0].connected));
+        queue_maybe_warn();
+        hist_add(H_LOOP, now_us() - loop_t0);
+    }
+
+    log_ts("INFO", "Shutting down…");
+    for (int i = 0; i < started; ++i) {
+        mosquitto_disconnect(g_gw[i].mosq);
+        mosquitto_loop_stop(g_gw[i].mosq, false);
+        mosquitto_destroy(g_gw[i].mosq);
+        g_gw[i].mosq = NULL;
+    }
+    g_mosq = NULL;
+    return rc;
+}
+
 /* ---------- main ---------- */
 
 int main(void) {
@@ -278,16 +2521,110 @@ int main(void) {
     g_reconnect_min = env_or_default_int("RECONNECT_MIN_S", 2);
     g_reconnect_max = env_or_default_int("RECONNECT_MAX_S", 60);
     g_sleep_after_script = env_or_default_int("RETRY_SLEEP_AFTER_SCRIPT_S", 5);
+    g_batch_max = env_or_default_int("MQTT_BATCH_MAX", 1);
+    g_batch_ms  = env_or_default_int("MQTT_BATCH_MS", 1000);
+    g_writer_thread = env_or_default_int("MQTT_WRITER_THREAD", 0) ? 1 : 0;
+    g_queue_cap  = env_or_default_int("MQTT_QUEUE_CAP", 1024);
+    g_queue_slot = env_or_default_int("MQTT_QUEUE_SLOT_BYTES", 512);
+    g_queue_block = (strcmp(env_or_default("MQTT_QUEUE_POLICY", "drop"), "block") == 0) ? 1 : 0;
+    if (g_queue_cap < 1) g_queue_cap = 1;
+    if (g_queue_slot < 64) g_queue_slot = 64;
+    snprintf(g_rules_path, sizeof(g_rules_path), "%s", env_or_default("MQTT_RULES_FILE", ""));
+    retention_parse(getenv("MQTT_RETENTION"));
+    g_rollup_1m_days  = env_or_default_int("MQTT_RETENTION_1M_DAYS", 0);
+    g_maint_every_s   = env_or_default_int("MQTT_MAINT_EVERY_S", 60);
+    g_maint_budget_ms = env_or_default_int("MQTT_MAINT_BUDGET_MS", 50);
+    g_maint_chunk     = env_or_default_int("MQTT_MAINT_CHUNK", 500);
+    if (g_maint_chunk < 1) g_maint_chunk = 1;
+    g_archive_after_days = env_or_default_int("MQTT_ARCHIVE_AFTER_DAYS", 0);
+    g_metrics_every_s = env_or_default_int("MQTT_METRICS_EVERY_S", 0);
+    snprintf(g_metrics_topic, sizeof(g_metrics_topic), "%s", env_or_default("MQTT_METRICS_TOPIC", "$SYS/mqtt2sqlite"));
+    if (getenv("MQTT_METRICS_TOPIC") && !*getenv("MQTT_METRICS_TOPIC")) g_metrics_topic[0] = '\0';
+    snprintf(g_metrics_file, sizeof(g_metrics_file), "%s", env_or_default("MQTT_METRICS_FILE", ""));
+    snprintf(g_spool_prefix, sizeof(g_spool_prefix), "%s", env_or_default("MQTT_SPOOL_PREFIX", "spool/"));
+    snprintf(g_replica_path, sizeof(g_replica_path), "%s", env_or_default("MQTT_REPLICA_PATH", ""));
+    g_replica_full       = strcmp(env_or_default("MQTT_REPLICA_MODE", "rollups"), "full") == 0;
+    g_replica_every_s    = env_or_default_int("MQTT_REPLICA_EVERY_S", 30);
+    g_replica_raw_hours  = env_or_default_int("MQTT_REPLICA_RAW_HOURS", 24);
+    g_replica_step_pages = env_or_default_int("MQTT_REPLICA_STEP_PAGES", 128);
+    if (g_replica_step_pages < 1) g_replica_step_pages = 1;
+    g_sup_enabled = env_or_default_int("MQTT_SUPERVISOR", 0) ? 1 : 0;
+    snprintf(g_sup_ifname, sizeof(g_sup_ifname), "%s", env_or_default("MQTT_SUP_IFACE", "ppp0"));
+    snprintf(g_sup_pidfile, sizeof(g_sup_pidfile), "%s", env_or_default("MQTT_SUP_PPPD_PIDFILE", "/var/run/ppp-wemos.pid"));
+    snprintf(g_sup_dev, sizeof(g_sup_dev), "%s", env_or_default("MQTT_SUP_DEV", "/dev/ttyUSB0"));
+    snprintf(g_sup_peer, sizeof(g_sup_peer), "%s", env_or_default("MQTT_SUP_PEER", "192.168.178.50"));
+    snprintf(g_sup_route, sizeof(g_sup_route), "%s", env_or_default("MQTT_SUP_ROUTE", "192.168.4.0/24"));
+    if (getenv("MQTT_SUP_ROUTE") && !*getenv("MQTT_SUP_ROUTE")) g_sup_route[0] = '\0';
+    g_sup_hup_ms   = env_or_default_int("MQTT_SUP_HUP_MS", 4000);
+    g_sup_reset_ms = env_or_default_int("MQTT_SUP_RESET_MS", 15000);
+    g_sup_pulse_ms = env_or_default_int("MQTT_SUP_PULSE_MS", 120);
+    if (gateways_parse(getenv("MQTT_BROKERS")) > 0) {
+        g_fanin = 1;
+        g_writer_thread = 1;  // the network threads only enqueue
+    } else {
+        g_gw_n = 1;
+        snprintf(g_gw[0].name, sizeof(g_gw[0].name), "%s", env_or_default("MQTT_GATEWAY_NAME", g_broker_host));
+        snprintf(g_gw[0].host, sizeof(g_gw[0].host), "%s", g_broker_host);
+        g_gw[0].port = g_broker_port;
+    }
+    for (int i = 0; i < g_gw_n; ++i) {
+        g_gw[i].on_link = strcmp(g_gw[i].host, g_sup_peer) == 0;
+        g_sup.broker_on_link |= g_gw[i].on_link;
+    }
+    init_log_inserts();
 
     install_sig_handlers();
 
+    if (g_rules_path[0] && rules_load(g_rules_path) != 0) {
+        fprintf(stderr, "Failed to load rules from %s\n", g_rules_path);
+        return 1;
+    }
+
     if (db_init(g_db_path) != 0) {
         fprintf(stderr, "Failed to init DB at %s\n", g_db_path);
         return 1;
     }
+    g_maint_next_ms = now_ms() + 5000;  // first pass shortly after start
+    if (retention_enabled()) {
+        char buf[200];
+        snprintf(buf, sizeof(buf), "Retention: %d prefix rule(s), default %d days, rollup_1m %d days; pass every %d s, budget %d ms",
+                 g_retention_n, g_retention_default_days, g_rollup_1m_days, g_maint_every_s, g_maint_budget_ms);
+        log_ts("INFO", buf);
+        if (db_pragma_int("PRAGMA auto_vacuum;") != 2) {
+            log_ts("INFO", "auto_vacuum is not INCREMENTAL on this file; run 'VACUUM' once (offline) to reclaim space incrementally");
+        }
+    }
+    if (g_archive_after_days > 0) {
+        char buf[160];
+        snprintf(buf, sizeof(buf), "Archive: numeric rows older than %d day(s) go to archive_blocks (closed UTC days)",
+                 g_archive_after_days);
+        log_ts("INFO", buf);
+    }
+    if (g_batch_max > 1) {
+        char buf[160];
+        snprintf(buf, sizeof(buf), "Batched inserts: up to %d rows or %d ms per transaction", g_batch_max, g_batch_ms);
+        log_ts("INFO", buf);
+    }
+    if (g_writer_thread) {
+        if (writer_start() != 0) { db_close(); return 1; }
+        char buf[160];
+        snprintf(buf, sizeof(buf), "Writer thread: queue %d x %d bytes, policy=%s",
+                 g_queue_cap, g_queue_slot, g_queue_block ? "block" : "drop-oldest");
+        log_ts("INFO", buf);
+    }
+
+    if (g_sup_enabled) {
+        if (sup_start() != 0) { if (g_writer_thread) writer_stop(); db_close(); return 1; }
+        char buf[256];
+        snprintf(buf, sizeof(buf), "Supervisor: watching %s; pppd restart after %d ms, hard reset via %s after %d ms%s",
+                 g_sup_ifname, g_sup_hup_ms, g_sup_dev, g_sup_reset_ms,
+                 g_sup.broker_on_link ? "; broker is the peer" : "");
+        log_ts("INFO", buf);
+    }
 
     mosquitto_lib_init();
 
+    int rc;
     const char *cid_env = getenv("MQTT_CLIENT_ID");
     char cid_buf[64];
     if (!cid_env || !*cid_env) {
@@ -295,11 +2632,16 @@ int main(void) {
         cid_env = cid_buf;
     }
 
-    g_mosq = mosquitto_new(cid_env, true, NULL);
+    if (g_fanin) {
+        rc = fanin_run(cid_env);
+        storage_shutdown();
+        return rc;
+    }
+
+    g_mosq = mosquitto_new(cid_env, true, &g_gw[0]);
     if (!g_mosq) {
         fprintf(stderr, "mosquitto_new failed\n");
-        db_close();
-        mosquitto_lib_cleanup();
+        storage_shutdown();
         return 1;
     }
 
@@ -311,7 +2653,7 @@ int main(void) {
     mosquitto_reconnect_delay_set(g_mosq, true, g_reconnect_min, g_reconnect_max);
 
     // Initial connect (non-fatal on failure)
-    int rc = mosquitto_connect(g_mosq, g_broker_host, g_broker_port, 30);
+    rc = mosquitto_connect(g_mosq, g_broker_host, g_broker_port, 30);
     if (rc != MOSQ_ERR_SUCCESS) {
         char buf[160];
         snprintf(buf, sizeof(buf), "Initial connect failed: %s", mosquitto_strerror(rc));
@@ -319,9 +2661,27 @@ int main(void) {
     }
 
     // Manual loop: keep going until signaled to stop.
+    // With the writer thread, SQLite (and its batch timer) belongs to that thread.
     int backoff = g_reconnect_min;
+    unsigned sup_down_seen = atomic_load(&g_sup.down_epoch);
     while (!g_should_stop) {
-        rc = mosquitto_loop(g_mosq, /*timeout_ms*/ 1000, /*max_packets*/ 1);
+        if (g_sup_enabled && g_sup.broker_on_link && atomic_load(&g_sup.down_epoch) != sup_down_seen) {
+            // The TCP session through a dead link would only time out with the keepalive.
+            sup_down_seen = atomic_load(&g_sup.down_epoch);
+            log_ts("WARN", "Supervisor: link lost, dropping the MQTT session");
+            mosquitto_disconnect(g_mosq);
+        }
+        rc = mosquitto_loop(g_mosq, /*timeout_ms*/ g_writer_thread ? 1000 : db_batch_wait_ms(1000), /*max_packets*/ 1);
+        // H_LOOP: the work between two waits, not the idle wait itself
+        long long loop_t0 = now_us();
+        if (!g_writer_thread) {
+            db_batch_maybe_flush();
+            if (rc == MOSQ_ERR_SUCCESS) maint_maybe_run();
+            replica_maybe_step();
+        }
+        metrics_maybe_export(rc == MOSQ_ERR_SUCCESS);
+        if (g_writer_thread) queue_maybe_warn();
+        hist_add(H_LOOP, now_us() - loop_t0);
         if (rc == MOSQ_ERR_SUCCESS) {
             // Healthy loop iteration.
             backoff = g_reconnect_min; // reset backoff on success
@@ -333,6 +2693,35 @@ int main(void) {
         snprintf(buf, sizeof(buf), "mosquitto_loop error: %s", mosquitto_strerror(rc));
         log_ts("WARN", buf);
 
+        // Don't hold rows in an open transaction while we are offline.
+        if (!g_writer_thread) db_batch_flush();
+
+        if (g_sup_enabled) {
+            // Reconnect as soon as the link is back; retry meanwhile with a short,
+            // growing backoff (the supervisor thread handles pppd and the Wemos).
+            int wait_ms = 0;
+            while (!g_should_stop) {
+                unsigned up_seen = atomic_load(&g_sup.up_epoch);
+                if (atomic_load(&g_sup.link_up) || !g_sup.broker_on_link) {
+                    int rc2 = mosquitto_reconnect(g_mosq);
+                    if (rc2 == MOSQ_ERR_SUCCESS) {
+                        CTR_INC(reconnects);
+                        log_ts("INFO", "Reconnected successfully.");
+                        break;
+                    }
+                    CTR_INC(reconnect_failures);
+                    wait_ms = wait_ms ? wait_ms * 2 : 100;
+                    if (wait_ms > g_reconnect_max * 1000) wait_ms = g_reconnect_max * 1000;
+                    snprintf(buf, sizeof(buf), "Reconnect failed: %s. Retrying in %d ms or on link up…",
+                             mosquitto_strerror(rc2), wait_ms);
+                    log_ts("WARN", buf);
+                }
+                if (sup_wait_up(up_seen, wait_ms ? wait_ms : g_reconnect_max * 1000)) wait_ms = 0;
+            }
+            sup_down_seen = atomic_load(&g_sup.down_epoch);
+            continue;
+        }
+
         // Try to repair network; then sleep a bit for routes/ppp to settle.
         run_network_repair_script();
 
@@ -347,11 +2736,13 @@ int main(void) {
         while (!g_should_stop) {
             int rc2 = mosquitto_reconnect(g_mosq);
             if (rc2 == MOSQ_ERR_SUCCESS) {
+                CTR_INC(reconnects);
                 log_ts("INFO", "Reconnected successfully.");
                 backoff = g_reconnect_min;
                 break; // back to main loop; subscribe happens in on_connect
             }
 
+            CTR_INC(reconnect_failures);
             snprintf(buf, sizeof(buf), "Reconnect failed: %s. Retrying in %d s…",
                      mosquitto_strerror(rc2), backoff);
             log_ts("WARN", buf);
@@ -367,8 +2758,7 @@ int main(void) {
     log_ts("INFO", "Shutting down…");
     mosquitto_disconnect(g_mosq);
     mosquitto_destroy(g_mosq);
-    mosquitto_lib_cleanup();
-    db_close();
+    storage_shutdown();
     return 0;
 }
 
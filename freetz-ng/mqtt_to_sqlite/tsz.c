@@ -0,0 +1,192 @@
+// tsz.c
+// Gorilla-style series compression, see tsz.h for the format.
+
+#include "tsz.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* ---------- Bit I/O ---------- */
+
+static int put_bits(tsz_enc_t *e, uint64_t v, int nbits) {
+    size_t need = (e->bits + (size_t)nbits + 7) / 8;
+    if (need > e->cap) {
+        size_t cap = e->cap ? e->cap * 2 : 256;
+        while (cap < need) cap *= 2;
+        uint8_t *p = realloc(e->buf, cap);
+        if (!p) return -1;
+        memset(p + e->cap, 0, cap - e->cap);
+        e->buf = p;
+        e->cap = cap;
+    }
+    while (nbits > 0) {
+        size_t byte = e->bits / 8;
+        int free_bits = 8 - (int)(e->bits % 8);
+        int take = nbits < free_bits ? nbits : free_bits;
+        uint8_t chunk = (uint8_t)((v >> (nbits - take)) & ((1u << take) - 1));
+        e->buf[byte] |= (uint8_t)(chunk << (free_bits - take));
+        e->bits += (size_t)take;
+        nbits -= take;
+    }
+    return 0;
+}
+
+static int get_bits(tsz_dec_t *d, int nbits, uint64_t *out) {
+    if (d->pos + (size_t)nbits > d->bits) return -1;
+    uint64_t v = 0;
+    while (nbits > 0) {
+        size_t byte = d->pos / 8;
+        int avail = 8 - (int)(d->pos % 8);
+        int take = nbits < avail ? nbits : avail;
+        uint8_t chunk = (uint8_t)((d->buf[byte] >> (avail - take)) & ((1u << take) - 1));
+        v = (v << take) | chunk;
+        d->pos += (size_t)take;
+        nbits -= take;
+    }
+    *out = v;
+    return 0;
+}
+
+static int clz64(uint64_t x) { int n = 0; while (!(x & (1ull << 63))) { x <<= 1; n++; } return n; }
+static int ctz64(uint64_t x) { int n = 0; while (!(x & 1)) { x >>= 1; n++; } return n; }
+
+/* ---------- Encoder ---------- */
+
+int tsz_enc_init(tsz_enc_t *e) {
+    memset(e, 0, sizeof(*e));
+    e->lead = -1;
+    e->bits = TSZ_HEADER * 8;
+    return put_bits(e, 0, 0);
+}
+
+static int enc_ts(tsz_enc_t *e, int64_t t) {
+    int64_t d = t - e->t_prev;
+    int64_t dod = d - e->d_prev;
+    e->t_prev = t;
+    e->d_prev = d;
+    if (dod == 0)                      return put_bits(e, 0, 1);
+    if (dod >= -63 && dod <= 64)       return put_bits(e, 2, 2) || put_bits(e, (uint64_t)(dod + 63), 7);
+    if (dod >= -255 && dod <= 256)     return put_bits(e, 6, 3) || put_bits(e, (uint64_t)(dod + 255), 9);
+    if (dod >= -2047 && dod <= 2048)   return put_bits(e, 14, 4) || put_bits(e, (uint64_t)(dod + 2047), 12);
+    if (dod < INT32_MIN || dod > INT32_MAX) return -1;
+    return put_bits(e, 15, 4) || put_bits(e, (uint64_t)(uint32_t)(int32_t)dod, 32);
+}
+
+static int enc_value(tsz_enc_t *e, uint64_t bits) {
+    uint64_t x = bits ^ e->v_prev;
+    e->v_prev = bits;
+    if (!x) return put_bits(e, 0, 1);
+    int lead = clz64(x), trail = ctz64(x);
+    if (lead > 31) lead = 31;  // 5-bit field
+    if (e->lead >= 0 && lead >= e->lead && trail >= e->trail) {
+        int sig = 64 - e->lead - e->trail;
+        return put_bits(e, 2, 2) || put_bits(e, x >> e->trail, sig);
+    }
+    int sig = 64 - lead - trail;
+    e->lead = lead;
+    e->trail = trail;
+    return put_bits(e, 3, 2) || put_bits(e, (uint64_t)lead, 5) || put_bits(e, (uint64_t)(sig - 1), 6) ||
+           put_bits(e, x >> trail, sig);
+}
+
+int tsz_enc_add(tsz_enc_t *e, int64_t t, double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    if (e->n == 0) {
+        if (put_bits(e, (uint64_t)t, 64) || put_bits(e, bits, 64)) return -1;
+        e->t_prev = t;
+        e->v_prev = bits;
+    } else {
+        if (t < e->t_prev) return -1;
+        if (enc_ts(e, t) || enc_value(e, bits)) return -1;
+    }
+    e->n++;
+    return 0;
+}
+
+const uint8_t *tsz_enc_finish(tsz_enc_t *e, size_t *len) {
+    if (put_bits(e, 0, 0) || !e->buf) return NULL;
+    e->buf[0] = TSZ_VERSION;
+    for (int i = 0; i < 4; ++i) e->buf[1 + i] = (uint8_t)(e->n >> (8 * i));
+    *len = (e->bits + 7) / 8;
+    return e->buf;
+}
+
+void tsz_enc_free(tsz_enc_t *e) {
+    free(e->buf);
+    memset(e, 0, sizeof(*e));
+}
+
+/* ---------- Decoder ---------- */
+
+int tsz_dec_init(tsz_dec_t *d, const void *data, size_t len) {
+    memset(d, 0, sizeof(*d));
+    const uint8_t *p = data;
+    if (!p || len < TSZ_HEADER || p[0] != TSZ_VERSION) return -1;
+    d->buf = p;
+    d->bits = len * 8;
+    d->pos = TSZ_HEADER * 8;
+    for (int i = 0; i < 4; ++i) d->n |= (uint32_t)p[1 + i] << (8 * i);
+    d->lead = -1;
+    return 0;
+}
+
+uint32_t tsz_dec_count(const tsz_dec_t *d) { return d->n; }
+
+static int dec_ts(tsz_dec_t *d) {
+    static const struct { int bits; int64_t bias; } W[] = { { 7, 63 }, { 9, 255 }, { 12, 2047 } };
+    uint64_t b, raw;
+    int64_t dod = 0;
+    int k = 0;
+    // count leading 1s of the prefix: 0..4
+    while (k < 4) {
+        if (get_bits(d, 1, &b)) return -1;
+        if (!b) break;
+        k++;
+    }
+    if (k >= 1 && k <= 3) {
+        if (get_bits(d, W[k - 1].bits, &raw)) return -1;
+        dod = (int64_t)raw - W[k - 1].bias;
+    } else if (k == 4) {
+        if (get_bits(d, 32, &raw)) return -1;
+        dod = (int32_t)(uint32_t)raw;
+    }
+    d->d_prev += dod;
+    d->t_prev += d->d_prev;
+    return 0;
+}
+
+static int dec_value(tsz_dec_t *d) {
+    uint64_t b, x;
+    if (get_bits(d, 1, &b)) return -1;
+    if (!b) return 0;
+    if (get_bits(d, 1, &b)) return -1;
+    if (b) {
+        uint64_t lead, sig1;
+        if (get_bits(d, 5, &lead) || get_bits(d, 6, &sig1)) return -1;
+        d->lead = (int)lead;
+        d->trail = 64 - (int)lead - (int)sig1 - 1;
+        if (d->trail < 0) return -1;
+    } else if (d->lead < 0) {
+        return -1;
+    }
+    int sig = 64 - d->lead - d->trail;
+    if (get_bits(d, sig, &x)) return -1;
+    d->v_prev ^= x << d->trail;
+    return 0;
+}
+
+int tsz_dec_next(tsz_dec_t *d, int64_t *t, double *v) {
+    if (d->i >= d->n) return 0;
+    if (d->i == 0) {
+        uint64_t tb;
+        if (get_bits(d, 64, &tb) || get_bits(d, 64, &d->v_prev)) return -1;
+        d->t_prev = (int64_t)tb;
+    } else if (dec_ts(d) || dec_value(d)) {
+        return -1;
+    }
+    d->i++;
+    *t = d->t_prev;
+    memcpy(v, &d->v_prev, sizeof(*v));
+    return 1;
+}
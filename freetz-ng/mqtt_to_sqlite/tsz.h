@@ -0,0 +1,59 @@
+// tsz.h
+// Compressed (timestamp, value) series in the style of Facebook's Gorilla:
+// delta-of-delta timestamps and XOR-compressed doubles in one bit stream.
+// Used for the archive blocks of mqtt_to_sqlite (archive_blocks.data).
+//
+// Block layout: u8 version (TSZ_VERSION), u32 point count (little endian),
+// then the bit stream, most significant bit first:
+//   first point   64-bit timestamp, 64-bit IEEE double
+//   timestamp     dod = (t - t_prev) - (t_prev - t_prev2), first delta against 0:
+//                   0                    '0'
+//                   [-63, 64]            '10'   + 7 bits
+//                   [-255, 256]          '110'  + 9 bits
+//                   [-2047, 2048]        '1110' + 12 bits
+//                   otherwise            '1111' + 32 bits (two's complement)
+//   value         x = bits(v) ^ bits(v_prev):
+//                   x == 0               '0'
+//                   fits previous window '10'  + meaningful bits
+//                   otherwise            '11'  + 5 bits leading zeros
+//                                              + 6 bits (meaningful length - 1) + meaningful bits
+
+#ifndef TSZ_H
+#define TSZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum { TSZ_VERSION = 1, TSZ_HEADER = 5 };
+
+typedef struct {
+    uint8_t  *buf;
+    size_t    cap, bits;
+    uint32_t  n;
+    int64_t   t_prev, d_prev;
+    uint64_t  v_prev;
+    int       lead, trail;   // current XOR window, lead < 0 = none yet
+} tsz_enc_t;
+
+typedef struct {
+    const uint8_t *buf;
+    size_t         bits, pos;
+    uint32_t       n, i;
+    int64_t        t_prev, d_prev;
+    uint64_t       v_prev;
+    int            lead, trail;
+} tsz_dec_t;
+
+// Encoder: timestamps must not decrease. Regular series (fixed interval,
+// slowly changing values) take about 2 bits per point.
+int  tsz_enc_init(tsz_enc_t *e);
+int  tsz_enc_add(tsz_enc_t *e, int64_t t, double v);  // 0, or -1 (no memory / dod beyond 32 bits)
+const uint8_t *tsz_enc_finish(tsz_enc_t *e, size_t *len);  // valid until tsz_enc_free()
+void tsz_enc_free(tsz_enc_t *e);
+
+// Decoder over a block; the buffer must outlive it.
+int  tsz_dec_init(tsz_dec_t *d, const void *data, size_t len);  // 0, or -1 (not a block)
+int  tsz_dec_next(tsz_dec_t *d, int64_t *t, double *v);        // 1 = point, 0 = end, -1 = corrupt
+uint32_t tsz_dec_count(const tsz_dec_t *d);
+
+#endif
@@ -0,0 +1,74 @@
+// wemos_reset.c
+// DTR/RTS reset sequence shared by reset_wemos and mqtt_to_sqlite (see wemos_reset.h).
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "wemos_reset.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef TIOCMGET
+#  include <sys/ttycom.h>
+#endif
+
+#ifndef TIOCM_DTR
+#  define TIOCM_DTR 0x002
+#endif
+#ifndef TIOCM_RTS
+#  define TIOCM_RTS 0x004
+#endif
+#ifndef TIOCMGET
+#  define TIOCMGET 0x5415
+#endif
+#ifndef TIOCMSET
+#  define TIOCMSET 0x5418
+#endif
+
+static void msleep(unsigned ms) {
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000UL;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+}
+
+int wemos_reset_fd(int fd, unsigned pulse_ms, unsigned settle_ms) {
+    // Get current modem control state
+    int mstate = 0;
+    if (ioctl(fd, TIOCMGET, &mstate) < 0) return -errno;
+
+    // Step 1: Deassert DTR to keep GPIO0 HIGH (normal run mode)
+    mstate &= ~TIOCM_DTR;
+    if (ioctl(fd, TIOCMSET, &mstate) < 0) return -errno;
+    if (settle_ms) msleep(settle_ms);
+
+    // Step 2: Pulse RTS to reset (assert -> delay -> deassert)
+    // Asserting RTS (through the inverter) pulls RESET low.
+    mstate |= TIOCM_RTS;
+    if (ioctl(fd, TIOCMSET, &mstate) < 0) return -errno;
+    msleep(pulse_ms);
+
+    mstate &= ~TIOCM_RTS;
+    int rc = ioctl(fd, TIOCMSET, &mstate) < 0 ? -errno : 0;
+    if (rc == 0 && settle_ms) msleep(settle_ms);
+    return rc;
+}
+
+int wemos_reset(const char *dev, unsigned pulse_ms, unsigned settle_ms) {
+    // Open without becoming controlling TTY; read/write not strictly needed but harmless.
+    int fd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) return -errno;
+
+    // Clear O_NONBLOCK after open so ioctls behave normally.
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0) fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    int rc = wemos_reset_fd(fd, pulse_ms, settle_ms);
+    close(fd);
+    return rc;
+}
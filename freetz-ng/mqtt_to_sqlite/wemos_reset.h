@@ -0,0 +1,19 @@
+// wemos_reset.h
+// Hard reset of a WeMos D1/ESP8266 through the DTR/RTS lines of its USB-serial
+// adapter (DTR -> GPIO0, RTS -> RESET via the usual auto-reset transistors).
+// Used by the reset_wemos tool and by the mqtt_to_sqlite supervisor.
+
+#ifndef WEMOS_RESET_H
+#define WEMOS_RESET_H
+
+// Release DTR (GPIO0 high = normal boot) and pulse RTS for pulse_ms on an open
+// tty. settle_ms is waited after each of the two steps (0 = no wait; the ESP
+// only samples GPIO0 when RESET is released, pulse_ms after DTR).
+// Returns 0, or -errno of the failing ioctl; the line state is left released.
+int wemos_reset_fd(int fd, unsigned pulse_ms, unsigned settle_ms);
+
+// Same on a device path. The tty is opened O_NOCTTY alongside pppd, if it is
+// running: the modem lines belong to the port, not to one file descriptor.
+int wemos_reset(const char *dev, unsigned pulse_ms, unsigned settle_ms);
+
+#endif
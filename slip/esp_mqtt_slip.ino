@@ -31,6 +31,31 @@ extern "C" {
 #endif
 static bool napt_inited = false;
 
+// NAPT itself is a black box (its timeouts are compiled into lwIP), so a flow
+// tracker on the SLIP netif mirrors its table: translated flows (source port in
+// NAPT's range) are keyed by NAT port and remote end, one slot per flow, same
+// capacity as NAPT. Keep the TTLs in line with lwIP's IP_NAPT_TIMEOUT_MS_*.
+#ifndef NAPT_TTL_TCP_S
+#define NAPT_TTL_TCP_S     1800   // established TCP
+#endif
+#ifndef NAPT_TTL_TCP_FIN_S
+#define NAPT_TTL_TCP_FIN_S 20     // after FIN/RST
+#endif
+#ifndef NAPT_TTL_UDP_S
+#define NAPT_TTL_UDP_S     2
+#endif
+#define NAPT_PORT_FIRST    49152  // IP_NAPT_PORT_RANGE_START
+#define FLOW_SLOTS         IP_NAPT_MAX
+#define FLOW_PROBE         8      // linear probe window per key
+
+// ===== Performance profile =====
+// 0 = power (80 MHz, light sleep), 1 = auto: 160 MHz and no sleep while NAT
+// forwards traffic, back to power after PERF_IDLE_MS, 2 = always performance.
+#ifndef PERF_PROFILE
+#define PERF_PROFILE 1
+#endif
+#define PERF_IDLE_MS 10000
+
 char ap_ssid[MAX_SSID+1] = "APSSID";
 char ap_pass[MAX_PASS+1] = "APPW12345670";
 const int AP_CHAN = 6;
@@ -61,6 +86,115 @@ public:
 // ===== SLIP bits =====
 static struct netif slip_netif;
 static bool slip_started = false;
+static netif_output_fn slip_ip_output = nullptr;   // lwIP's etharp-less SLIP output
+static netif_input_fn  slip_ip_input  = nullptr;   // ip_input
+
+// ===== NAT flow tracker =====
+struct Flow {
+  uint32_t key;       // 0 = free
+  uint16_t last_s;    // seconds since boot, wrapping
+  uint8_t  proto;
+  uint8_t  fin;       // TCP FIN/RST seen: short TTL
+};
+static Flow     flows[FLOW_SLOTS];
+static uint16_t flows_live = 0, flows_hwm = 0, flows_sweep = 0;
+static uint32_t flows_new = 0, flows_evicted = 0, flows_expired = 0;
+static uint32_t nat_miss = 0, nat_out_pkts = 0, nat_in_pkts = 0;
+static unsigned long fwd_last_ms = 0;
+static bool perf_on = false;                      // performance profile active
+
+static inline uint16_t nowS() { return (uint16_t)(millis() / 1000); }
+
+static uint16_t flowTtl(const Flow& f) {
+  if (f.proto == 6) return f.fin ? NAPT_TTL_TCP_FIN_S : NAPT_TTL_TCP_S;
+  return NAPT_TTL_UDP_S;
+}
+static bool flowExpired(const Flow& f, uint16_t now) { return (uint16_t)(now - f.last_s) > flowTtl(f); }
+
+static uint32_t flowKey(uint8_t proto, uint16_t natPort, uint32_t remote, uint16_t rport) {
+  uint32_t h = 2166136261u;                      // FNV-1a over the tuple
+  const uint8_t b[9] = { proto, (uint8_t)(natPort >> 8), (uint8_t)natPort,
+                         (uint8_t)(remote >> 24), (uint8_t)(remote >> 16), (uint8_t)(remote >> 8), (uint8_t)remote,
+                         (uint8_t)(rport >> 8), (uint8_t)rport };
+  for (uint8_t c : b) { h ^= c; h *= 16777619u; }
+  return h ? h : 1;
+}
+
+// Outbound: refresh or insert (evicting the stalest slot in the window when full).
+static void flowTouch(uint32_t key, uint8_t proto, bool fin) {
+  const uint16_t now = nowS();
+  Flow* hit = nullptr; Flow* freeSlot = nullptr; Flow* oldest = nullptr;
+  for (uint16_t i = 0; i < FLOW_PROBE; ++i) {
+    Flow& f = flows[(key + i) % FLOW_SLOTS];
+    if (f.key == key) { hit = &f; break; }
+    if (!f.key || flowExpired(f, now)) { if (!freeSlot) freeSlot = &f; continue; }
+    if (!oldest || (uint16_t)(now - f.last_s) > (uint16_t)(now - oldest->last_s)) oldest = &f;
+  }
+  if (!hit) {
+    if (freeSlot) {
+      if (freeSlot->key) flows_expired++; else flows_live++;
+      hit = freeSlot;
+    } else {
+      hit = oldest; flows_evicted++;
+    }
+    hit->key = key; hit->proto = proto; hit->fin = 0;
+    flows_new++;
+    if (flows_live > flows_hwm) flows_hwm = flows_live;
+  }
+  hit->last_s = now;
+  if (fin) hit->fin = 1;
+}
+
+// Inbound: a packet for a NAT port without a live flow is a lookup miss.
+static void flowLookup(uint32_t key, bool fin) {
+  const uint16_t now = nowS();
+  for (uint16_t i = 0; i < FLOW_PROBE; ++i) {
+    Flow& f = flows[(key + i) % FLOW_SLOTS];
+    if (f.key == key && !flowExpired(f, now)) { f.last_s = now; if (fin) f.fin = 1; return; }
+  }
+  nat_miss++;
+}
+
+// Frees expired slots a few at a time so flows_live tracks occupancy.
+void sweepFlows() {
+  const uint16_t now = nowS();
+  for (uint8_t n = 0; n < 32; ++n) {
+    Flow& f = flows[flows_sweep];
+    flows_sweep = (flows_sweep + 1) % FLOW_SLOTS;
+    if (f.key && flowExpired(f, now)) { f.key = 0; flows_live--; flows_expired++; }
+  }
+}
+
+// Returns false if p is not TCP/UDP on a NAPT port; fills the tuple otherwise.
+static bool parseFlow(const pbuf* p, bool outbound, uint32_t* key, uint8_t* proto, bool* fin) {
+  if (!p || p->len < 20) return false;
+  const uint8_t* ip = (const uint8_t*)p->payload;
+  const uint8_t ihl = (ip[0] & 0x0F) * 4;
+  if ((ip[0] >> 4) != 4 || p->len < ihl + 14) return false;
+  *proto = ip[9];
+  if (*proto != 6 && *proto != 17) return false;
+  const uint8_t* l4 = ip + ihl;
+  const uint16_t sport = (l4[0] << 8) | l4[1], dport = (l4[2] << 8) | l4[3];
+  const uint32_t remote = outbound ? ((uint32_t)ip[16] << 24 | (uint32_t)ip[17] << 16 | ip[18] << 8 | ip[19])
+                                   : ((uint32_t)ip[12] << 24 | (uint32_t)ip[13] << 16 | ip[14] << 8 | ip[15]);
+  const uint16_t natPort = outbound ? sport : dport, rport = outbound ? dport : sport;
+  if (natPort < NAPT_PORT_FIRST) return false;     // the ESP's own sockets (broker, web)
+  *fin = (*proto == 6) && (l4[13] & 0x05);          // FIN or RST
+  *key = flowKey(*proto, natPort, remote, rport);
+  return true;
+}
+
+static err_t slipOutputTracked(struct netif* n, struct pbuf* p, const ip4_addr_t* ipaddr) {
+  uint32_t key; uint8_t proto; bool fin;
+  if (parseFlow(p, true, &key, &proto, &fin)) { flowTouch(key, proto, fin); nat_out_pkts++; fwd_last_ms = millis(); }
+  return slip_ip_output(n, p, ipaddr);
+}
+
+static err_t slipInputTracked(struct pbuf* p, struct netif* n) {
+  uint32_t key; uint8_t proto; bool fin;
+  if (parseFlow(p, false, &key, &proto, &fin)) { flowLookup(key, fin); nat_in_pkts++; fwd_last_ms = millis(); }
+  return slip_ip_input(p, n);
+}
 
 // lwIP expects a sio_fd_t for slipif
 static sio_fd_t slip_sio_fd;
@@ -92,21 +226,25 @@ void setupSLIP() {
   netif_set_link_up(&slip_netif);
   slip_started = true;
 
+  // observe NAT traffic on the WAN side: after translation out, before it in
+  slip_ip_output = slip_netif.output; slip_netif.output = slipOutputTracked;
+  slip_ip_input  = slip_netif.input;  slip_netif.input  = slipInputTracked;
+
   Serial1.println("[SLIP] interface up");
 
-  // ---- NAT enable on the SLIP (WAN) interface ----
+  // ---- NAT: translate what AP clients send out via SLIP ----
   if (!napt_inited) {
     ip_napt_init(IP_NAPT_MAX, IP_PORTMAP_MAX);
     napt_inited = true;
     Serial1.printf("[NAT] NAPT initialized (max=%d, portmaps=%d)\n", IP_NAPT_MAX, IP_PORTMAP_MAX);
   }
-  u32_t slip_addr = ip4_addr_get_u32(netif_ip4_addr(&slip_netif));
-  if (ip_napt_enable(slip_addr, 1) == ERR_OK) {
-    Serial1.printf("[NAT] enabled on SLIP address %s\n", ipaddr_ntoa(netif_ip_addr4(&slip_netif)));
+  // The NAPT flag belongs on the inside interface: packets received there are
+  // masqueraded to the address of the netif they leave through (SLIP).
+  if (ip_napt_enable_no(SOFTAP_IF, 1) == ERR_OK) {
+    Serial1.printf("[NAT] enabled for AP clients via SLIP address %s\n", ipaddr_ntoa(netif_ip_addr4(&slip_netif)));
   } else {
     Serial1.println("[NAT] enable failed");
   }
-  Serial1.println("[NAT] enabled on SLIP (outbound masquerade)");
 }
 
 // ===== Web server =====
@@ -143,6 +281,15 @@ void handleRoot() {
   wifi_softap_free_station_info();
   html += "</ul>";
 
+  char nat[320];
+  snprintf(nat, sizeof(nat),
+           "<h2>NAT</h2><pre>flows    %u / %u (peak %u)\nnew      %lu\nevicted  %lu\nexpired  %lu\n"
+           "in miss  %lu\npackets  out %lu, in %lu\nprofile  %s, %u MHz</pre>",
+           flows_live, (unsigned)FLOW_SLOTS, flows_hwm, (unsigned long)flows_new, (unsigned long)flows_evicted,
+           (unsigned long)flows_expired, (unsigned long)nat_miss, (unsigned long)nat_out_pkts, (unsigned long)nat_in_pkts,
+           perf_on ? "performance" : "power", (unsigned)system_get_cpu_freq());
+  html += nat;
+
   html += "<h2>Set AP Parameters</h2>";
   html += "<form method='POST' action='/setap'>";
   html += "SSID: <input name='ssid' value='" + String(ap_ssid) + "'><br>";
@@ -199,6 +346,31 @@ void setupWeb() {
 }
 
 // ====== Power optimisation =====
+
+void setPerformance(bool on) {
+  perf_on = on;
+  system_update_cpu_freq(on ? 160 : 80);
+  wifi_set_sleep_type(on ? NONE_SLEEP_T : LIGHT_SLEEP_T);
+  Serial1.printf("[PERF] %s\n", on ? "160 MHz, no sleep" : "80 MHz, light sleep");
+}
+
+void serviceProfile() {
+#if PERF_PROFILE == 1
+  const bool busy = fwd_last_ms && (uint32_t)(millis() - fwd_last_ms) < PERF_IDLE_MS;
+  if (busy != perf_on) setPerformance(busy);
+#endif
+}
+
+void logNAT() {
+  static unsigned long last = 0;
+  if ((uint32_t)(millis() - last) < 30000) return;
+  last = millis();
+  Serial1.printf("[NAT] flows=%u/%u hwm=%u new=%lu evict=%lu exp=%lu miss=%lu out=%lu in=%lu cpu=%u\n",
+                 flows_live, (unsigned)FLOW_SLOTS, flows_hwm, (unsigned long)flows_new, (unsigned long)flows_evicted,
+                 (unsigned long)flows_expired, (unsigned long)nat_miss, (unsigned long)nat_out_pkts,
+                 (unsigned long)nat_in_pkts, (unsigned)system_get_cpu_freq());
+}
+
 void tuneAP() {
   softap_config conf{};
   wifi_softap_get_config(&conf);
@@ -217,11 +389,14 @@ void setup() {
   setupSLIP();
   setupMQTT();
   setupWeb();
-  wifi_set_sleep_type(LIGHT_SLEEP_T);
+  setPerformance(PERF_PROFILE == 2);
 }
 
 void loop() {
   // SLIP polling is handled by lwIP stack, nothing to do here for serial
   server.handleClient();
+  sweepFlows();
+  serviceProfile();
+  logNAT();
   yield();
 }
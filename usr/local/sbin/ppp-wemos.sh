@@ -1,4 +1,72 @@
 #!/bin/bash
-stty -F /dev/ttyUSB0 115200 -echo -ixon -ixoff -crtscts raw
-exec /usr/sbin/pppd /dev/ttyUSB0 call wemos
+# Start pppd to the Wemos; every dial first negotiates a faster line speed.
+#
+# The firmware starts at 115200 and, while PPP is down, answers "AT" with "OK"
+# and "AT+BAUD=<rate>" with "OK <rate>" before switching. The new speed is only
+# kept if we confirm it with "AT" at that speed; otherwise both sides use 115200.
+#
+# Run without arguments it starts pppd. /etc/ppp/peers/wemos runs it again as
+# "ppp-wemos.sh connect" (pppd's connect script, stdin/stdout on the tty) before
+# each dial, including the redials of "persist", so a Wemos that reset itself
+# to 115200 or still runs the rate of an earlier session is found again. pppd
+# is given no speed and keeps the one set here.
+#
+# WEMOS_DEV=/dev/ttyUSB0
+# WEMOS_BAUDS="921600 460800 230400"   # tried in order; "" = plain 115200
+# WEMOS_CRTSCTS=0                       # 1 only with RTS/CTS wired and PPP_HW_FLOW=1
+# WEMOS_PROBE_S=10                      # how long a dial looks for the device; more than
+#                                       # its LCP echo window, during which it ignores AT
 
+DEV=${WEMOS_DEV:-/dev/ttyUSB0}
+BASE=115200
+RATES=${WEMOS_BAUDS-"921600 460800 230400"}
+PROBE_S=${WEMOS_PROBE_S:-10}
+
+if [ "${WEMOS_CRTSCTS:-0}" = "1" ]; then
+    STTY_FLOW=crtscts;  PPP_FLOW=crtscts
+else
+    STTY_FLOW=-crtscts; PPP_FLOW=nocrtscts
+fi
+
+# at <rate> <command>: send one AT line at <rate>, print what comes back within 1 s
+# (connect mode: the tty is stdin and fd 3; stdout goes to the caller's grep)
+at() {
+    stty "$1" -echo -ixon -ixoff $STTY_FLOW raw || return 1
+    printf '%s\r' "$2" >&3
+    timeout 1 cat | tr -c '[:print:]\n' ' '
+}
+
+if [ "$1" = "connect" ]; then
+    exec 3>&1
+    speed=$BASE
+    cur=""
+    if [ -n "$RATES" ]; then
+        # Where is the device now? Right after a host-side restart it may still
+        # consider the link up and stay silent until its LCP echo gives up.
+        end=$(( $(date +%s) + PROBE_S ))
+        while [ -z "$cur" ] && [ "$(date +%s)" -lt "$end" ]; do
+            for r in $BASE $RATES; do
+                if at "$r" AT | grep -q OK; then cur=$r; break; fi
+            done
+        done
+
+        if [ -n "$cur" ]; then
+            for r in $RATES; do
+                if [ "$r" = "$cur" ]; then speed=$r; break; fi
+                if at "$cur" "AT+BAUD=$r" | grep -q "OK $r"; then
+                    if at "$r" AT | grep -q OK; then speed=$r; break; fi
+                    sleep 2       # unconfirmed: the device falls back to 115200
+                    cur=$BASE
+                fi
+            done
+        fi
+        logger -t ppp-wemos "line speed $speed (device was at ${cur:-unknown})" 2>/dev/null
+    fi
+    stty "$speed" -echo -ixon -ixoff $STTY_FLOW raw
+    exit 0
+fi
+
+export WEMOS_BAUDS="$RATES" WEMOS_CRTSCTS="${WEMOS_CRTSCTS:-0}" WEMOS_PROBE_S="$PROBE_S"
+stty -F "$DEV" "$BASE" -echo -ixon -ixoff $STTY_FLOW raw
+# Flow control after "call" overrides the one in /etc/ppp/peers/wemos.
+exec /usr/sbin/pppd "$DEV" call wemos $PPP_FLOW